@@ -0,0 +1,111 @@
+#include "batch_manifest.h"
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <set>
+
+namespace linux
+{
+
+namespace {
+
+std::string Trim(const std::string &s) {
+  std::string::size_type begin = s.find_first_not_of(" \t\r");
+  if(std::string::npos == begin) return std::string();
+
+  std::string::size_type end = s.find_last_not_of(" \t\r");
+  return s.substr(begin, end - begin + 1);
+}
+
+std::vector<std::string> Split(const std::string &s) {
+  std::vector<std::string> words;
+  std::istringstream in(s);
+  std::string word;
+  while(in >> word) words.push_back(word);
+  return words;
+}
+
+}
+
+std::vector<Component> ParseManifest(const std::string &file) {
+
+  std::ifstream in(file);
+  if(!in) {
+    throw std::runtime_error("Can't open manifest " + file);
+  }
+
+  std::vector<Component> components;
+  std::set<std::string> names;
+  std::string line;
+  int line_number = 0;
+
+  auto error = [&](const std::string &what) {
+    std::ostringstream message;
+    message << file << ":" << line_number << ": " << what;
+    return std::runtime_error(message.str());
+  };
+
+  while(std::getline(in, line)) {
+    ++line_number;
+
+    line = Trim(line);
+    if(line.empty() || '#' == line[0]) continue;
+
+    if('[' == line[0]) {
+      if(']' != line.back()) throw error("missing ']'");
+
+      Component component;
+      component.name = Trim(line.substr(1, line.size() - 2));
+      component.install_args.push_back("install");
+
+      if(component.name.empty()) throw error("empty component name");
+      if(!names.insert(component.name).second) {
+        throw error("duplicate component '" + component.name + "'");
+      }
+
+      components.push_back(component);
+      continue;
+    }
+
+    std::string::size_type equal = line.find('=');
+    if(std::string::npos == equal) throw error("expected 'key = value'");
+    if(components.empty()) throw error("'" + line + "' outside of a [component]");
+
+    std::string key   = Trim(line.substr(0, equal));
+    std::string value = Trim(line.substr(equal + 1));
+    Component &component = components.back();
+
+    if("dir" == key) {
+      component.dir = value;
+    } else if("build" == key) {
+      component.build_args = Split(value);
+    } else if("install" == key) {
+      component.install_args = Split(value);
+    } else if("depends" == key) {
+      component.depends = Split(value);
+    } else if(!key.empty()) {
+      component.control.push_back(std::make_pair(key, value));
+    } else {
+      throw error("empty key");
+    }
+  }
+
+  for(auto &component : components) {
+    if(component.dir.empty()) {
+      throw std::runtime_error(file + ": component '" + component.name +
+                               "' has no dir");
+    }
+
+    for(auto &dependency : component.depends) {
+      if(!names.count(dependency)) {
+        throw std::runtime_error(file + ": component '" + component.name +
+                                 "' depends on unknown '" + dependency + "'");
+      }
+    }
+  }
+
+  return components;
+}
+
+} /// ns infra
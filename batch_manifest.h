@@ -0,0 +1,51 @@
+
+#ifndef LINUX_BATCH_MANIFEST_H_
+#define LINUX_BATCH_MANIFEST_H_
+
+#include <string>
+#include <vector>
+#include <utility>
+
+namespace linux
+{
+
+/**
+ * @brief One component of a --batch manifest.
+ *
+ * The manifest is a list of sections:
+ *
+ *   # comment
+ *   [zlib]
+ *   dir          = /src/zlib
+ *   build        = -j4                 # optional, run concurrently
+ *   install      = install prefix=/usr # default 'install'
+ *   depends      = other-component ...
+ *   Version      = 1.2.13
+ *   Architecture = armhf
+ *   Maintainer   = Someone <someone@example.com>
+ *   Description  = compression library
+ *
+ * The section name is the package name, keys other than dir, build,
+ * install and depends become fields of DEBIAN/control.
+ */
+struct Component {
+  std::string                                      name;
+  std::string                                      dir;
+  std::vector<std::string>                         build_args;
+  std::vector<std::string>                         install_args;
+  std::vector<std::string>                         depends;
+  std::vector<std::pair<std::string, std::string> > control;
+};
+
+/**
+ * @brief read and check a manifest.
+ *
+ * @exception runtime_error with file and line if the manifest can't be
+ * read, is malformed, has duplicate components or depends on a
+ * component that isn't listed.
+ */
+std::vector<Component> ParseManifest(const std::string &file);
+
+} // end of linux ns
+
+#endif /* end of include guard: LINUX_BATCH_MANIFEST_H_ */
@@ -0,0 +1,541 @@
+#include "capture_store.h"
+#include "file_ops.h"
+#include "inotify.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <memory>
+#include <queue>
+#include <stdexcept>
+#include <system_error>
+
+namespace linux
+{
+
+namespace {
+
+const size_t kChunk  = 32 << 10;   /// deflated bytes read or written at once
+const size_t kFanIn  = 16;         /// runs of a level merged into one
+
+enum Op : char { kMovedAway = 0, kCreatedFile = 1, kCreatedDir = 2 };
+
+enum Flags : char { kCreated = 1, kDir = 2 };
+
+/**
+ * @brief what the records of a path did to how often it exists: a create
+ * is count + 1, a move away max(count - 1, 0). Any sequence of them is
+ * max(count + add, floor), and two sequences fold into one.
+ */
+struct Record {
+  std::string path;
+  int64_t     add;
+  int64_t     floor;
+  bool        created;   /// a create is among them
+  bool        is_dir;    /// of the latest create
+
+  bool exists() const { return std::max<int64_t>(this->add, this->floor) > 0; }
+};
+
+Record FromOp(const char *path, size_t length, char op) {
+  if(kMovedAway == op) {
+    return Record{ std::string(path, length), -1, 0, false, false };
+  }
+  return Record{ std::string(path, length), 1, 1, true, kCreatedDir == op };
+}
+
+/// later happened after earlier.
+void Fold(Record &earlier, const Record &later) {
+  earlier.floor   = std::max(earlier.floor + later.add, later.floor);
+  earlier.add    += later.add;
+  earlier.is_dir  = later.created ? later.is_dir : earlier.is_dir;
+  earlier.created = earlier.created || later.created;
+}
+
+/// a sorted stream of folded records, one per path.
+class Source {
+ public:
+  virtual ~Source() { }
+  virtual bool Next(Record &record) = 0;
+};
+
+/// the arena, sorted.
+class ArenaSource final : public Source {
+ public:
+  ArenaSource(const std::string &arena, const std::vector<size_t> &index)
+    : arena_(arena), index_(index), next_(0) {
+  }
+
+  bool Next(Record &record) override {
+    if(this->next_ >= this->index_.size()) return false;
+
+    record = this->At(this->next_++);
+    while(this->next_ < this->index_.size()) {
+      Record later = this->At(this->next_);
+      if(later.path != record.path) break;
+      Fold(record, later);
+      ++this->next_;
+    }
+    return true;
+  }
+
+ private:
+  Record At(size_t i) const {
+    const char *p = this->arena_.data() + this->index_[i];
+    uint64_t length;
+    GetVarint(p, this->arena_.data() + this->arena_.size(), length);
+    return FromOp(p, length, p[length]);
+  }
+
+  const std::string         &arena_;
+  const std::vector<size_t> &index_;
+  size_t                     next_;
+};
+
+/// front coded records, deflated:
+///   varint shared with the path before, varint length, rest of the
+///   path, zigzag add, varint floor, flags
+class RunWriter final {
+ public:
+  RunWriter(int fd, off_t offset)
+    : fd_(fd), offset_(offset), written_(0), records_(0) {
+    memset(&this->stream_, 0, sizeof(this->stream_));
+    if(Z_OK != deflateInit(&this->stream_, Z_BEST_SPEED)) {
+      throw std::runtime_error("Can't deflate the capture");
+    }
+  }
+
+  ~RunWriter() { deflateEnd(&this->stream_); }
+
+  void Add(const Record &record) {
+    size_t shared = 0;
+    size_t limit = std::min(record.path.size(), this->last_.size());
+    while(shared < limit && record.path[shared] == this->last_[shared]) {
+      ++shared;
+    }
+
+    PutVarint(this->raw_, shared);
+    PutVarint(this->raw_, record.path.size() - shared);
+    this->raw_.append(record.path, shared, std::string::npos);
+    PutVarint(this->raw_, (uint64_t(record.add) << 1) ^
+                          uint64_t(record.add >> 63));
+    PutVarint(this->raw_, uint64_t(record.floor));
+    this->raw_.push_back(char((record.created ? kCreated : 0) |
+                              (record.is_dir ? kDir : 0)));
+
+    this->last_ = record.path;
+    ++this->records_;
+
+    if(this->raw_.size() >= kChunk) this->Deflate(Z_NO_FLUSH);
+  }
+
+  /// @return the deflated size.
+  uint64_t Finish() {
+    this->Deflate(Z_FINISH);
+    return this->written_;
+  }
+
+  uint64_t records() const { return this->records_; }
+
+ private:
+  void Deflate(int flush) {
+    this->stream_.next_in  = reinterpret_cast<Bytef*>(&this->raw_[0]);
+    this->stream_.avail_in = uInt(this->raw_.size());
+
+    char out[kChunk];
+    int rc;
+    do {
+      this->stream_.next_out  = reinterpret_cast<Bytef*>(out);
+      this->stream_.avail_out = sizeof(out);
+      rc = deflate(&this->stream_, flush);
+
+      size_t produced = sizeof(out) - this->stream_.avail_out;
+      WriteAll(this->fd_, out, produced, this->offset_ + this->written_);
+      this->written_ += produced;
+    } while(0 == this->stream_.avail_out ||
+            (Z_FINISH == flush && Z_STREAM_END != rc));
+
+    this->raw_.clear();
+  }
+
+  int         fd_;
+  off_t       offset_;
+  uint64_t    written_;
+  uint64_t    records_;
+  z_stream    stream_;
+  std::string raw_;
+  std::string last_;
+};
+
+class RunReader final : public Source {
+ public:
+  RunReader(int fd, off_t offset, uint64_t size, uint64_t records)
+    : fd_(fd), offset_(offset), left_(size), records_(records),
+      in_(new char[kChunk]), out_(new char[kChunk]), pos_(0), end_(0) {
+    memset(&this->stream_, 0, sizeof(this->stream_));
+    if(Z_OK != inflateInit(&this->stream_)) {
+      throw std::runtime_error("Can't inflate the capture");
+    }
+  }
+
+  ~RunReader() { inflateEnd(&this->stream_); }
+
+  bool Next(Record &record) override {
+    if(0 == this->records_) return false;
+    --this->records_;
+
+    uint64_t shared = this->Varint(), length = this->Varint();
+    if(shared > this->last_.size()) throw Corrupt();
+
+    this->last_.resize(shared + length);
+    for(uint64_t i = 0; i < length; ++i) this->last_[shared + i] = this->Byte();
+
+    uint64_t add = this->Varint();
+    record.path    = this->last_;
+    record.add     = int64_t(add >> 1) ^ -int64_t(add & 1);
+    record.floor   = int64_t(this->Varint());
+    char flags     = this->Byte();
+    record.created = 0 != (flags & kCreated);
+    record.is_dir  = 0 != (flags & kDir);
+    return true;
+  }
+
+ private:
+  static std::runtime_error Corrupt() {
+    return std::runtime_error("The spilled capture is corrupt");
+  }
+
+  uint64_t Varint() {
+    uint64_t v = 0;
+    for(int shift = 0; shift < 64; shift += 7) {
+      char byte = this->Byte();
+      v |= uint64_t(byte & 0x7f) << shift;
+      if(!(byte & 0x80)) return v;
+    }
+    throw Corrupt();
+  }
+
+  char Byte() {
+    while(this->pos_ == this->end_) {
+      if(0 == this->stream_.avail_in) {
+        if(0 == this->left_) throw Corrupt();
+
+        size_t size = std::min<uint64_t>(this->left_, kChunk);
+        ssize_t nread = ::pread(this->fd_, this->in_.get(), size,
+                                this->offset_);
+        CHECK_LINUX_FUN_RETURN_OR_THROW(nread);
+        if(0 == nread) throw Corrupt();
+
+        this->offset_ += nread;
+        this->left_   -= nread;
+        this->stream_.next_in  = reinterpret_cast<Bytef*>(this->in_.get());
+        this->stream_.avail_in = uInt(nread);
+      }
+
+      this->stream_.next_out  = reinterpret_cast<Bytef*>(this->out_.get());
+      this->stream_.avail_out = kChunk;
+      int rc = inflate(&this->stream_, Z_NO_FLUSH);
+      if(Z_OK != rc && Z_STREAM_END != rc && Z_BUF_ERROR != rc) {
+        throw Corrupt();
+      }
+
+      this->pos_ = 0;
+      this->end_ = kChunk - this->stream_.avail_out;
+      if(Z_STREAM_END == rc && 0 == this->end_) throw Corrupt();
+    }
+
+    return this->out_[this->pos_++];
+  }
+
+  int                     fd_;
+  off_t                   offset_;
+  uint64_t                left_;
+  uint64_t                records_;
+  z_stream                stream_;
+  std::unique_ptr<char[]> in_;
+  std::unique_ptr<char[]> out_;
+  size_t                  pos_;
+  size_t                  end_;
+  std::string             last_;
+};
+
+/**
+ * @brief k-way merge of sources given oldest first, the records of a
+ * path fold in that order.
+ */
+class Merger final : public Source {
+ public:
+  explicit Merger(const std::vector<Source*> &sources)
+    : sources_(sources), heads_(sources.size()),
+      queue_(Later{ &this->heads_ }) {
+
+    for(size_t i = 0; i < this->sources_.size(); ++i) {
+      if(this->sources_[i]->Next(this->heads_[i])) this->queue_.push(i);
+    }
+  }
+
+  bool Next(Record &record) override {
+    if(this->queue_.empty()) return false;
+
+    size_t first = this->queue_.top();
+    this->queue_.pop();
+
+    record = this->heads_[first];
+    this->Advance(first);
+
+    while(!this->queue_.empty() &&
+          this->heads_[this->queue_.top()].path == record.path) {
+      size_t i = this->queue_.top();
+      this->queue_.pop();
+      Fold(record, this->heads_[i]);
+      this->Advance(i);
+    }
+    return true;
+  }
+
+ private:
+  /// by path, then the older source first.
+  struct Later {
+    const std::vector<Record> *heads;
+    bool operator()(size_t a, size_t b) const {
+      int order = (*heads)[a].path.compare((*heads)[b].path);
+      return order != 0 ? order > 0 : a > b;
+    }
+  };
+
+  void Advance(size_t i) {
+    if(this->sources_[i]->Next(this->heads_[i])) this->queue_.push(i);
+  }
+
+  std::vector<Source*>                                    sources_;
+  std::vector<Record>                                     heads_;
+  std::priority_queue<size_t, std::vector<size_t>, Later> queue_;
+};
+
+}
+
+/// what a Reader merges: the runs and the arena.
+struct CaptureStore::Reader::Sources {
+  std::vector<std::unique_ptr<RunReader> > runs;
+  std::unique_ptr<ArenaSource>             arena;
+  std::unique_ptr<Merger>                  merger;
+};
+
+CaptureStore::Reader::Reader(CaptureStore &store) : sources_(new Sources) {
+  store.SortArena();
+
+  std::vector<Source*> sources;
+  for(const Run &run : store.runs_) {
+    this->sources_->runs.emplace_back(new RunReader(store.fd_, run.offset,
+                                                    run.size, run.records));
+    sources.push_back(this->sources_->runs.back().get());
+  }
+
+  this->sources_->arena.reset(new ArenaSource(store.arena_, store.index_));
+  sources.push_back(this->sources_->arena.get());
+
+  this->sources_->merger.reset(new Merger(sources));
+}
+
+CaptureStore::Reader::~Reader() {
+}
+
+bool CaptureStore::Reader::Next(std::string &path, bool &is_dir) {
+  Record record;
+  while(this->sources_->merger->Next(record)) {
+    if(!record.exists()) continue;
+
+    path.swap(record.path);
+    is_dir = record.is_dir;
+    return true;
+  }
+  return false;
+}
+
+CaptureStore::CaptureStore(size_t budget, const std::string &temp_dir)
+  : budget_(budget), temp_dir_(temp_dir), sorted_(true), fd_(-1),
+    file_end_(0), records_(0), spills_(0), spilled_bytes_(0) {
+
+  if(this->temp_dir_.empty()) {
+    const char *tmpdir = getenv("TMPDIR");
+    this->temp_dir_ = nullptr != tmpdir && *tmpdir ? tmpdir : "/tmp";
+  }
+}
+
+CaptureStore::~CaptureStore() {
+  if(-1 != this->fd_) ::close(this->fd_);
+}
+
+void CaptureStore::AddCreated(const std::string &path, bool is_dir) {
+  this->index_.push_back(this->arena_.size());
+  PutVarint(this->arena_, path.size());
+  this->arena_ += path;
+  this->arena_.push_back(is_dir ? kCreatedDir : kCreatedFile);
+
+  this->sorted_ = false;
+  ++this->records_;
+
+  if(this->arena_.size() + this->index_.size() * sizeof(size_t) >=
+     this->budget_) {
+    this->Spill();
+  }
+}
+
+void CaptureStore::AddMovedAway(const std::string &path) {
+  this->index_.push_back(this->arena_.size());
+  PutVarint(this->arena_, path.size());
+  this->arena_ += path;
+  this->arena_.push_back(kMovedAway);
+
+  this->sorted_ = false;
+  ++this->records_;
+
+  if(this->arena_.size() + this->index_.size() * sizeof(size_t) >=
+     this->budget_) {
+    this->Spill();
+  }
+}
+
+void CaptureStore::AddEvents(const std::vector<InotifyEvent> &events) {
+
+  for(auto &event : events) {
+
+    if(IN_MOVED_FROM & event.mask()) {
+      this->AddMovedAway(CombineToFullPath(event.dir(), event.file()));
+      continue;
+    }
+
+    if(IN_CREATE & event.mask()) {
+      this->AddCreated(CombineToFullPath(event.dir(), event.file()),
+                       0 != (IN_ISDIR & event.mask()));
+    }
+  }
+}
+
+void CaptureStore::SortArena() {
+  if(this->sorted_) return;
+
+  const char *arena = this->arena_.data();
+  const char *end   = arena + this->arena_.size();
+  auto path = [arena, end](size_t offset, uint64_t &length) {
+    const char *p = arena + offset;
+    GetVarint(p, end, length);
+    return p;
+  };
+
+  /// stable, so the records of a path stay in the order they came.
+  std::stable_sort(this->index_.begin(), this->index_.end(),
+                   [&path](size_t a, size_t b) {
+                     uint64_t a_length, b_length;
+                     const char *a_path = path(a, a_length);
+                     const char *b_path = path(b, b_length);
+                     int order = memcmp(a_path, b_path,
+                                        std::min(a_length, b_length));
+                     return order != 0 ? order < 0 : a_length < b_length;
+                   });
+
+  this->sorted_ = true;
+}
+
+void CaptureStore::OpenTempFile() {
+  if(-1 != this->fd_) return;
+
+  this->fd_ = ::open(this->temp_dir_.c_str(),
+                     O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if(-1 != this->fd_) return;
+
+  /// no O_TMPFILE on this file system.
+  std::string name = this->temp_dir_ + "/miXpkg-capture.XXXXXX";
+  std::vector<char> temp(name.begin(), name.end());
+  temp.push_back('\0');
+
+  this->fd_ = ::mkostemp(temp.data(), O_CLOEXEC);
+  CHECK_LINUX_FUN_RETURN_OR_THROW(this->fd_);
+  ::unlink(temp.data());
+}
+
+void CaptureStore::Spill() {
+  this->OpenTempFile();
+  this->SortArena();
+
+  ArenaSource arena(this->arena_, this->index_);
+  RunWriter writer(this->fd_, this->file_end_);
+
+  /// with nothing older, a path that is gone is gone for good.
+  bool oldest = this->runs_.empty();
+  Record record;
+  while(arena.Next(record)) {
+    if(!oldest || record.exists()) writer.Add(record);
+  }
+
+  Run run{ this->file_end_, writer.Finish(), writer.records(), 0 };
+  this->runs_.push_back(run);
+  this->file_end_      += run.size;
+  this->spilled_bytes_ += run.size;
+  ++this->spills_;
+
+  this->arena_.clear();
+  this->index_.clear();
+  this->sorted_ = true;
+
+  /// size-tiered: 16 runs of a level make one of the next.
+  while(this->runs_.size() >= kFanIn) {
+    size_t first = this->runs_.size() - kFanIn;
+    if(this->runs_[first].level != this->runs_.back().level) break;
+    this->MergeTail(first);
+  }
+}
+
+void CaptureStore::MergeTail(size_t first) {
+
+  std::vector<std::unique_ptr<RunReader> > readers;
+  std::vector<Source*> sources;
+  for(size_t i = first; i < this->runs_.size(); ++i) {
+    const Run &run = this->runs_[i];
+    readers.emplace_back(new RunReader(this->fd_, run.offset, run.size,
+                                       run.records));
+    sources.push_back(readers.back().get());
+  }
+
+  RunWriter writer(this->fd_, this->file_end_);
+  bool oldest = 0 == first;
+
+  Merger merger(sources);
+  Record record;
+  while(merger.Next(record)) {
+    if(!oldest || record.exists()) writer.Add(record);
+  }
+
+  Run merged{ this->file_end_, writer.Finish(), writer.records(),
+              this->runs_.back().level + 1 };
+
+  /// give the space of the merged runs back, the file keeps its size.
+  /// Runs only ever go after the older ones, so all from the first
+  /// merged one to the new one is dead: one hole, or runs smaller than a
+  /// block would never free one.
+  off_t begin = this->runs_[first].offset;
+  ::fallocate(this->fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+              begin, this->file_end_ - begin);
+
+  this->runs_.resize(first);
+  this->runs_.push_back(merged);
+  this->file_end_      += merged.size;
+  this->spilled_bytes_ += merged.size;
+}
+
+void CaptureStore::ForEach(const Visitor &visit) {
+  Reader reader(*this);
+
+  std::string path;
+  bool is_dir;
+  while(reader.Next(path, is_dir)) {
+    if(!visit(path, is_dir)) return;
+  }
+}
+
+} /// ns infra
@@ -0,0 +1,145 @@
+
+#ifndef LINUX_CAPTURE_STORE_H_
+#define LINUX_CAPTURE_STORE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace linux
+{
+
+class InotifyEvent;
+
+/**
+ * @brief the paths an install created, kept in a bounded amount of
+ * memory however many there are.
+ *
+ * A path is appended to an arena as a few bytes plus the path. When the
+ * arena and its index outgrow the budget, the records are sorted by
+ * path and written to an unlinked temporary file as a run: front coded
+ * (a path only stores what differs from the one before) and deflated.
+ * Runs are merged size-tiered, 16 of a size into one, so a few dozen
+ * runs at most are read together.
+ *
+ * A move away doesn't search for the path, it is a record as well. When
+ * the records of a path meet, sorted or merged, they fold into one that
+ * says whether the path is still there.
+ */
+class CaptureStore final {
+ public:
+  static const size_t kDefaultBudget = 64 << 20;
+
+  /**
+   * @param budget bytes kept in memory before spilling.
+   * @param temp_dir where the temporary file goes once needed,
+   * $TMPDIR or /tmp if empty.
+   */
+  explicit CaptureStore(size_t budget = kDefaultBudget,
+                        const std::string &temp_dir = std::string());
+
+  ~CaptureStore();
+
+ private:
+  CaptureStore(const CaptureStore&) = delete;
+  CaptureStore& operator=(const CaptureStore&) = delete;
+
+ public:
+
+  /**
+   * @exception system_error if a run can't be written.
+   */
+  void AddCreated(const std::string &path, bool is_dir);
+
+  /// takes back one earlier AddCreated() of path, if there is one.
+  void AddMovedAway(const std::string &path);
+
+  /**
+   * @brief what an install did, as Inotify::ReadEvents() reports it:
+   * IN_CREATE adds the path, IN_MOVED_FROM moves it away.
+   *
+   * @exception system_error if a run can't be written.
+   */
+  void AddEvents(const std::vector<InotifyEvent> &events);
+
+  /// visit returns false to stop.
+  typedef std::function<bool(const std::string &path, bool is_dir)> Visitor;
+
+  /**
+   * @brief calls visit for every path that was created and not moved
+   * away since, once each, in path order. Paths may be added again
+   * afterwards.
+   *
+   * @exception system_error if a run can't be read. runtime_error if a
+   * run is corrupt.
+   */
+  void ForEach(const Visitor &visit);
+
+  /**
+   * @brief the paths ForEach() visits, pulled one at a time, so two
+   * stores can be read side by side. Nothing may be added to the store
+   * while a reader is open.
+   */
+  class Reader final {
+   public:
+    /// @exception system_error if a run can't be read.
+    explicit Reader(CaptureStore &store);
+    ~Reader();
+
+   private:
+    Reader(const Reader&) = delete;
+    Reader& operator=(const Reader&) = delete;
+
+   public:
+
+    /**
+     * @return false after the last path.
+     * @exception as ForEach().
+     */
+    bool Next(std::string &path, bool &is_dir);
+
+   private:
+    struct Sources;
+    std::unique_ptr<Sources> sources_;
+  };
+
+  /// records added, how often they were spilled and the bytes written.
+  uint64_t records() const { return this->records_; }
+  size_t spills() const { return this->spills_; }
+  uint64_t spilled_bytes() const { return this->spilled_bytes_; }
+
+ private:
+  struct Run {
+    off_t    offset;
+    uint64_t size;       /// deflated
+    uint64_t records;
+    int      level;      /// merged from 16^level spills
+  };
+
+  void SortArena();
+  void Spill();
+  void MergeTail(size_t first);
+  void OpenTempFile();
+
+  size_t              budget_;
+  std::string         temp_dir_;
+  std::string         arena_;     /// varint length, path, op
+  std::vector<size_t> index_;     /// arena offset of every record
+  bool                sorted_;    /// index_ by path, then as added
+
+  int                 fd_;
+  off_t               file_end_;
+  std::vector<Run>    runs_;      /// oldest first
+
+  uint64_t            records_;
+  size_t              spills_;
+  uint64_t            spilled_bytes_;
+};
+
+} // end of linux ns
+
+#endif /* end of include guard: LINUX_CAPTURE_STORE_H_ */
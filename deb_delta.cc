@@ -0,0 +1,411 @@
+#include "deb_delta.h"
+#include "file_ops.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <system_error>
+#include <vector>
+
+namespace linux
+{
+
+namespace {
+
+const char     kMagic[8]   = { 'm', 'i', 'X', 'd', 'e', 'l', 't', 'a' };
+const uint32_t kVersion    = 1;
+const size_t   kHeaderSize = 8 + 4 + 4 + 8 + 8 + 4 + 4 + 8 + 8;
+
+/// old file blocks that are looked up, a match is at least this long.
+const size_t   kBlockSize  = 64;
+
+/// patches shorter than this are cheaper as new bytes.
+const size_t   kMinPatch   = 16;
+
+void PutU32(std::string &out, uint32_t v) {
+  for(int i = 0; i < 4; ++i) out.push_back(char(v >> (8 * i)));
+}
+
+void PutU64(std::string &out, uint64_t v) {
+  for(int i = 0; i < 8; ++i) out.push_back(char(v >> (8 * i)));
+}
+
+uint32_t GetU32(const unsigned char *p) {
+  uint32_t v = 0;
+  for(int i = 3; i >= 0; --i) v = (v << 8) | p[i];
+  return v;
+}
+
+uint64_t GetU64(const unsigned char *p) {
+  uint64_t v = 0;
+  for(int i = 7; i >= 0; --i) v = (v << 8) | p[i];
+  return v;
+}
+
+void PutSignedVarint(std::string &out, int64_t v) {
+  PutVarint(out, (uint64_t(v) << 1) ^ uint64_t(v >> 63));
+}
+
+uint32_t Crc32(const char *data, size_t size) {
+  uLong crc = crc32(0, Z_NULL, 0);
+
+  /// zlib takes 32 bit lengths.
+  while(size > 0) {
+    uInt chunk = uInt(std::min<size_t>(size, 1u << 30));
+    crc = crc32(crc, reinterpret_cast<const Bytef*>(data), chunk);
+    data += chunk;
+    size -= chunk;
+  }
+  return uint32_t(crc);
+}
+
+/// polynomial hash of a window, rolled a byte at a time.
+const uint32_t kPrime = 0x01000193;
+
+uint32_t HashBlock(const unsigned char *p) {
+  uint32_t h = 0;
+  for(size_t i = 0; i < kBlockSize; ++i) h = h * kPrime + p[i];
+  return h;
+}
+
+/**
+ * @brief the bsdiff idea: after a reference, a rebuilt binary usually
+ * goes on with the same bytes except for changed addresses. Extend as
+ * long as at least half of the bytes still match.
+ */
+size_t PatchLength(const unsigned char *now, size_t now_size,
+                   const unsigned char *old, size_t old_size) {
+
+  size_t limit = std::min(now_size, old_size);
+  long score = 0, best_score = 0;
+  size_t best = 0;
+
+  for(size_t i = 0; i < limit; ++i) {
+    score += now[i] == old[i] ? 1 : -1;
+    if(score > best_score) {
+      best_score = score;
+      best = i + 1;
+    } else if(score < best_score - long(kBlockSize)) {
+      break;
+    }
+  }
+
+  return best;
+}
+
+class OperationWriter {
+ public:
+  OperationWriter(const unsigned char *old, size_t old_size,
+                  const unsigned char *now)
+    : old_(old), old_size_(old_size), now_(now), old_end_(0) {
+    memset(&stats_, 0, sizeof(stats_));
+  }
+
+  /// new bytes [begin, end), as a patch against the old bytes after the
+  /// last reference where that pays off.
+  void Literal(size_t begin, size_t end) {
+    if(begin >= end) return;
+
+    if(this->old_end_ < this->old_size_) {
+      size_t length = PatchLength(this->now_ + begin, end - begin,
+                                  this->old_ + this->old_end_,
+                                  this->old_size_ - this->old_end_);
+      if(length >= kMinPatch) {
+        this->ops_.push_back('P');
+        PutSignedVarint(this->ops_, 0);
+        PutVarint(this->ops_, length);
+        for(size_t i = 0; i < length; ++i) {
+          this->ops_.push_back(char(this->now_[begin + i] -
+                                    this->old_[this->old_end_ + i]));
+        }
+        this->old_end_ += length;
+        this->stats_.patched += length;
+        begin += length;
+      }
+    }
+
+    if(begin >= end) return;
+
+    this->ops_.push_back('I');
+    PutVarint(this->ops_, end - begin);
+    this->ops_.append(reinterpret_cast<const char*>(this->now_ + begin),
+                      end - begin);
+    this->stats_.inserted += end - begin;
+  }
+
+  void Reference(size_t old_offset, size_t length) {
+    this->ops_.push_back('C');
+    PutSignedVarint(this->ops_, int64_t(old_offset) - int64_t(this->old_end_));
+    PutVarint(this->ops_, length);
+    this->old_end_ = old_offset + length;
+    this->stats_.copied += length;
+  }
+
+  const std::string& ops() const { return this->ops_; }
+  DeltaStats& stats() { return this->stats_; }
+
+ private:
+  const unsigned char *old_;
+  size_t               old_size_;
+  const unsigned char *now_;
+  size_t               old_end_;
+  std::string          ops_;
+  DeltaStats           stats_;
+};
+
+void WriteFileAtomically(const std::string &file,
+                         const std::string &header,
+                         const char *data, size_t size) {
+
+  std::string temp = file + ".XXXXXX";
+  std::vector<char> temp_name(temp.begin(), temp.end());
+  temp_name.push_back('\0');
+
+  int fd = ::mkostemp(temp_name.data(), O_CLOEXEC);
+  CHECK_LINUX_FUN_RETURN_OR_THROW(fd);
+
+  try {
+    WriteAll(fd, header.data(), header.size(), 0);
+    WriteAll(fd, data, size, header.size());
+    CHECK_LINUX_FUN_RETURN_OR_THROW(::fchmod(fd, 0644));
+
+    int rc = ::close(fd);
+    fd = -1;
+    CHECK_LINUX_FUN_RETURN_OR_THROW(rc);
+    CHECK_LINUX_FUN_RETURN_OR_THROW(::rename(temp_name.data(), file.c_str()));
+  }
+  catch(...) {
+    if(-1 != fd) ::close(fd);
+    ::unlink(temp_name.data());
+    throw;
+  }
+}
+
+}
+
+DeltaStats CreateDelta(const std::string &old_file,
+                       const std::string &new_file,
+                       const std::string &delta_file) {
+
+  MappedFile old_map(old_file), new_map(new_file);
+
+  const unsigned char *old = reinterpret_cast<const unsigned char*>(
+      old_map.data());
+  const unsigned char *now = reinterpret_cast<const unsigned char*>(
+      new_map.data());
+  const size_t old_size = old_map.size();
+  const size_t new_size = new_map.size();
+
+  /// every aligned block of the old file, one slot per hash; a
+  /// collision only loses a candidate.
+  size_t slots = 1;
+  while(slots < 2 * (old_size / kBlockSize + 1)) slots <<= 1;
+  std::vector<uint32_t> table(slots, 0);   /// block index + 1
+
+  for(size_t block = 0; (block + 1) * kBlockSize <= old_size; ++block) {
+    uint32_t h = HashBlock(old + block * kBlockSize);
+    table[h & (slots - 1)] = uint32_t(block + 1);
+  }
+
+  uint32_t drop = 1;   /// kPrime ^ (kBlockSize - 1), to roll a byte out
+  for(size_t i = 1; i < kBlockSize; ++i) drop *= kPrime;
+
+  OperationWriter writer(old, old_size, now);
+  size_t literal = 0, pos = 0;
+  uint32_t h = new_size >= kBlockSize ? HashBlock(now) : 0;
+
+  while(pos + kBlockSize <= new_size) {
+
+    uint32_t block = table[h & (slots - 1)];
+    size_t   offset = size_t(block - 1) * kBlockSize;
+
+    if(0 != block && 0 == memcmp(old + offset, now + pos, kBlockSize)) {
+
+      /// grow the match both ways as far as the bytes agree.
+      size_t back = 0;
+      while(pos - back > literal && offset - back > 0 &&
+            now[pos - back - 1] == old[offset - back - 1]) {
+        ++back;
+      }
+
+      size_t length = kBlockSize + back;
+      size_t new_begin = pos - back, old_begin = offset - back;
+      while(new_begin + length < new_size && old_begin + length < old_size &&
+            now[new_begin + length] == old[old_begin + length]) {
+        ++length;
+      }
+
+      writer.Literal(literal, new_begin);
+      writer.Reference(old_begin, length);
+
+      pos = literal = new_begin + length;
+      if(pos + kBlockSize <= new_size) h = HashBlock(now + pos);
+      continue;
+    }
+
+    if(pos + kBlockSize < new_size) {
+      h = (h - now[pos] * drop) * kPrime + now[pos + kBlockSize];
+    }
+    ++pos;
+  }
+
+  writer.Literal(literal, new_size);
+
+  const std::string &ops = writer.ops();
+  uLongf packed_size = compressBound(ops.size());
+  std::vector<char> packed(packed_size);
+
+  int rc = compress2(reinterpret_cast<Bytef*>(packed.data()), &packed_size,
+                     reinterpret_cast<const Bytef*>(ops.data()), ops.size(),
+                     Z_BEST_COMPRESSION);
+  if(Z_OK != rc) throw std::runtime_error("Can't deflate the delta");
+
+  std::string header(kMagic, sizeof(kMagic));
+  PutU32(header, kVersion);
+  PutU32(header, 0);
+  PutU64(header, old_size);
+  PutU64(header, new_size);
+  PutU32(header, Crc32(old_map.data(), old_size));
+  PutU32(header, Crc32(new_map.data(), new_size));
+  PutU64(header, ops.size());
+  PutU64(header, packed_size);
+
+  WriteFileAtomically(delta_file, header, packed.data(), packed_size);
+
+  DeltaStats stats = writer.stats();
+  stats.size = header.size() + packed_size;
+  return stats;
+}
+
+void ApplyDelta(const std::string &old_file,
+                const std::string &delta_file,
+                const std::string &new_file) {
+
+  MappedFile old_map(old_file), delta_map(delta_file);
+
+  const unsigned char *old = reinterpret_cast<const unsigned char*>(
+      old_map.data());
+  const unsigned char *delta = reinterpret_cast<const unsigned char*>(
+      delta_map.data());
+
+  if(delta_map.size() < kHeaderSize ||
+     0 != memcmp(delta, kMagic, sizeof(kMagic)) ||
+     kVersion != GetU32(delta + 8)) {
+    throw std::runtime_error(delta_file + " is not a miXpkg delta");
+  }
+
+  uint64_t old_size   = GetU64(delta + 16);
+  uint64_t new_size   = GetU64(delta + 24);
+  uint32_t old_crc    = GetU32(delta + 32);
+  uint32_t new_crc    = GetU32(delta + 36);
+  uint64_t ops_size   = GetU64(delta + 40);
+  uint64_t packed_size = GetU64(delta + 48);
+
+  if(old_size != old_map.size() ||
+     old_crc != Crc32(old_map.data(), old_map.size())) {
+    throw std::runtime_error(delta_file + " was not made from " + old_file);
+  }
+
+  if(packed_size != delta_map.size() - kHeaderSize ||
+     ops_size > 2 * new_size + 64 * 1024 * 1024) {
+    throw std::runtime_error(delta_file + " is corrupt");
+  }
+
+  std::vector<unsigned char> ops(ops_size);
+  uLongf unpacked_size = ops_size;
+  if(Z_OK != uncompress(ops.data(), &unpacked_size, delta + kHeaderSize,
+                        packed_size) || unpacked_size != ops_size) {
+    throw std::runtime_error(delta_file + " is corrupt");
+  }
+
+  std::vector<char> now(new_size);
+  const char *p   = reinterpret_cast<const char*>(ops.data());
+  const char *end = p + ops.size();
+  uint64_t pos = 0, old_end = 0;
+
+  auto corrupt = [&]() {
+    return std::runtime_error(delta_file + " is corrupt");
+  };
+
+  while(p < end) {
+    unsigned char op = *p++;
+    uint64_t length;
+
+    if('C' == op || 'P' == op) {
+      uint64_t zigzag;
+      if(!GetVarint(p, end, zigzag) || !GetVarint(p, end, length)) {
+        throw corrupt();
+      }
+
+      int64_t move = int64_t(zigzag >> 1) ^ -int64_t(zigzag & 1);
+      uint64_t offset = old_end + uint64_t(move);
+
+      if(offset > old_size || length > old_size - offset ||
+         length > new_size - pos) {
+        throw corrupt();
+      }
+
+      if('C' == op) {
+        memcpy(now.data() + pos, old + offset, length);
+      } else {
+        if(length > uint64_t(end - p)) throw corrupt();
+        for(uint64_t i = 0; i < length; ++i) {
+          now[pos + i] = char(old[offset + i] + p[i]);
+        }
+        p += length;
+      }
+
+      old_end = offset + length;
+    } else if('I' == op) {
+      if(!GetVarint(p, end, length) || length > uint64_t(end - p) ||
+         length > new_size - pos) {
+        throw corrupt();
+      }
+      memcpy(now.data() + pos, p, length);
+      p += length;
+    } else {
+      throw corrupt();
+    }
+
+    pos += length;
+  }
+
+  if(pos != new_size || new_crc != Crc32(now.data(), now.size())) {
+    throw std::runtime_error("The result of " + delta_file +
+                             " doesn't match its checksum");
+  }
+
+  WriteFileAtomically(new_file, std::string(), now.data(), now.size());
+}
+
+time_t PackageTimestamp(const std::string &deb_file) {
+
+  int fd = ::open(deb_file.c_str(), O_RDONLY | O_CLOEXEC);
+  CHECK_LINUX_FUN_RETURN_OR_THROW(fd);
+
+  /// "!<arch>\n", then the first member: name[16] mtime[12] ...
+  char head[8 + 16 + 12 + 1] = { 0 };
+  ssize_t n = ::pread(fd, head, sizeof(head) - 1, 0);
+
+  struct stat s;
+  int rc = ::fstat(fd, &s);
+  ::close(fd);
+  CHECK_LINUX_FUN_RETURN_OR_THROW(rc);
+
+  if(n == ssize_t(sizeof(head) - 1) && 0 == memcmp(head, "!<arch>\n", 8)) {
+    char *end = nullptr;
+    long long stamp = strtoll(head + 8 + 16, &end, 10);
+    if(end != head + 8 + 16 && stamp > 0) return time_t(stamp);
+  }
+
+  return s.st_mtime;
+}
+
+} /// ns infra
@@ -0,0 +1,73 @@
+
+#ifndef LINUX_DEB_DELTA_H_
+#define LINUX_DEB_DELTA_H_
+
+#include <time.h>
+
+#include <cstdint>
+#include <string>
+
+namespace linux
+{
+
+/**
+ * @brief what a delta is made of, in bytes of the new file.
+ */
+struct DeltaStats {
+  uint64_t copied;     /// taken unchanged from the old file
+  uint64_t patched;    /// old bytes plus a byte-wise difference
+  uint64_t inserted;   /// new bytes
+  uint64_t size;       /// of the delta file
+};
+
+/**
+ * @brief write a delta that turns old_file into new_file.
+ *
+ * Runs of new_file found anywhere in old_file are references; the
+ * bytes after such a run are encoded as the difference to the bytes
+ * after its old counterpart when that is mostly zeros (changed
+ * addresses in a rebuilt binary), as new bytes otherwise. All of it is
+ * deflated. Works best on packages built with dpkg-deb -Znone, where an
+ * unchanged file is an unchanged run of bytes.
+ *
+ * The file is, integers little endian:
+ *
+ *   "miXdelta" u32 version u32 0
+ *   u64 old size  u64 new size  u32 old crc32  u32 new crc32
+ *   u64 size of the operations  u64 size of the deflated operations
+ *   deflated operations:
+ *     'C' svarint old offset - end of previous reference, varint length
+ *     'P' svarint (same), varint length, length difference bytes
+ *     'I' varint length, length bytes
+ *
+ * @exception system_error if a file can't be read or written.
+ */
+DeltaStats CreateDelta(const std::string &old_file,
+                       const std::string &new_file,
+                       const std::string &delta_file);
+
+/**
+ * @brief rebuild new_file from old_file and a delta, bit for bit. It is
+ * written next to new_file and renamed once complete.
+ *
+ * @exception runtime_error if old_file isn't the file the delta was made
+ * from, the delta is corrupt or the result doesn't match its crc32.
+ * system_error if a file can't be read or written.
+ */
+void ApplyDelta(const std::string &old_file,
+                const std::string &delta_file,
+                const std::string &new_file);
+
+/**
+ * @brief the timestamp dpkg-deb gave the members of a package, which is
+ * SOURCE_DATE_EPOCH if it was set, or else the file's mtime. Building
+ * the next package with the same SOURCE_DATE_EPOCH keeps the tar headers
+ * of unchanged files unchanged.
+ *
+ * @exception system_error if the package can't be read.
+ */
+time_t PackageTimestamp(const std::string &deb_file);
+
+} // end of linux ns
+
+#endif /* end of include guard: LINUX_DEB_DELTA_H_ */
@@ -0,0 +1,322 @@
+#include "deb_stream.h"
+#include "file_ops.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <system_error>
+
+namespace linux
+{
+
+namespace {
+
+const size_t kBlock      = 512;
+const size_t kBufferSize = 1 << 17;
+
+uint64_t RoundUp(uint64_t size) {
+  return (size + kBlock - 1) / kBlock * kBlock;
+}
+
+/// octal with a NUL, or GNU base-256 for what doesn't fit, e.g. files
+/// of 8 GiB and more.
+void PutNumber(char *field, size_t width, uint64_t value) {
+  if(value < (uint64_t(1) << (3 * (width - 1)))) {
+    for(size_t i = width - 1; i-- > 0; ) {
+      field[i] = char('0' + (value & 7));
+      value >>= 3;
+    }
+    field[width - 1] = '\0';
+    return;
+  }
+
+  memset(field, 0, width);
+  field[0] = char(0x80);
+  for(size_t i = width - 1; i > 0 && value; --i) {
+    field[i] = char(value & 0xff);
+    value >>= 8;
+  }
+}
+
+std::string TarBlock(const std::string &name, char type, mode_t mode,
+                     uint64_t size, time_t mtime, const std::string &link,
+                     dev_t rdev) {
+
+  char h[kBlock];
+  memset(h, 0, sizeof(h));
+
+  memcpy(h, name.data(), std::min<size_t>(name.size(), 100));
+  PutNumber(h + 100, 8, mode & 07777);
+  PutNumber(h + 108, 8, 0);
+  PutNumber(h + 116, 8, 0);
+  PutNumber(h + 124, 12, size);
+  PutNumber(h + 136, 12, mtime < 0 ? 0 : uint64_t(mtime));
+  memset(h + 148, ' ', 8);
+  h[156] = type;
+  memcpy(h + 157, link.data(), std::min<size_t>(link.size(), 100));
+  memcpy(h + 257, "ustar  ", 8);
+  memcpy(h + 265, "root", 4);
+  memcpy(h + 297, "root", 4);
+
+  if('3' == type || '4' == type) {
+    PutNumber(h + 329, 8, major(rdev));
+    PutNumber(h + 337, 8, minor(rdev));
+  }
+
+  unsigned sum = 0;
+  for(size_t i = 0; i < kBlock; ++i) sum += static_cast<unsigned char>(h[i]);
+  snprintf(h + 148, 8, "%06o", sum);
+  h[155] = ' ';
+
+  return std::string(h, kBlock);
+}
+
+/// a name or link too long for its field goes in an entry of its own.
+std::string LongLink(char type, const std::string &value) {
+  std::string out = TarBlock("././@LongLink", type, 0, value.size() + 1,
+                             0, std::string(), 0);
+  out += value;
+  out.resize(out.size() + RoundUp(value.size() + 1) - value.size(), '\0');
+  return out;
+}
+
+/// ./usr/bin/app as dpkg-deb names it.
+std::string TarPath(const std::string &path) {
+  return !path.empty() && '/' == path[0] ? "." + path : "./" + path;
+}
+
+/// what header() below makes of an entry, without making it.
+uint64_t HeaderSize(const std::string &name, const std::string &link) {
+  uint64_t size = kBlock;
+  if(name.size() >= 100) size += kBlock + RoundUp(name.size() + 1);
+  if(link.size() >= 100) size += kBlock + RoundUp(link.size() + 1);
+  return size;
+}
+
+std::string ArHeader(const std::string &name, uint64_t size, time_t mtime) {
+  if(size > 9999999999ULL) {
+    throw std::runtime_error(name + " is too big for a .deb");
+  }
+
+  char h[61];
+  snprintf(h, sizeof(h), "%-16s%-12lld%-6d%-6d%-8s%-10llu`\n",
+           name.c_str(), static_cast<long long>(mtime), 0, 0, "100644",
+           static_cast<unsigned long long>(size));
+  return std::string(h, 60);
+}
+
+}
+
+class DebStream::Output final {
+ public:
+  explicit Output(int fd) : fd_(fd), written_(0) {
+    this->buffer_.reserve(kBufferSize);
+  }
+
+  void Append(const std::string &data) {
+    if(this->buffer_.size() + data.size() > kBufferSize) this->Flush();
+    if(data.size() > kBufferSize) {
+      this->Write(data.data(), data.size());
+    } else {
+      this->buffer_ += data;
+    }
+  }
+
+  /// zeros up to the next tar block.
+  void Pad(uint64_t size) {
+    this->Append(std::string(RoundUp(size) - size, '\0'));
+  }
+
+  void Flush() {
+    this->Write(this->buffer_.data(), this->buffer_.size());
+    this->buffer_.clear();
+  }
+
+  void SendFile(const std::string &source, uint64_t size) {
+
+    int fd = ::open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    CHECK_LINUX_FUN_RETURN_OR_THROW(fd);
+    std::shared_ptr<void> closer(nullptr, [fd](void*) { ::close(fd); });
+
+    struct stat s;
+    CHECK_LINUX_FUN_RETURN_OR_THROW(::fstat(fd, &s));
+    if(uint64_t(s.st_size) != size) {
+      throw std::runtime_error(source + " changed while packaging");
+    }
+
+    this->Flush();
+
+    /// straight from the page cache to the pipe, unless the output
+    /// can't take it.
+    uint64_t left = size;
+    while(left > 0 && this->can_send_) {
+      ssize_t sent = ::sendfile(this->fd_, fd, nullptr,
+                                std::min<uint64_t>(left, 1 << 30));
+      if(-1 == sent) {
+        if(EINTR == errno) continue;
+        if((EINVAL == errno || ENOSYS == errno) && left == size) {
+          this->can_send_ = false;
+          break;
+        }
+        CHECK_LINUX_FUN_RETURN_OR_THROW(sent);
+      }
+      if(0 == sent) {
+        throw std::runtime_error(source + " changed while packaging");
+      }
+      left -= sent;
+      this->written_ += sent;
+    }
+
+    std::unique_ptr<char[]> buffer;
+    while(left > 0) {
+      if(!buffer) buffer.reset(new char[kBufferSize]);
+      ssize_t nread = ::read(fd, buffer.get(),
+                             std::min<uint64_t>(left, kBufferSize));
+      if(-1 == nread && EINTR == errno) continue;
+      CHECK_LINUX_FUN_RETURN_OR_THROW(nread);
+      if(0 == nread) {
+        throw std::runtime_error(source + " changed while packaging");
+      }
+      this->Write(buffer.get(), nread);
+      left -= nread;
+    }
+
+    this->Pad(size);
+  }
+
+  uint64_t written() const {
+    return this->written_ + this->buffer_.size();
+  }
+
+ private:
+  void Write(const char *p, size_t size) {
+    while(size > 0) {
+      ssize_t written = ::write(this->fd_, p, size);
+      if(-1 == written && EINTR == errno) continue;
+      CHECK_LINUX_FUN_RETURN_OR_THROW(written);
+
+      p              += written;
+      size           -= written;
+      this->written_ += written;
+    }
+  }
+
+  int         fd_;
+  uint64_t    written_;
+  std::string buffer_;
+  bool        can_send_ = true;
+};
+
+DebStream::DebStream(int fd, time_t timestamp)
+  : fd_(fd), timestamp_(timestamp), entries_(0),
+    data_size_(HeaderSize("./", std::string()) + 2 * kBlock),
+    data_start_(0) {
+}
+
+DebStream::~DebStream() {
+}
+
+void DebStream::AddDirectory(const std::string &path, mode_t mode,
+                             time_t mtime) {
+  this->Add(path, '5', mode, 0, mtime, std::string(), std::string(), 0);
+}
+
+void DebStream::AddFile(const std::string &path, const std::string &source,
+                        mode_t mode, off_t size, time_t mtime) {
+  this->Add(path, '0', mode, uint64_t(size), mtime, source, std::string(),
+            0);
+}
+
+void DebStream::AddSymlink(const std::string &path,
+                           const std::string &target, time_t mtime) {
+  this->Add(path, '2', 0777, 0, mtime, std::string(), target, 0);
+}
+
+void DebStream::AddNode(const std::string &path, mode_t mode, dev_t rdev,
+                        time_t mtime) {
+  char type = S_ISCHR(mode) ? '3' : S_ISBLK(mode) ? '4' : '6';
+  this->Add(path, type, mode, 0, mtime, std::string(), std::string(), rdev);
+}
+
+void DebStream::AddHardLink(const std::string &path,
+                            const std::string &target,
+                            mode_t mode, time_t mtime) {
+  this->Add(path, '1', mode, 0, mtime, std::string(), TarPath(target), 0);
+}
+
+void DebStream::Add(const std::string &path, char type, mode_t mode,
+                    uint64_t size, time_t mtime, const std::string &source,
+                    const std::string &link, dev_t rdev) {
+
+  std::string name = TarPath(path);
+  if('5' == type) name += '/';
+
+  /// planning, only the sizes count.
+  if(!this->out_) {
+    ++this->entries_;
+    this->data_size_ += HeaderSize(name, link);
+    if('0' == type) this->data_size_ += RoundUp(size);
+    return;
+  }
+
+  std::string header;
+  if(name.size() >= 100) header += LongLink('L', name);
+  if(link.size() >= 100) header += LongLink('K', link);
+  header += TarBlock(name, type, mode, '0' == type ? size : 0, mtime, link,
+                     rdev);
+
+  this->out_->Append(header);
+  if('0' == type) this->out_->SendFile(source, size);
+}
+
+void DebStream::Start(const std::string &control) {
+
+  /// small enough to be built in memory.
+  std::string control_tar =
+      TarBlock("./", '5', 0755, 0, this->timestamp_, std::string(), 0) +
+      TarBlock("./control", '0', 0644, control.size(), this->timestamp_,
+               std::string(), 0) +
+      control;
+  control_tar.resize(RoundUp(control_tar.size()) + 2 * kBlock, '\0');
+
+  this->out_.reset(new Output(this->fd_));
+  Output &out = *this->out_;
+
+  out.Append("!<arch>\n");
+  out.Append(ArHeader("debian-binary", 4, this->timestamp_));
+  out.Append("2.0\n");
+  out.Append(ArHeader("control.tar", control_tar.size(), this->timestamp_));
+  out.Append(control_tar);
+  out.Append(ArHeader("data.tar", this->data_size_, this->timestamp_));
+
+  this->data_start_ = out.written();
+  out.Append(TarBlock("./", '5', 0755, 0, this->timestamp_, std::string(),
+                      0));
+}
+
+uint64_t DebStream::Finish() {
+
+  if(!this->out_) throw std::logic_error("DebStream::Finish() before Start()");
+
+  Output &out = *this->out_;
+  out.Append(std::string(2 * kBlock, '\0'));
+
+  if(out.written() - this->data_start_ != this->data_size_) {
+    throw std::runtime_error("The installed files changed while packaging");
+  }
+
+  /// tar members are whole blocks, so no ar padding is needed.
+  out.Flush();
+  return out.written();
+}
+
+} /// ns infra
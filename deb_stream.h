@@ -0,0 +1,100 @@
+
+#ifndef LINUX_DEB_STREAM_H_
+#define LINUX_DEB_STREAM_H_
+
+#include <sys/types.h>
+#include <time.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace linux
+{
+
+/**
+ * @brief writes a .deb front to back to a pipe, socket or file, without
+ * seeking and without temporary files.
+ *
+ * control.tar and data.tar are stored uncompressed and file contents go
+ * from sysroot to the output with sendfile(). The size of data.tar has
+ * to be in its ar header, so the entries are added twice in the same
+ * order: once to plan it, and once more after Start() to write them.
+ * Only the entry being written is held, however large the package.
+ *
+ * The tar members use the GNU format dpkg-deb writes: owner root, long
+ * names as ././@LongLink entries. Like dpkg-deb, the entries have to be
+ * sorted by path, with "./" first and every directory before its
+ * contents.
+ */
+class DebStream final {
+ public:
+  /**
+   * @param timestamp of the ar members, the control files and "./".
+   */
+  DebStream(int fd, time_t timestamp);
+  ~DebStream();
+
+  DebStream(const DebStream&) = delete;
+  DebStream& operator=(const DebStream&) = delete;
+
+  /**
+   * @name path is the path inside the package, e.g. /usr/bin/app.
+   *
+   * @exception as Finish() once started.
+   * @{
+   */
+  void AddDirectory(const std::string &path, mode_t mode, time_t mtime);
+  void AddFile(const std::string &path, const std::string &source,
+               mode_t mode, off_t size, time_t mtime);
+  void AddSymlink(const std::string &path, const std::string &target,
+                  time_t mtime);
+  /// devices and fifos.
+  void AddNode(const std::string &path, mode_t mode, dev_t rdev,
+               time_t mtime);
+
+  /// a file with the contents of target, which was added before it with
+  /// mode and mtime.
+  void AddHardLink(const std::string &path, const std::string &target,
+                   mode_t mode, time_t mtime);
+  /** @} */
+
+  /**
+   * @brief the entries added so far planned data.tar. Write everything up
+   * to its first entry.
+   *
+   * @exception system_error if the output can't be written.
+   */
+  void Start(const std::string &control);
+
+  /**
+   * @brief end the package.
+   *
+   * @return the number of bytes written.
+   * @exception runtime_error if the entries aren't the ones planned or a
+   * file changed size since, the output is then incomplete. system_error
+   * if a file can't be read or the output can't be written.
+   */
+  uint64_t Finish();
+
+  /// entries planned, without "./".
+  uint64_t entries() const { return this->entries_; }
+
+ private:
+  class Output;
+
+  void Add(const std::string &path, char type, mode_t mode, uint64_t size,
+           time_t mtime, const std::string &source, const std::string &link,
+           dev_t rdev);
+
+  int                     fd_;
+  time_t                  timestamp_;
+  uint64_t                entries_;
+  uint64_t                data_size_;    /// planned
+  uint64_t                data_start_;   /// offset of data.tar's first entry
+  std::unique_ptr<Output> out_;          /// once started
+};
+
+} // end of linux ns
+
+#endif /* end of include guard: LINUX_DEB_STREAM_H_ */
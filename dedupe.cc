@@ -0,0 +1,204 @@
+#include "dedupe.h"
+#include "capture_store.h"
+#include "file_ops.h"
+#include "thread_pool.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+namespace linux
+{
+
+namespace {
+
+const size_t kBatch   = 1 << 12;   /// files hashed or compared at once
+const size_t kSizeKey = 24;        /// hex size and mode, then the path
+const size_t kHashKey = 40;        /// hex size, mode and hash
+const size_t kNone    = size_t(-1);
+
+uint64_t Rotate(uint64_t x, int bits) {
+  return (x << bits) | (x >> (64 - bits));
+}
+
+/// 8 bytes a step, good enough to tell files apart: every match is
+/// confirmed by comparing the bytes anyway.
+uint64_t HashContents(const char *data, size_t size) {
+  const uint64_t kMul1 = 0x9e3779b97f4a7c15ULL;
+  const uint64_t kMul2 = 0xff51afd7ed558ccdULL;
+
+  uint64_t hash = kMul1 ^ size;
+  size_t i = 0;
+
+  for(; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy(&word, data + i, sizeof(word));
+    hash = Rotate(hash ^ (word * kMul2), 31) * kMul1;
+  }
+
+  uint64_t tail = 0;
+  memcpy(&tail, data + i, size - i);
+  hash = Rotate(hash ^ (tail * kMul2), 31) * kMul1;
+
+  hash ^= hash >> 33;
+  hash *= kMul2;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+/// fixed width, so the keys sort by the number.
+std::string Hex(uint64_t value, int digits) {
+  char hex[17];
+  snprintf(hex, sizeof(hex), "%0*llx", digits,
+           static_cast<unsigned long long>(value));
+  return hex;
+}
+
+bool SameContents(const std::string &a, const std::string &b) {
+  try {
+    MappedFile first(a), second(b);
+    return first.size() == second.size() &&
+           0 == memcmp(first.data(), second.data(), first.size());
+  }
+  catch(const std::exception&) {
+    return false;
+  }
+}
+
+}
+
+DuplicateFinder::DuplicateFinder(ThreadPool &pool, size_t budget)
+  : pool_(pool), budget_(budget), candidates_(new CaptureStore(budget)),
+    duplicates_(0), duplicate_bytes_(0) {
+}
+
+DuplicateFinder::~DuplicateFinder() {
+}
+
+void DuplicateFinder::Add(const std::string &path, off_t size, mode_t mode) {
+  if(size <= 0) return;
+  this->candidates_->AddCreated(Hex(size, 16) + Hex(mode, 8) + path, false);
+}
+
+void DuplicateFinder::Resolve(const Found &found) {
+
+  CaptureStore hashes(this->budget_);
+
+  /// sizes first, most files have a size nothing else has. A file is
+  /// hashed once the next one in order has its size too.
+  std::vector<std::string> batch;
+  std::string previous;
+  bool previous_queued = false;
+
+  auto hash_batch = [&]() {
+    std::vector<std::string> keys(batch.size());
+
+    this->pool_.ParallelFor(batch.size(), [&](size_t i) {
+      try {
+        MappedFile file(batch[i].substr(kSizeKey));
+        keys[i] = batch[i].substr(0, kSizeKey) +
+                  Hex(HashContents(file.data(), file.size()), 16) +
+                  batch[i].substr(kSizeKey);
+      }
+      catch(const std::exception&) {
+        /// stays unique
+      }
+    });
+
+    for(auto &key : keys) {
+      if(!key.empty()) hashes.AddCreated(key, false);
+    }
+    batch.clear();
+  };
+
+  this->candidates_->ForEach([&](const std::string &key, bool) {
+    if(0 == key.compare(0, kSizeKey, previous, 0, kSizeKey)) {
+      if(!previous_queued) batch.push_back(previous);
+      batch.push_back(key);
+      previous_queued = true;
+    } else {
+      previous_queued = false;
+    }
+
+    previous = key;
+    if(batch.size() >= kBatch) hash_batch();
+    return true;
+  });
+  hash_batch();
+
+  /// at last the bytes, against the first file of the hash group. A
+  /// group usually has one content, a hash collision makes a second one.
+  struct Member {
+    std::string path;
+    size_t      group;
+    size_t      original;
+    uint64_t    size;
+  };
+
+  std::vector<std::vector<std::string> > originals;   /// of the groups
+  std::vector<Member> members;
+  std::string group_key;
+
+  auto compare_batch = [&]() {
+    std::vector<size_t> known;
+    for(auto &group : originals) known.push_back(group.size());
+
+    this->pool_.ParallelFor(members.size(), [&](size_t i) {
+      Member &member = members[i];
+      const std::vector<std::string> &group = originals[member.group];
+      for(size_t o = 0; o < known[member.group]; ++o) {
+        if(SameContents(group[o], member.path)) {
+          member.original = o;
+          break;
+        }
+      }
+    });
+
+    /// the rest may have the contents of one found in this batch.
+    for(auto &member : members) {
+      std::vector<std::string> &group = originals[member.group];
+      for(size_t o = known[member.group];
+          kNone == member.original && o < group.size(); ++o) {
+        if(SameContents(group[o], member.path)) member.original = o;
+      }
+
+      if(kNone == member.original) {
+        group.push_back(member.path);
+        continue;
+      }
+
+      found(member.path, group[member.original]);
+      ++this->duplicates_;
+      this->duplicate_bytes_ += member.size;
+    }
+    members.clear();
+
+    /// the last group may go on in the next batch.
+    if(originals.size() > 1) {
+      originals.erase(originals.begin(), originals.end() - 1);
+    }
+  };
+
+  hashes.ForEach([&](const std::string &key, bool) {
+    std::string path = key.substr(kHashKey);
+
+    if(originals.empty() || 0 != key.compare(0, kHashKey, group_key)) {
+      if(originals.size() >= kBatch) compare_batch();
+      group_key = key.substr(0, kHashKey);
+      originals.push_back(std::vector<std::string>(1, path));
+      return true;
+    }
+
+    members.push_back(Member{ path, originals.size() - 1, kNone,
+                              std::stoull(key.substr(0, 16), nullptr, 16) });
+    if(members.size() >= kBatch) compare_batch();
+    return true;
+  });
+  compare_batch();
+}
+
+} /// ns infra
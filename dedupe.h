@@ -0,0 +1,75 @@
+
+#ifndef LINUX_DEDUPE_H_
+#define LINUX_DEDUPE_H_
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+namespace linux
+{
+
+class CaptureStore;
+class ThreadPool;
+
+/**
+ * @brief find regular files with the same contents, among all files
+ * of a package however many there are.
+ *
+ * They are grouped by size (and mode, files with another mode are
+ * never matched) first, then by a fast hash of the contents, and the
+ * byte compare of each against the first of its group confirms it.
+ * Both groupings are sorted records in stores that spill like the
+ * captured paths, and the files are hashed and compared a batch at a
+ * time, so memory doesn't grow with the number of files.
+ *
+ * Empty files and files that can't be read are never matched.
+ */
+class DuplicateFinder final {
+ public:
+  /**
+   * @param budget bytes each of its stores keeps in memory.
+   */
+  DuplicateFinder(ThreadPool &pool, size_t budget);
+  ~DuplicateFinder();
+
+ private:
+  DuplicateFinder(const DuplicateFinder&) = delete;
+  DuplicateFinder& operator=(const DuplicateFinder&) = delete;
+
+ public:
+
+  /**
+   * @exception system_error if a run can't be written.
+   */
+  void Add(const std::string &path, off_t size, mode_t mode);
+
+  typedef std::function<void(const std::string &duplicate,
+                             const std::string &original)> Found;
+
+  /**
+   * @brief calls found for every file with the contents of another.
+   * original is the first of them in path order, the same for all.
+   *
+   * @exception as CaptureStore::ForEach(), or what found throws.
+   */
+  void Resolve(const Found &found);
+
+  /// found by Resolve(), and their bytes.
+  size_t duplicates() const { return this->duplicates_; }
+  uint64_t duplicate_bytes() const { return this->duplicate_bytes_; }
+
+ private:
+  ThreadPool                   &pool_;
+  size_t                        budget_;
+  std::unique_ptr<CaptureStore> candidates_;   /// size, mode, path
+  size_t                        duplicates_;
+  uint64_t                      duplicate_bytes_;
+};
+
+} // end of linux ns
+
+#endif /* end of include guard: LINUX_DEDUPE_H_ */
@@ -0,0 +1,37 @@
+/// Rebuilds a package from the previous one and the delta that
+/// 'miXpkg --delta-from' wrote, on the target.
+///
+///   make apply
+///   ./miXpkg-apply old.deb new.deb.delta new.deb
+
+#include <chrono>
+#include <exception>
+#include <iostream>
+
+#include "deb_delta.h"
+
+int main(int argc, char *argv[]) {
+
+  if(argc != 4) {
+    std::cerr << "usage: " << argv[0] << " old.deb delta new.deb"
+              << std::endl;
+    return 1;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+
+  try {
+    linux::ApplyDelta(argv[1], argv[2], argv[3]);
+  }
+  catch(const std::exception &ex) {
+    std::cerr << "error: " << ex.what() << std::endl;
+    return 1;
+  }
+
+  std::cout << "Rebuilt " << argv[3] << " in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now() - start).count()
+            << " ms" << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,275 @@
+#include "dir_index.h"
+#include "file_ops.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+
+#include <system_error>
+
+namespace linux
+{
+
+namespace {
+
+const char     kMagic[8] = { 'm', 'i', 'X', 'i', 'n', 'd', 'e', 'x' };
+const uint32_t kVersion  = 2;
+
+/// a directory changed within the same file system tick as it was
+/// recorded keeps its mtime, 2 s is the coarsest granularity (FAT).
+const int64_t kTimestampGranularity = 2000000000LL;
+
+/// the file is read by the host that wrote it, so everything is in host
+/// byte order. The byte_order field tells another host apart.
+struct Header {
+  char     magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t entry_count;
+  uint32_t reserved;
+  uint64_t names_size;
+  uint64_t key_hash;
+  uint64_t checksum;
+  int64_t  started_sec;    /// when the first directory was recorded
+  int64_t  started_nsec;
+};
+
+const uint32_t kByteOrder = 0x01020304;
+
+int64_t Nanoseconds(int64_t sec, int64_t nsec) {
+  return sec * 1000000000LL + nsec;
+}
+
+}
+
+const uint32_t DirIndex::kNone;
+
+DirIndex::DirIndex()
+  : map_(nullptr), map_size_(0), entries_(nullptr), entry_count_(0),
+    names_(nullptr), names_size_(0), started_(0), record_started_(0),
+    read_dirs_(0), reused_dirs_(0) {
+
+}
+
+DirIndex::~DirIndex() {
+  this->Unmap();
+}
+
+void DirIndex::Unmap() {
+  if(nullptr != this->map_) ::munmap(this->map_, this->map_size_);
+
+  this->map_         = nullptr;
+  this->map_size_    = 0;
+  this->entries_     = nullptr;
+  this->entry_count_ = 0;
+  this->names_       = nullptr;
+  this->names_size_  = 0;
+  this->started_     = 0;
+}
+
+bool DirIndex::Load(const std::string &file, const std::string &key) {
+
+  this->Unmap();
+
+  int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+  if(-1 == fd) return false;
+
+  struct stat s;
+  if(0 != ::fstat(fd, &s) || s.st_size < off_t(sizeof(Header))) {
+    ::close(fd);
+    return false;
+  }
+
+  void *map = ::mmap(nullptr, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if(MAP_FAILED == map) return false;
+
+  this->map_      = map;
+  this->map_size_ = s.st_size;
+
+  const char *base = static_cast<const char*>(map);
+  Header header;
+  memcpy(&header, base, sizeof(header));
+
+  uint64_t body = this->map_size_ - sizeof(Header);
+
+  bool valid =
+      0 == memcmp(header.magic, kMagic, sizeof(kMagic)) &&
+      kVersion == header.version &&
+      kByteOrder == header.byte_order &&
+      header.entry_count > 0 &&
+      header.entry_count < kNone &&
+      uint64_t(header.entry_count) * sizeof(Entry) <= body &&
+      header.names_size ==
+        body - uint64_t(header.entry_count) * sizeof(Entry) &&
+      Fnv1a(key.data(), key.size()) == header.key_hash &&
+      Fnv1a(base + sizeof(Header), body) == header.checksum;
+
+  if(!valid) {
+    this->Unmap();
+    return false;
+  }
+
+  const Entry *entries = reinterpret_cast<const Entry*>(base + sizeof(Header));
+
+  /// links only point forward in pre-order, so walking it always ends.
+  for(uint32_t i = 0; i < header.entry_count; ++i) {
+    const Entry &e = entries[i];
+
+    bool sane =
+        (kNone == e.first_child  ||
+         (e.first_child > i && e.first_child < header.entry_count)) &&
+        (kNone == e.next_sibling ||
+         (e.next_sibling > i && e.next_sibling < header.entry_count)) &&
+        e.name_offset <= header.names_size &&
+        e.name_length <= header.names_size - e.name_offset;
+
+    if(!sane) {
+      this->Unmap();
+      return false;
+    }
+  }
+
+  this->entries_     = entries;
+  this->entry_count_ = header.entry_count;
+  this->names_       = reinterpret_cast<const char*>(entries + header.entry_count);
+  this->names_size_  = header.names_size;
+  this->started_     = Nanoseconds(header.started_sec, header.started_nsec);
+
+  return true;
+}
+
+void DirIndex::Save(const std::string &file, const std::string &key) const {
+
+  if(this->records_.empty()) return;
+
+  std::string::size_type last_blash_pos = file.find_last_of('/');
+  if(std::string::npos != last_blash_pos && 0 != last_blash_pos) {
+    MakeDirectories(file.substr(0, last_blash_pos));
+  }
+
+  const size_t entries_size = this->records_.size() * sizeof(Entry);
+
+  Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version     = kVersion;
+  header.byte_order  = kByteOrder;
+  header.entry_count = this->records_.size();
+  header.names_size  = this->record_names_.size();
+  header.key_hash    = Fnv1a(key.data(), key.size());
+  header.checksum    = Fnv1a(this->record_names_.data(),
+                             this->record_names_.size(),
+                             Fnv1a(this->records_.data(), entries_size));
+  header.started_sec  = this->record_started_ / 1000000000LL;
+  header.started_nsec = this->record_started_ % 1000000000LL;
+
+  std::string temp = file + ".XXXXXX";
+  std::vector<char> temp_name(temp.begin(), temp.end());
+  temp_name.push_back('\0');
+
+  int fd = ::mkostemp(temp_name.data(), O_CLOEXEC);
+  CHECK_LINUX_FUN_RETURN_OR_THROW(fd);
+
+  try {
+    WriteAll(fd, &header, sizeof(header), 0);
+    WriteAll(fd, this->records_.data(), entries_size, sizeof(header));
+    WriteAll(fd, this->record_names_.data(), this->record_names_.size(),
+             sizeof(header) + entries_size);
+
+    int rc = ::close(fd);
+    fd = -1;
+    CHECK_LINUX_FUN_RETURN_OR_THROW(rc);
+    CHECK_LINUX_FUN_RETURN_OR_THROW(::rename(temp_name.data(), file.c_str()));
+  }
+  catch(...) {
+    if(-1 != fd) ::close(fd);
+    ::unlink(temp_name.data());
+    throw;
+  }
+}
+
+uint32_t DirIndex::FirstChild(uint32_t entry) const {
+  return entry < this->entry_count_ ? this->entries_[entry].first_child : kNone;
+}
+
+uint32_t DirIndex::NextSibling(uint32_t entry) const {
+  return entry < this->entry_count_ ? this->entries_[entry].next_sibling : kNone;
+}
+
+std::string DirIndex::Name(uint32_t entry) const {
+  const Entry &e = this->entries_[entry];
+  return std::string(this->names_ + e.name_offset, e.name_length);
+}
+
+bool DirIndex::Unchanged(uint32_t entry, const struct stat &s) const {
+
+  if(entry >= this->entry_count_) return false;
+
+  const Entry &e = this->entries_[entry];
+
+  /// racy, as git calls it: changed since it was recorded, it may still
+  /// have the same mtime. Only an older mtime can be trusted.
+  if(Nanoseconds(e.mtime_sec, e.mtime_nsec) >=
+     this->started_ - kTimestampGranularity) {
+    return false;
+  }
+
+  return e.ino        == uint64_t(s.st_ino) &&
+         e.dev        == uint64_t(s.st_dev) &&
+         e.mtime_sec  == int64_t(s.st_mtim.tv_sec) &&
+         e.mtime_nsec == int64_t(s.st_mtim.tv_nsec);
+}
+
+uint32_t DirIndex::Record(uint32_t parent, const std::string &name,
+                          const struct stat &s) {
+
+  if(this->records_.empty()) {
+    struct timespec now;
+    ::clock_gettime(CLOCK_REALTIME, &now);
+    this->record_started_ = Nanoseconds(now.tv_sec, now.tv_nsec);
+  }
+
+  Entry e;
+  memset(&e, 0, sizeof(e));
+  e.ino          = s.st_ino;
+  e.dev          = s.st_dev;
+  e.mtime_sec    = s.st_mtim.tv_sec;
+  e.mtime_nsec   = s.st_mtim.tv_nsec;
+  e.parent       = kNone == parent ? 0 : parent;
+  e.first_child  = kNone;
+  e.next_sibling = kNone;
+
+  /// the same names (lib, include, ...) show up all over a sysroot.
+  auto interned = this->interned_.find(name);
+  if(this->interned_.end() == interned) {
+    interned = this->interned_.insert(
+        std::make_pair(name, uint32_t(this->record_names_.size()))).first;
+    this->record_names_.append(name);
+  }
+
+  e.name_offset = interned->second;
+  e.name_length = name.size();
+
+  uint32_t index = this->records_.size();
+  this->records_.push_back(e);
+  this->last_child_.push_back(kNone);
+
+  if(kNone != parent) {
+    uint32_t &last = this->last_child_[parent];
+    if(kNone == last) {
+      this->records_[parent].first_child = index;
+    } else {
+      this->records_[last].next_sibling = index;
+    }
+    last = index;
+  }
+
+  return index;
+}
+
+} /// ns infra
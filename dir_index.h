@@ -0,0 +1,137 @@
+
+#ifndef LINUX_DIR_INDEX_H_
+#define LINUX_DIR_INDEX_H_
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+#include <map>
+
+namespace linux
+{
+
+/**
+ * @brief Directory tree of the sysroot as it was at the last run,
+ * persisted in a compact file that is mmap'd on the next start.
+ *
+ * Every directory keeps its inode, mtime and name (interned in a
+ * string table) and links to its parent, first child and next sibling.
+ * They are stored in the order the walk records them, depth first a
+ * run of siblings at a time: all subdirectories of a directory, then
+ * those of the first of them, and so on. A directory whose inode and
+ * mtime didn't change still has the same entries, so its subdirectories
+ * can be taken from the index instead of readdir() and lstat() on every
+ * entry.
+ *
+ * While the tree is watched, the directories are recorded again and
+ * Save() replaces the file.
+ */
+class DirIndex final {
+ public:
+  static const uint32_t kNone = 0xffffffff;
+
+  DirIndex();
+  ~DirIndex();
+
+ private:
+  DirIndex(const DirIndex&) = delete;
+  DirIndex& operator=(const DirIndex&) = delete;
+
+ public:
+
+  /**
+   * @brief map and validate the index written by Save().
+   *
+   * @param key describes what was indexed (root, filters, depth). An
+   * index saved with a different key is stale.
+   *
+   * @return false if the file is missing, corrupt, of another version
+   * or stale. The index is empty then and everything gets walked.
+   */
+  bool Load(const std::string &file, const std::string &key);
+
+  /**
+   * @brief write what was recorded, replacing file atomically.
+   *
+   * @exception system_error Indicates the error.
+   */
+  void Save(const std::string &file, const std::string &key) const;
+
+  /**
+   * @name Loaded index, entry 0 is the root.
+   * @{
+   */
+  bool loaded() const { return nullptr != this->entries_; }
+  uint32_t Root() const { return this->loaded() ? 0 : kNone; }
+  uint32_t FirstChild(uint32_t entry) const;
+  uint32_t NextSibling(uint32_t entry) const;
+  std::string Name(uint32_t entry) const;
+
+  /**
+   * @return true if the directory is still the same as when indexed.
+   * Directories whose mtime wasn't older than the recording by more
+   * than a file system tick are never taken as unchanged.
+   */
+  bool Unchanged(uint32_t entry, const struct stat &s) const;
+  /** @} */
+
+  /**
+   * @brief record a directory for the next Save().
+   *
+   * @param parent return value of the parent's Record(), kNone for the root.
+   *
+   * @return the recorded entry.
+   */
+  uint32_t Record(uint32_t parent, const std::string &name,
+                  const struct stat &s);
+
+  /**
+   * @brief count directories that were read from disk or taken from
+   * the index, for reporting.
+   */
+  void CountRead()   { ++this->read_dirs_; }
+  void CountReused() { ++this->reused_dirs_; }
+  size_t read_dirs() const { return this->read_dirs_; }
+  size_t reused_dirs() const { return this->reused_dirs_; }
+
+  struct Entry {
+    uint64_t ino;
+    uint64_t dev;
+    int64_t  mtime_sec;
+    int64_t  mtime_nsec;
+    uint32_t parent;
+    uint32_t first_child;
+    uint32_t next_sibling;
+    uint32_t name_offset;
+    uint32_t name_length;
+    uint32_t reserved;
+  };
+
+ private:
+  void Unmap();
+
+  /// loaded index
+  void          *map_;
+  size_t         map_size_;
+  const Entry   *entries_;
+  uint32_t       entry_count_;
+  const char    *names_;
+  uint64_t       names_size_;
+  int64_t        started_;          /// ns, when its recording started
+
+  /// recorded while watching
+  std::vector<Entry>              records_;
+  std::vector<uint32_t>           last_child_;
+  std::string                     record_names_;
+  std::map<std::string, uint32_t> interned_;
+  int64_t                         record_started_;   /// ns
+
+  size_t read_dirs_;
+  size_t reused_dirs_;
+};
+
+} // end of linux ns
+
+#endif /* end of include guard: LINUX_DIR_INDEX_H_ */
@@ -0,0 +1,586 @@
+#include "elf_strip.h"
+#include "file_ops.h"
+
+#include <elf.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <algorithm>
+#include <system_error>
+#include <vector>
+
+namespace linux
+{
+
+namespace {
+
+struct Elf32Types {
+  typedef Elf32_Ehdr Ehdr;
+  typedef Elf32_Phdr Phdr;
+  typedef Elf32_Shdr Shdr;
+  typedef Elf32_Off  Off;
+};
+
+struct Elf64Types {
+  typedef Elf64_Ehdr Ehdr;
+  typedef Elf64_Phdr Phdr;
+  typedef Elf64_Shdr Shdr;
+  typedef Elf64_Off  Off;
+};
+
+template <typename T>
+void Swap(T &v) {
+  char *p = reinterpret_cast<char*>(&v);
+  std::reverse(p, p + sizeof(T));
+}
+
+/// The SwapXxx() convert between file and host byte order, both ways.
+template <typename Ehdr>
+void SwapEhdr(Ehdr &h) {
+  Swap(h.e_type);      Swap(h.e_machine);   Swap(h.e_version);
+  Swap(h.e_entry);     Swap(h.e_phoff);     Swap(h.e_shoff);
+  Swap(h.e_flags);     Swap(h.e_ehsize);    Swap(h.e_phentsize);
+  Swap(h.e_phnum);     Swap(h.e_shentsize); Swap(h.e_shnum);
+  Swap(h.e_shstrndx);
+}
+
+template <typename Phdr>
+void SwapPhdr(Phdr &h) {
+  Swap(h.p_type);   Swap(h.p_offset); Swap(h.p_vaddr); Swap(h.p_paddr);
+  Swap(h.p_filesz); Swap(h.p_memsz);  Swap(h.p_flags); Swap(h.p_align);
+}
+
+template <typename Shdr>
+void SwapShdr(Shdr &h) {
+  Swap(h.sh_name);   Swap(h.sh_type);   Swap(h.sh_flags);
+  Swap(h.sh_addr);   Swap(h.sh_offset); Swap(h.sh_size);
+  Swap(h.sh_link);   Swap(h.sh_info);   Swap(h.sh_addralign);
+  Swap(h.sh_entsize);
+}
+
+uint64_t AlignUp(uint64_t value, uint64_t align) {
+  if(align <= 1) return value;
+  return (value + align - 1) / align * align;
+}
+
+bool IsDebugSection(const char *name) {
+  return 0 == strncmp(name, ".debug_", 7)  ||
+         0 == strncmp(name, ".zdebug_", 8) ||
+         0 == strcmp(name, ".symtab")      ||
+         0 == strcmp(name, ".gdb_index")   ||
+         0 == strcmp(name, ".stab")        ||
+         0 == strcmp(name, ".stabstr");
+}
+
+bool IsRelocation(uint32_t type) {
+  return SHT_REL == type || SHT_RELA == type;
+}
+
+/// hex string of the NT_GNU_BUILD_ID note, empty if there is none.
+std::string FindBuildId(const char *notes, uint64_t size, bool swap) {
+
+  static const char hex[] = "0123456789abcdef";
+  uint64_t pos = 0;
+
+  /// Elf32_Nhdr and Elf64_Nhdr are the same.
+  while(size - pos >= sizeof(Elf32_Nhdr)) {
+    Elf32_Nhdr note;
+    memcpy(&note, notes + pos, sizeof(note));
+    if(swap) {
+      Swap(note.n_namesz); Swap(note.n_descsz); Swap(note.n_type);
+    }
+    pos += sizeof(note);
+
+    uint64_t name_size = AlignUp(note.n_namesz, 4);
+    uint64_t desc_size = AlignUp(note.n_descsz, 4);
+    if(name_size > size - pos) break;
+    const char *name = notes + pos;
+    pos += name_size;
+
+    if(desc_size > size - pos) break;
+    const unsigned char *desc =
+        reinterpret_cast<const unsigned char*>(notes + pos);
+    pos += desc_size;
+
+    if(NT_GNU_BUILD_ID == note.n_type && 4 == note.n_namesz &&
+       0 == memcmp(name, "GNU", 4) && note.n_descsz > 1) {
+      std::string id;
+      for(uint32_t i = 0; i < note.n_descsz; ++i) {
+        id.push_back(hex[desc[i] >> 4]);
+        id.push_back(hex[desc[i] & 0xf]);
+      }
+      return id;
+    }
+  }
+
+  return std::string();
+}
+
+class OutputFile final {
+ public:
+  explicit OutputFile(int fd) : fd_(fd) {
+    CHECK_LINUX_FUN_RETURN_OR_THROW(fd);
+  }
+
+  ~OutputFile() { if(-1 != this->fd_) ::close(this->fd_); }
+
+  void Write(const void *buf, uint64_t size, uint64_t offset) {
+    WriteAll(this->fd_, buf, size, offset);
+  }
+
+  int get() const { return this->fd_; }
+
+  void Close() {
+    int fd = this->fd_;
+    this->fd_ = -1;
+    CHECK_LINUX_FUN_RETURN_OR_THROW(::close(fd));
+  }
+
+ private:
+  OutputFile(const OutputFile&) = delete;
+  OutputFile& operator=(const OutputFile&) = delete;
+
+  int fd_;
+};
+
+struct Chunk {
+  uint64_t source_offset;
+  uint64_t size;
+  uint64_t target_offset;
+};
+
+template <typename Types>
+class ElfImage final {
+ public:
+  typedef typename Types::Ehdr Ehdr;
+  typedef typename Types::Phdr Phdr;
+  typedef typename Types::Shdr Shdr;
+
+  ElfImage(const MappedFile &file, bool swap)
+    : base_(file.data()), size_(file.size()), swap_(swap) { }
+
+  /**
+   * @return false if the file isn't an executable or shared object, is
+   * malformed, or has nothing to strip.
+   */
+  bool Parse();
+
+  void WriteStripped(const std::string &target, mode_t mode) const;
+  void WriteDebug(const std::string &target) const;
+
+  std::string BuildId() const;
+
+ private:
+  const char* NameOf(const Shdr &s) const;
+  void WriteHeaders(OutputFile &out,
+                    Ehdr ehdr,
+                    std::vector<Phdr> phdrs,
+                    std::vector<Shdr> shdrs) const;
+
+  const char        *base_;
+  uint64_t           size_;
+  bool               swap_;
+  Ehdr               ehdr_;
+  std::vector<Phdr>  phdrs_;
+  std::vector<Shdr>  shdrs_;
+  std::vector<bool>  removed_;
+};
+
+template <typename Types>
+bool ElfImage<Types>::Parse() {
+
+  if(this->size_ < sizeof(Ehdr)) return false;
+
+  memcpy(&this->ehdr_, this->base_, sizeof(Ehdr));
+  if(this->swap_) SwapEhdr(this->ehdr_);
+
+  const Ehdr &e = this->ehdr_;
+
+  if(ET_EXEC != e.e_type && ET_DYN != e.e_type) return false;
+
+  /// extended section numbering isn't worth supporting here.
+  if(sizeof(Shdr) != e.e_shentsize || 0 == e.e_shnum ||
+     e.e_shnum >= SHN_LORESERVE || SHN_UNDEF == e.e_shstrndx ||
+     e.e_shstrndx >= e.e_shnum) {
+    return false;
+  }
+
+  if(e.e_shoff > this->size_ ||
+     uint64_t(e.e_shnum) * sizeof(Shdr) > this->size_ - e.e_shoff) {
+    return false;
+  }
+
+  if(e.e_phnum > 0 &&
+     (sizeof(Phdr) != e.e_phentsize || e.e_phoff > this->size_ ||
+      uint64_t(e.e_phnum) * sizeof(Phdr) > this->size_ - e.e_phoff)) {
+    return false;
+  }
+
+  this->phdrs_.resize(e.e_phnum);
+  for(size_t i = 0; i < this->phdrs_.size(); ++i) {
+    memcpy(&this->phdrs_[i], this->base_ + e.e_phoff + i * sizeof(Phdr),
+           sizeof(Phdr));
+    if(this->swap_) SwapPhdr(this->phdrs_[i]);
+
+    const Phdr &p = this->phdrs_[i];
+    if(p.p_offset > this->size_ || p.p_filesz > this->size_ - p.p_offset) {
+      return false;
+    }
+  }
+
+  this->shdrs_.resize(e.e_shnum);
+  for(size_t i = 0; i < this->shdrs_.size(); ++i) {
+    memcpy(&this->shdrs_[i], this->base_ + e.e_shoff + i * sizeof(Shdr),
+           sizeof(Shdr));
+    if(this->swap_) SwapShdr(this->shdrs_[i]);
+
+    const Shdr &s = this->shdrs_[i];
+    if(SHT_NOBITS != s.sh_type &&
+       (s.sh_offset > this->size_ || s.sh_size > this->size_ - s.sh_offset)) {
+      return false;
+    }
+  }
+
+  if(SHT_NOBITS == this->shdrs_[e.e_shstrndx].sh_type) return false;
+
+  const size_t shnum = this->shdrs_.size();
+  std::vector<bool> &removed = this->removed_;
+  removed.assign(shnum, false);
+
+  bool any = false;
+  for(size_t i = 1; i < shnum; ++i) {
+    const Shdr &s = this->shdrs_[i];
+    if(!(SHF_ALLOC & s.sh_flags) && IsDebugSection(this->NameOf(s))) {
+      removed[i] = any = true;
+    }
+  }
+
+  if(!any) return false;
+
+  /// relocations against removed sections, or using the removed .symtab.
+  for(size_t i = 1; i < shnum; ++i) {
+    const Shdr &s = this->shdrs_[i];
+    if(SHF_ALLOC & s.sh_flags || !IsRelocation(s.sh_type)) continue;
+
+    if((s.sh_info < shnum && removed[s.sh_info]) ||
+       (s.sh_link < shnum && removed[s.sh_link])) {
+      removed[i] = true;
+    }
+  }
+
+  /// string tables that only removed sections use, e.g. .strtab
+  for(size_t i = 1; i < shnum; ++i) {
+    const Shdr &s = this->shdrs_[i];
+    if(SHF_ALLOC & s.sh_flags || SHT_STRTAB != s.sh_type ||
+       i == e.e_shstrndx) {
+      continue;
+    }
+
+    bool used_by_kept = false, used_by_removed = false;
+    for(size_t j = 1; j < shnum; ++j) {
+      if(this->shdrs_[j].sh_link != i) continue;
+      (removed[j] ? used_by_removed : used_by_kept) = true;
+    }
+
+    if(used_by_removed && !used_by_kept) removed[i] = true;
+  }
+
+  return true;
+}
+
+template <typename Types>
+const char* ElfImage<Types>::NameOf(const Shdr &s) const {
+
+  const Shdr &strtab = this->shdrs_[this->ehdr_.e_shstrndx];
+  const char *names = this->base_ + strtab.sh_offset;
+
+  if(s.sh_name >= strtab.sh_size ||
+     nullptr == memchr(names + s.sh_name, '\0', strtab.sh_size - s.sh_name)) {
+    return "";
+  }
+
+  return names + s.sh_name;
+}
+
+template <typename Types>
+std::string ElfImage<Types>::BuildId() const {
+
+  for(auto &s : this->shdrs_) {
+    if(SHT_NOTE != s.sh_type) continue;
+
+    std::string id = FindBuildId(this->base_ + s.sh_offset,
+                                 s.sh_size, this->swap_);
+    if(!id.empty()) return id;
+  }
+
+  return std::string();
+}
+
+template <typename Types>
+void ElfImage<Types>::WriteHeaders(OutputFile &out,
+                                   Ehdr ehdr,
+                                   std::vector<Phdr> phdrs,
+                                   std::vector<Shdr> shdrs) const {
+
+  uint64_t phoff = ehdr.e_phoff;
+  uint64_t shoff = ehdr.e_shoff;
+
+  if(this->swap_) {
+    SwapEhdr(ehdr);
+    for(auto &p : phdrs) SwapPhdr(p);
+    for(auto &s : shdrs) SwapShdr(s);
+  }
+
+  out.Write(&ehdr, sizeof(Ehdr), 0);
+  if(!phdrs.empty()) {
+    out.Write(phdrs.data(), phdrs.size() * sizeof(Phdr), phoff);
+  }
+  out.Write(shdrs.data(), shdrs.size() * sizeof(Shdr), shoff);
+}
+
+/// The loadable image stays where it is, byte for byte. Kept sections
+/// behind it are packed right after it, followed by the section headers.
+template <typename Types>
+void ElfImage<Types>::WriteStripped(const std::string &target,
+                                    mode_t mode) const {
+
+  const size_t shnum = this->shdrs_.size();
+
+  uint64_t image_end = sizeof(Ehdr);
+  if(!this->phdrs_.empty()) {
+    image_end = std::max<uint64_t>(
+        image_end, this->ehdr_.e_phoff + this->phdrs_.size() * sizeof(Phdr));
+  }
+
+  for(auto &p : this->phdrs_) {
+    image_end = std::max<uint64_t>(image_end, p.p_offset + p.p_filesz);
+  }
+
+  for(size_t i = 1; i < shnum; ++i) {
+    const Shdr &s = this->shdrs_[i];
+    if(!this->removed_[i] && SHF_ALLOC & s.sh_flags &&
+       SHT_NOBITS != s.sh_type) {
+      image_end = std::max<uint64_t>(image_end, s.sh_offset + s.sh_size);
+    }
+  }
+
+  std::vector<size_t> index(shnum, 0);
+  std::vector<size_t> kept;
+  std::vector<size_t> moved;
+
+  for(size_t i = 0; i < shnum; ++i) {
+    if(this->removed_[i]) continue;
+
+    index[i] = kept.size();
+    kept.push_back(i);
+
+    const Shdr &s = this->shdrs_[i];
+    if(SHT_NOBITS != s.sh_type && s.sh_size > 0 &&
+       s.sh_offset + s.sh_size > image_end) {
+      moved.push_back(i);
+    }
+  }
+
+  std::sort(moved.begin(), moved.end(), [&](size_t a, size_t b) {
+    return this->shdrs_[a].sh_offset < this->shdrs_[b].sh_offset;
+  });
+
+  std::vector<uint64_t> offsets(shnum);
+  for(size_t i = 0; i < shnum; ++i) offsets[i] = this->shdrs_[i].sh_offset;
+
+  std::vector<Chunk> chunks;
+  uint64_t cursor = image_end;
+  for(size_t i : moved) {
+    const Shdr &s = this->shdrs_[i];
+    cursor = AlignUp(cursor, s.sh_addralign);
+    offsets[i] = cursor;
+    chunks.push_back(Chunk{ s.sh_offset, s.sh_size, cursor });
+    cursor += s.sh_size;
+  }
+
+  std::vector<Shdr> shdrs;
+  for(size_t i : kept) {
+    Shdr s = this->shdrs_[i];
+    s.sh_offset = offsets[i];
+
+    if(s.sh_link < shnum) s.sh_link = index[s.sh_link];
+
+    if((IsRelocation(s.sh_type) || SHF_INFO_LINK & s.sh_flags) &&
+       s.sh_info < shnum) {
+      s.sh_info = index[s.sh_info];
+    }
+
+    shdrs.push_back(s);
+  }
+
+  Ehdr ehdr = this->ehdr_;
+  ehdr.e_shoff    = AlignUp(cursor, sizeof(typename Types::Off));
+  ehdr.e_shnum    = kept.size();
+  ehdr.e_shstrndx = index[this->ehdr_.e_shstrndx];
+
+  OutputFile out(::open(target.c_str(),
+                        O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode));
+
+  out.Write(this->base_ + sizeof(Ehdr), image_end - sizeof(Ehdr),
+            sizeof(Ehdr));
+
+  for(auto &chunk : chunks) {
+    out.Write(this->base_ + chunk.source_offset, chunk.size,
+              chunk.target_offset);
+  }
+
+  /// program headers are part of the image written above.
+  WriteHeaders(out, ehdr, std::vector<Phdr>(), shdrs);
+  out.Close();
+}
+
+/// Same section table as the input, so debuggers can match it. Only the
+/// removed sections, notes and section names have contents, everything
+/// else becomes SHT_NOBITS.
+template <typename Types>
+void ElfImage<Types>::WriteDebug(const std::string &target) const {
+
+  const size_t shnum = this->shdrs_.size();
+  const uint64_t shstrndx = this->ehdr_.e_shstrndx;
+
+  Ehdr ehdr = this->ehdr_;
+  uint64_t cursor = sizeof(Ehdr);
+
+  std::vector<Phdr> phdrs = this->phdrs_;
+  ehdr.e_phoff = phdrs.empty() ? 0 : cursor;
+  cursor += phdrs.size() * sizeof(Phdr);
+
+  for(auto &p : phdrs) {
+    p.p_offset = 0;
+    p.p_filesz = 0;
+  }
+
+  std::vector<Chunk> chunks;
+  std::vector<Shdr>  shdrs = this->shdrs_;
+
+  for(size_t i = 1; i < shnum; ++i) {
+    Shdr &s = shdrs[i];
+
+    bool has_contents = SHT_NOBITS != s.sh_type &&
+                        (this->removed_[i] ||
+                         SHT_NOTE == s.sh_type ||
+                         shstrndx == i);
+
+    if(has_contents) {
+      cursor = AlignUp(cursor, s.sh_addralign);
+      chunks.push_back(Chunk{ s.sh_offset, s.sh_size, cursor });
+      s.sh_offset = cursor;
+      cursor += s.sh_size;
+    } else {
+      s.sh_type   = SHT_NOBITS;
+      s.sh_offset = cursor;
+    }
+  }
+
+  ehdr.e_shoff = AlignUp(cursor, sizeof(typename Types::Off));
+
+  /// another thread may write the same build-id, e.g. for hardlinks.
+  std::string temp = target + ".XXXXXX";
+  std::vector<char> temp_name(temp.begin(), temp.end());
+  temp_name.push_back('\0');
+
+  OutputFile out(::mkostemp(temp_name.data(), O_CLOEXEC));
+
+  try {
+
+    CHECK_LINUX_FUN_RETURN_OR_THROW(::fchmod(out.get(), 0644));
+
+    for(auto &chunk : chunks) {
+      out.Write(this->base_ + chunk.source_offset, chunk.size,
+                chunk.target_offset);
+    }
+
+    WriteHeaders(out, ehdr, phdrs, shdrs);
+    out.Close();
+
+    CHECK_LINUX_FUN_RETURN_OR_THROW(::rename(temp_name.data(),
+                                             target.c_str()));
+  }
+  catch(...) {
+    ::unlink(temp_name.data());
+    throw;
+  }
+}
+
+template <typename Types>
+bool StripImage(const MappedFile &in,
+                bool swap,
+                const std::string &debug_root,
+                const std::string &target,
+                const std::string &relative_path,
+                mode_t mode) {
+
+  ElfImage<Types> image(in, swap);
+  if(!image.Parse()) return false;
+
+  std::string debug_dir = debug_root + "/usr/lib/debug";
+  std::string debug_file;
+
+  std::string id = image.BuildId();
+  if(!id.empty()) {
+    debug_dir += "/.build-id/" + id.substr(0, 2);
+    debug_file = debug_dir + "/" + id.substr(2) + ".debug";
+  } else {
+    /// relative_path is like /usr/bin/app
+    debug_file = debug_dir + relative_path + ".debug";
+    debug_dir  = debug_file.substr(0, debug_file.find_last_of('/'));
+  }
+
+  MakeDirectories(debug_dir);
+  image.WriteDebug(debug_file);
+  image.WriteStripped(target, mode);
+
+  return true;
+}
+
+}
+
+ElfStripper::ElfStripper(const std::string &debug_root)
+  : debug_root_(debug_root) {
+
+}
+
+bool ElfStripper::StripTo(const std::string &source,
+                          const std::string &target,
+                          const std::string &relative_path,
+                          mode_t mode) const {
+
+  MappedFile in(source);
+
+  if(in.size() < EI_NIDENT || 0 != memcmp(in.data(), ELFMAG, SELFMAG)) {
+    return false;
+  }
+
+  const unsigned char *ident =
+      reinterpret_cast<const unsigned char*>(in.data());
+
+  bool swap;
+  switch(ident[EI_DATA]) {
+    case ELFDATA2LSB: swap = __BYTE_ORDER != __LITTLE_ENDIAN; break;
+    case ELFDATA2MSB: swap = __BYTE_ORDER != __BIG_ENDIAN;    break;
+    default:          return false;
+  }
+
+  switch(ident[EI_CLASS]) {
+    case ELFCLASS32:
+      return StripImage<Elf32Types>(in, swap, this->debug_root_,
+                                    target, relative_path, mode);
+    case ELFCLASS64:
+      return StripImage<Elf64Types>(in, swap, this->debug_root_,
+                                    target, relative_path, mode);
+    default:
+      return false;
+  }
+}
+
+} /// ns infra
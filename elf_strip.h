@@ -0,0 +1,55 @@
+
+#ifndef LINUX_ELF_STRIP_H_
+#define LINUX_ELF_STRIP_H_
+
+#include <sys/types.h>
+
+#include <string>
+
+namespace linux
+{
+
+/**
+ * @brief Writes ELF executables and shared objects without their
+ * .debug_* and symbol table sections, and keeps those sections in a
+ * separate debug file. What 'strip' plus 'objcopy --only-keep-debug' do,
+ * but reading the input once and writing each output once.
+ *
+ * Both ELF classes and byte orders are handled, so cross compiled files
+ * work on any host.
+ */
+class ElfStripper final {
+ public:
+
+  /**
+   * @param debug_root root of the -dbg tree. Debug files go to
+   * usr/lib/debug/.build-id/xx/yyyy.debug under it, or to
+   * usr/lib/debug/<relative path>.debug when there is no build-id.
+   */
+  explicit ElfStripper(const std::string &debug_root);
+
+  /**
+   * @brief write a stripped copy of source to target, and the debug
+   * file into the -dbg tree.
+   *
+   * @exception system_error Indicates an I/O error.
+   *
+   * @param relative_path path of target inside the package, e.g.
+   * /usr/bin/app.
+   * @param mode mode of the created target.
+   *
+   * @return false if source isn't an executable or shared object with
+   * anything to strip. Nothing was written then.
+   */
+  bool StripTo(const std::string &source,
+               const std::string &target,
+               const std::string &relative_path,
+               mode_t mode) const;
+
+ private:
+  std::string debug_root_;
+};
+
+} // end of linux ns
+
+#endif /* end of include guard: LINUX_ELF_STRIP_H_ */
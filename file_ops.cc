@@ -0,0 +1,210 @@
+#include "file_ops.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <linux/limits.h>
+
+#include <system_error>
+#include <memory>
+
+namespace linux
+{
+
+namespace {
+
+class FileDescriptor final {
+ public:
+  explicit FileDescriptor(int fd) : fd_(fd) { }
+  ~FileDescriptor() { if(-1 != this->fd_) ::close(this->fd_); }
+
+  int get() const { return this->fd_; }
+
+ private:
+  FileDescriptor(const FileDescriptor&) = delete;
+  FileDescriptor& operator=(const FileDescriptor&) = delete;
+
+  int fd_;
+};
+
+}
+
+std::string CombineToFullPath(const std::string &path,
+                              const std::string &file) {
+
+  if(file.empty()) return path;
+
+  if('/' != path.back() && '/' != file.front()) {
+    return path + "/" + file;
+  } else if('/' == path.back() && '/' == file.front()) {
+    return path + file.substr(1);
+  }
+
+  return path + file;
+}
+
+void PutVarint(std::string &out, uint64_t v) {
+  while(v >= 0x80) {
+    out.push_back(char(0x80 | (v & 0x7f)));
+    v >>= 7;
+  }
+  out.push_back(char(v));
+}
+
+bool GetVarint(const char *&p, const char *end, uint64_t &v) {
+  v = 0;
+  for(int shift = 0; shift < 64; shift += 7) {
+    if(p >= end) return false;
+    unsigned char byte = *p++;
+    v |= uint64_t(byte & 0x7f) << shift;
+    if(!(byte & 0x80)) return true;
+  }
+  return false;
+}
+
+uint64_t Fnv1a(const void *data, size_t size, uint64_t hash) {
+  const unsigned char *p = static_cast<const unsigned char*>(data);
+  for(size_t i = 0; i < size; ++i) {
+    hash ^= p[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+void MakeDirectories(const std::string &path, mode_t mode) {
+
+  if(path.empty()) return;
+
+  if(0 == ::mkdir(path.c_str(), mode) || EEXIST == errno) {
+    return;
+  }
+
+  if(ENOENT != errno) THROW_API_CALL_ERROR();
+
+  /// parent is missing, create it first.
+  std::string::size_type last_blash_pos = path.find_last_of('/');
+  if(std::string::npos != last_blash_pos && 0 != last_blash_pos) {
+    MakeDirectories(path.substr(0, last_blash_pos), 0777);
+  }
+
+  if(0 != ::mkdir(path.c_str(), mode) && EEXIST != errno) {
+    THROW_API_CALL_ERROR();
+  }
+}
+
+void CopyRegularFile(const std::string &source,
+                     const std::string &target,
+                     mode_t mode) {
+
+  FileDescriptor in(::open(source.c_str(), O_RDONLY | O_CLOEXEC));
+  CHECK_LINUX_FUN_RETURN_OR_THROW(in.get());
+
+  FileDescriptor out(::open(target.c_str(),
+                            O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                            mode));
+  CHECK_LINUX_FUN_RETURN_OR_THROW(out.get());
+
+  /// let the kernel copy (or reflink) the data, fall back to read/write
+  /// when source and target are on file systems that don't support it.
+  ssize_t copied;
+  while((copied = ::copy_file_range(in.get(), nullptr,
+                                    out.get(), nullptr,
+                                    1 << 30, 0)) > 0) {
+  }
+
+  if(0 == copied) return;
+
+  if(EXDEV != errno && ENOSYS != errno &&
+     EINVAL != errno && EOPNOTSUPP != errno) {
+    THROW_API_CALL_ERROR();
+  }
+
+  /// both offsets were advanced by what copy_file_range() managed.
+  off_t offset = ::lseek(out.get(), 0, SEEK_CUR);
+  CHECK_LINUX_FUN_RETURN_OR_THROW(offset);
+
+  std::unique_ptr<char[]> buffer(new char[1 << 17]);
+  ssize_t nread;
+  while((nread = ::read(in.get(), buffer.get(), 1 << 17)) > 0) {
+    WriteAll(out.get(), buffer.get(), nread, offset);
+    offset += nread;
+  }
+
+  CHECK_LINUX_FUN_RETURN_OR_THROW(nread);
+}
+
+void CopySymlink(const std::string &source, const std::string &target) {
+
+  char link[PATH_MAX];
+  ssize_t size = ::readlink(source.c_str(), link, sizeof(link) - 1);
+  CHECK_LINUX_FUN_RETURN_OR_THROW(size);
+  link[size] = '\0';
+
+  if(0 != ::symlink(link, target.c_str())) {
+    if(EEXIST != errno) THROW_API_CALL_ERROR();
+
+    CHECK_LINUX_FUN_RETURN_OR_THROW(::unlink(target.c_str()));
+    CHECK_LINUX_FUN_RETURN_OR_THROW(::symlink(link, target.c_str()));
+  }
+}
+
+void CopyNode(const std::string &target, mode_t mode, dev_t rdev) {
+
+  auto make = [&]() {
+    return S_ISFIFO(mode) ? ::mkfifo(target.c_str(), mode & 07777)
+                          : ::mknod(target.c_str(), mode, rdev);
+  };
+
+  if(0 != make()) {
+    if(EEXIST != errno) THROW_API_CALL_ERROR();
+
+    CHECK_LINUX_FUN_RETURN_OR_THROW(::unlink(target.c_str()));
+    CHECK_LINUX_FUN_RETURN_OR_THROW(make());
+  }
+
+  CHECK_LINUX_FUN_RETURN_OR_THROW(::chmod(target.c_str(), mode & 07777));
+}
+
+void WriteAll(int fd, const void *buf, size_t size, off_t offset) {
+
+  const char *p = static_cast<const char*>(buf);
+
+  while(size > 0) {
+    ssize_t written = ::pwrite(fd, p, size, offset);
+    if(-1 == written) {
+      if(EINTR == errno) continue;
+      THROW_API_CALL_ERROR();
+    }
+
+    p      += written;
+    size   -= written;
+    offset += written;
+  }
+}
+
+MappedFile::MappedFile(const std::string &path)
+  : data_(nullptr), size_(0) {
+
+  FileDescriptor fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  CHECK_LINUX_FUN_RETURN_OR_THROW(fd.get());
+
+  struct stat s;
+  CHECK_LINUX_FUN_RETURN_OR_THROW(::fstat(fd.get(), &s));
+
+  this->size_ = s.st_size;
+  if(0 == this->size_) return;
+
+  void *p = ::mmap(nullptr, this->size_, PROT_READ, MAP_PRIVATE, fd.get(), 0);
+  if(MAP_FAILED == p) THROW_API_CALL_ERROR();
+
+  this->data_ = static_cast<const char*>(p);
+}
+
+MappedFile::~MappedFile() {
+  if(nullptr != this->data_) {
+    ::munmap(const_cast<char*>(this->data_), this->size_);
+  }
+}
+
+} /// ns infra
@@ -0,0 +1,125 @@
+
+#ifndef LINUX_FILE_OPS_H_
+#define LINUX_FILE_OPS_H_
+
+#include <errno.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <system_error>
+
+/// throw the errno of a call that returned -1.
+#define CHECK_LINUX_FUN_RETURN_OR_THROW(VAR)                \
+  do {                                                      \
+  if(-1 == VAR)                                             \
+    throw std::system_error(errno, std::system_category()); \
+  } while(0)
+
+#define THROW_API_CALL_ERROR()                              \
+  do {                                                      \
+    throw std::system_error(errno, std::system_category()); \
+  } while(0)
+
+namespace linux
+{
+
+/**
+ * @brief join path and file with exactly one '/' between them.
+ *
+ * @return path if file is empty.
+ */
+std::string CombineToFullPath(const std::string &path,
+                              const std::string &file);
+
+/**
+ * @brief append v in 7 bit groups, low first, the high bit set on all
+ * but the last.
+ */
+void PutVarint(std::string &out, uint64_t v);
+
+/**
+ * @brief read what PutVarint() wrote and move p past it.
+ *
+ * @return false if it runs past end or over 64 bits.
+ */
+bool GetVarint(const char *&p, const char *end, uint64_t &v);
+
+const uint64_t kFnv1aBasis = 0xcbf29ce484222325ULL;
+
+/**
+ * @brief 64 bit FNV-1a of size bytes, continued from hash.
+ */
+uint64_t Fnv1a(const void *data, size_t size, uint64_t hash = kFnv1aBasis);
+
+/**
+ * @brief same as 'mkdir -p'. Existing directories are not an error.
+ *
+ * @exception system_error Indicates the error.
+ */
+void MakeDirectories(const std::string &path, mode_t mode = 0777);
+
+/**
+ * @brief copy the contents of a regular file, target is created or
+ * truncated with the given mode.
+ *
+ * @exception system_error Indicates the error.
+ */
+void CopyRegularFile(const std::string &source,
+                     const std::string &target,
+                     mode_t mode);
+
+/**
+ * @brief create target as a symbolic link to where source points.
+ *
+ * @exception system_error Indicates the error.
+ */
+void CopySymlink(const std::string &source, const std::string &target);
+
+/**
+ * @brief create target as a device, fifo or socket of mode (type and
+ * permissions, which umask doesn't narrow) and rdev. An existing target
+ * is replaced.
+ *
+ * @exception system_error Indicates the error.
+ */
+void CopyNode(const std::string &target, mode_t mode, dev_t rdev);
+
+/**
+ * @brief pwrite() until all size bytes are written.
+ *
+ * @exception system_error Indicates the error.
+ */
+void WriteAll(int fd, const void *buf, size_t size, off_t offset);
+
+/**
+ * @brief read-only private mapping of a whole file.
+ */
+class MappedFile final {
+ public:
+
+  /**
+   * @exception system_error if the file can't be opened or mapped.
+   */
+  explicit MappedFile(const std::string &path);
+
+  ~MappedFile();
+
+ private:
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+ public:
+
+  const char* data() const { return this->data_; }
+  size_t size() const { return this->size_; }
+
+ private:
+  const char *data_;
+  size_t      size_;
+};
+
+} // end of linux ns
+
+#endif /* end of include guard: LINUX_FILE_OPS_H_ */
@@ -1,5 +1,6 @@
 
 #include "inotify.h"
+#include "file_ops.h"
 
 #include <cstdio>
 
@@ -26,27 +27,6 @@ namespace linux
 
 namespace {
 
-#define CHECK_LINUX_FUN_RETURN_OR_THROW(VAR)                \
-  do {                                                      \
-  if(-1 == VAR)                                             \
-    throw std::system_error(errno, std::system_category()); \
-  } while(0)
-
-#define THROW_API_CALL_ERROR()                              \
-  do {                                                      \
-    throw std::system_error(errno, std::system_category()); \
-  } while(0)
-
-bool IsDirectory(const std::string &dir) {
-  struct stat s;
-
-  if(!lstat(dir.c_str(), &s)) {
-    return S_ISDIR(s.st_mode) && !S_ISLNK(s.st_mode);
-  }
-
-  return false;
-}
-
 bool OneOrTwoDotsDir(struct dirent *entry) {
 
   return std::string(".")  == entry->d_name ||
@@ -64,28 +44,10 @@ void DetermineDetails(const char *path) {
   }
 }
 
-std::string CombineToFullPath(const std::string &path,
-                              const std::string &file) {
-
-  std::string new_path;
-
-  if(file.size() == 0) return path;
-
-  if('/' != path.back()  && '/' != file.front()) {
-    new_path = path + "/" + file;
-  } else if('/' == path.back()  && '/' == file.front()) {
-    new_path = path;
-    new_path.append(file.begin() + 1, file.end());
-  } else {
-    new_path = path + file;
-  }
-
-  return std::move(new_path);
-}
-
 }
 
-Inotify::Inotify(int flag) {
+Inotify::Inotify(int flag)
+  : filter_(nullptr), index_(nullptr), engine_(nullptr), recorder_(nullptr) {
   this->fd_ = ::inotify_init1(flag);
   CHECK_LINUX_FUN_RETURN_OR_THROW(this->fd_);
 }
@@ -112,33 +74,271 @@ void Inotify::WatchRecursively(const char *path,
 
   if(max_depth < 0) max_depth = std::numeric_limits<int32_t>::max();
 
-  int fd = this->WatchFile(path, events);
+  this->root_ = path;
+
+  PathFilter::Cursor root;
+  if(nullptr != this->filter_) root = this->filter_->Root();
+
+  uint32_t indexed = DirIndex::kNone;
+  if(nullptr != this->index_) indexed = this->index_->Root();
+
+  this->WatchDirectory(path, std::string(), events, max_depth, root,
+                       indexed, DirIndex::kNone);
+}
+
+void Inotify::WatchDirectory(const std::string &path,
+                             const std::string &name,
+                             uint32_t events,
+                             int32_t max_depth,
+                             const PathFilter::Cursor &cursor,
+                             uint32_t indexed,
+                             uint32_t parent_record) {
+
+  Subdirectory root;
+  root.path    = path;
+  root.name    = name;
+  root.cursor  = cursor;
+  root.indexed = indexed;
+  root.known   = true;
+
+  std::vector<Subdirectory> dirs(1, root);
+  this->WatchSubdirectories(dirs, events, max_depth, parent_record, false);
+}
+
+void Inotify::StatPaths(const std::vector<std::string> &paths,
+                        std::vector<struct stat> &stats,
+                        std::vector<int> &errors) {
+
+  if(nullptr != this->engine_) {
+    this->engine_->Stat(paths, stats, errors);
+    return;
+  }
+
+  stats.resize(paths.size());
+  errors.assign(paths.size(), 0);
+  for(size_t i = 0; i < paths.size(); ++i) {
+    if(0 != lstat(paths[i].c_str(), &stats[i])) errors[i] = errno;
+  }
+}
+
+void Inotify::WatchSubdirectories(std::vector<Subdirectory> &dirs,
+                                  uint32_t events,
+                                  int32_t max_depth,
+                                  uint32_t parent_record,
+                                  bool may_vanish) {
+
+  std::vector<std::string> paths;
+  std::vector<struct stat> stats;
+  std::vector<int> errors;
+
+  /// d_type was DT_UNKNOWN, find out which are directories before
+  /// watching them.
+  for(auto &dir : dirs) {
+    if(!dir.known) paths.push_back(dir.path);
+  }
+
+  if(!paths.empty()) {
+    this->StatPaths(paths, stats, errors);
+
+    size_t checked = 0, kept = 0;
+    for(size_t i = 0; i < dirs.size(); ++i) {
+      if(!dirs[i].known) {
+        bool is_dir = 0 == errors[checked] && S_ISDIR(stats[checked].st_mode);
+        ++checked;
+        if(!is_dir) continue;
+      }
+      if(kept != i) dirs[kept] = dirs[i];
+      ++kept;
+    }
+    dirs.resize(kept);
+  }
+
+  std::vector<int> fds;
+  fds.reserve(dirs.size());
+
+  for(size_t i = 0; i < dirs.size(); ++i) {
+    try {
+      fds.push_back(this->WatchFile(dirs[i].path.c_str(), events));
+    }
+    catch(const std::system_error &ex) {
+      /// removed since it was listed, nothing to watch.
+      if(!may_vanish || (ENOENT != ex.code().value() &&
+                         ENOTDIR != ex.code().value())) {
+        throw;
+      }
+      fds.push_back(-1);
+    }
+  }
+
+  /// stat after the watches are in place, later changes show up as
+  /// events. One batch for all siblings.
+  std::vector<uint32_t> records(dirs.size(), DirIndex::kNone);
+  if(nullptr != this->index_) {
+    paths.clear();
+    for(auto &dir : dirs) paths.push_back(dir.path);
+    this->StatPaths(paths, stats, errors);
+
+    for(size_t i = 0; i < dirs.size(); ++i) {
+      if(-1 == fds[i]) continue;
+      if(0 != errors[i] || !S_ISDIR(stats[i].st_mode)) {
+        fds[i] = -1;
+        continue;
+      }
+      records[i] = this->index_->Record(parent_record, dirs[i].name, stats[i]);
+    }
+  }
 
   if(0 == max_depth) {
     return;
   }
 
-  std::shared_ptr<DIR> dir(opendir(path), closedir);
-  if(!dir) {
+  for(size_t i = 0; i < dirs.size(); ++i) {
+    if(-1 == fds[i]) continue;
+    this->ReadDirectory(dirs[i], fds[i],
+                        nullptr != this->index_ ? &stats[i] : nullptr,
+                        events, max_depth, records[i]);
+  }
+}
+
+void Inotify::ReadDirectory(const Subdirectory &dir,
+                            int fd,
+                            const struct stat *s,
+                            uint32_t events,
+                            int32_t max_depth,
+                            uint32_t record) {
+
+  const std::string &path = dir.path;
+  std::vector<Subdirectory> children;
+
+  if(nullptr != s && this->index_->Unchanged(dir.indexed, *s)) {
+
+    /// same directory entries as last time, take subdirectories from
+    /// the index instead of reading it.
+    this->index_->CountReused();
+    this->wd_dir_map[fd] = path;
+    if(nullptr != this->filter_) this->wd_cursor_map[fd] = dir.cursor;
+    if(nullptr != this->recorder_) this->recorder_->Watch(fd, path);
+
+    for(uint32_t child = this->index_->FirstChild(dir.indexed);
+        DirIndex::kNone != child;
+        child = this->index_->NextSibling(child)) {
+
+      Subdirectory subdir;
+      subdir.name = this->index_->Name(child);
+
+      if(nullptr != this->filter_ &&
+         !(PathFilter::kDescend &
+           this->filter_->Test(dir.cursor, subdir.name.c_str(),
+                               &subdir.cursor))) {
+        continue;
+      }
+
+      subdir.path    = CombineToFullPath(path, subdir.name);
+      subdir.indexed = child;
+      subdir.known   = true;
+      children.push_back(subdir);
+    }
+
+    this->WatchSubdirectories(children, events, max_depth - 1, record, true);
+    return;
+  }
+
+  std::shared_ptr<DIR> handle(opendir(path.c_str()), closedir);
+  if(!handle) {
     return;
   } else {
-    this->wd_dir_map[fd] = std::string(path);
+    this->wd_dir_map[fd] = path;
+    if(nullptr != this->filter_) this->wd_cursor_map[fd] = dir.cursor;
+    if(nullptr != this->recorder_) this->recorder_->Watch(fd, path);
+  }
+
+  /// subdirectories may still be unchanged, look them up by name.
+  std::map<std::string, uint32_t> indexed_children;
+  if(nullptr != this->index_) {
+    this->index_->CountRead();
+
+    if(DirIndex::kNone != dir.indexed) {
+      for(uint32_t child = this->index_->FirstChild(dir.indexed);
+          DirIndex::kNone != child;
+          child = this->index_->NextSibling(child)) {
+        indexed_children[this->index_->Name(child)] = child;
+      }
+    }
   }
 
   struct dirent *entry = nullptr;
 
-  while(nullptr !=(entry = readdir(dir.get()))) {
+  while(nullptr !=(entry = readdir(handle.get()))) {
 
-    std::string entry_path = CombineToFullPath(path, entry->d_name);
+    if(OneOrTwoDotsDir(entry)) continue;
 
-    if(IsDirectory(entry_path)) {
-      if(OneOrTwoDotsDir(entry)) continue;
-      this->WatchRecursively(entry_path.c_str(),
-                             events, max_depth - 1);
+    Subdirectory subdir;
+    if(nullptr != this->filter_ &&
+       !(PathFilter::kDescend &
+         this->filter_->Test(dir.cursor, entry->d_name, &subdir.cursor))) {
+      continue;
     }
 
+    /// d_type saves the lstat() of every non-directory entry.
+    if(DT_DIR != entry->d_type && DT_UNKNOWN != entry->d_type) continue;
+
+    subdir.name    = entry->d_name;
+    subdir.path    = CombineToFullPath(path, subdir.name);
+    subdir.indexed = DirIndex::kNone;
+    subdir.known   = DT_DIR == entry->d_type;
+
+    auto found = indexed_children.find(subdir.name);
+    if(indexed_children.end() != found) subdir.indexed = found->second;
+
+    children.push_back(subdir);
+
   } /// while(entry)
 
+  handle.reset();
+  this->WatchSubdirectories(children, events, max_depth - 1, record, true);
+}
+
+void Inotify::WatchCreatedDirectory(const std::string &path,
+                                    uint32_t events,
+                                    int32_t max_depth) {
+
+  PathFilter::Cursor cursor;
+  if(nullptr != this->filter_ &&
+     0 == path.compare(0, this->root_.size(), this->root_)) {
+    cursor = this->filter_->Enter(path.substr(this->root_.size()));
+  }
+
+  DirIndex *index = this->index_;
+  this->index_ = nullptr;
+
+  try {
+    std::string name = path.substr(path.find_last_of('/') + 1);
+    this->WatchDirectory(path, name, events, max_depth, cursor,
+                         DirIndex::kNone, DirIndex::kNone);
+  }
+  catch(...) {
+    this->index_ = index;
+    throw;
+  }
+
+  this->index_ = index;
+}
+
+bool Inotify::IsFilteredOut(const inotify_event *event,
+                            const std::string &name) {
+
+  if(nullptr == this->filter_ || name.empty()) return false;
+
+  auto cursor = this->wd_cursor_map.find(event->wd);
+  if(this->wd_cursor_map.end() == cursor) return false;
+
+  int result = this->filter_->Test(cursor->second, name.c_str(), nullptr);
+
+  /// a new directory is copied with its contents, keep it if anything
+  /// inside may be captured.
+  if(IN_ISDIR & event->mask) return 0 == result;
+
+  return 0 == (PathFilter::kCapture & result);
 }
 
 bool Inotify::RemoveWatch(int wd) {
@@ -147,11 +347,19 @@ bool Inotify::RemoveWatch(int wd) {
   CHECK_LINUX_FUN_RETURN_OR_THROW(ret);
 
   this->wd_dir_map.erase(wd);
+  this->wd_cursor_map.erase(wd);
+  if(nullptr != this->recorder_) this->recorder_->Unwatch(wd);
 
   return ret == 0;
 }
 
 std::vector<InotifyEvent> Inotify::ReadEvents(int timeout_sec) {
+  return this->ReadEvents(std::chrono::milliseconds(
+      timeout_sec < 0 ? -1 : int64_t(timeout_sec) * 1000));
+}
+
+std::vector<InotifyEvent> Inotify::ReadEvents(
+    std::chrono::milliseconds timeout) {
 
   std::vector<InotifyEvent> events;
 
@@ -160,14 +368,14 @@ std::vector<InotifyEvent> Inotify::ReadEvents(int timeout_sec) {
   FD_SET(this->fd_, &read_fds);
 
   struct timeval read_timeout;
-  read_timeout.tv_sec  = timeout_sec;
-  read_timeout.tv_usec = 0;
+  read_timeout.tv_sec  = timeout.count() / 1000;
+  read_timeout.tv_usec = timeout.count() % 1000 * 1000;
 
   int nready = select(this->fd_ + 1,
                       &read_fds,
                       nullptr,
                       nullptr,
-                      timeout_sec < 0 ? nullptr : &read_timeout);
+                      timeout.count() < 0 ? nullptr : &read_timeout);
 
   if(nready > 0) {
 
@@ -177,8 +385,51 @@ std::vector<InotifyEvent> Inotify::ReadEvents(int timeout_sec) {
     }
 
     std::unique_ptr<char[]> read_buffer(new char[bytes_to_read]);
-    read(this->fd_, read_buffer.get(), bytes_to_read);
-    this->ParseInotifyEvents(read_buffer.get(), bytes_to_read, events);
+    ssize_t bytes_read = read(this->fd_, read_buffer.get(), bytes_to_read);
+    if(-1 == bytes_read) {
+      /// interrupted, or nothing left on a non-blocking fd: read next time.
+      if(EINTR == errno || EAGAIN == errno) return events;
+      THROW_API_CALL_ERROR();
+    }
+
+    /// parse what was read and recorded, so a replay sees the same bytes.
+    if(nullptr != this->recorder_ && bytes_read > 0) {
+      this->recorder_->Read(read_buffer.get(), bytes_read);
+    }
+    this->ParseInotifyEvents(read_buffer.get(), bytes_read, events);
+  }
+
+  return events;
+}
+
+std::vector<InotifyEvent> Inotify::Replay(
+    const InotifyRecording &recording,
+    const InotifyRecording::Record &record) {
+
+  std::vector<InotifyEvent> events;
+
+  switch(record.type) {
+    case InotifyRecording::kWatch: {
+      this->root_ = recording.root();
+      this->wd_dir_map[record.wd] = record.dir;
+
+      /// the cursor WatchRecursively() had got there by walking.
+      if(nullptr != this->filter_ &&
+         0 == record.dir.compare(0, this->root_.size(), this->root_)) {
+        this->wd_cursor_map[record.wd] =
+            this->filter_->Enter(record.dir.substr(this->root_.size()));
+      }
+      break;
+    }
+
+    case InotifyRecording::kUnwatch:
+      this->wd_dir_map.erase(record.wd);
+      this->wd_cursor_map.erase(record.wd);
+      break;
+
+    case InotifyRecording::kRead:
+      this->ParseInotifyEvents(record.data, record.size, events);
+      break;
   }
 
   return events;
@@ -191,12 +442,12 @@ Inotify::~Inotify() {
   }
 }
 
-void Inotify::ParseInotifyEvents(char *buf,
-                                 int size,
+void Inotify::ParseInotifyEvents(const char *buf,
+                                 size_t size,
                                  std::vector<InotifyEvent> &events) {
 
   size_t unread_bytes = size;
-  inotify_event* event = reinterpret_cast<inotify_event*>(buf);
+  const inotify_event* event = reinterpret_cast<const inotify_event*>(buf);
 
   do {
 
@@ -219,22 +470,11 @@ void Inotify::ParseInotifyEvents(char *buf,
       break;
     }
 
-    std::string name;
-    if(name_length > 0) {
-      event->name[name_length] = '\0';
-      name = std::move(std::string(event->name));
-    }
-
-    if(0 == event->wd) {
-      InotifyEvent ev(events.back().wd(),
-                      event->mask,
-                      event->cookie,
-                      events.back().file(),
-                      events.back().dir());
-
-      events.push_back(ev);
+    /// the kernel pads name with '\0', see man inotify, but a replayed
+    /// recording may not: never read past the event.
+    std::string name(event->name, strnlen(event->name, name_length));
 
-    } else {
+    if(!this->IsFilteredOut(event, name)) {
 
       InotifyEvent ev(event->wd,
                       event->mask,
@@ -248,8 +488,8 @@ void Inotify::ParseInotifyEvents(char *buf,
 
 
     unread_bytes -= event_size;
-    event   = reinterpret_cast<inotify_event*>(
-                reinterpret_cast<char*>(event) + event_size
+    event   = reinterpret_cast<const inotify_event*>(
+                reinterpret_cast<const char*>(event) + event_size
               );
 
   } while(unread_bytes > 0);
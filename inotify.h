@@ -7,8 +7,14 @@
 
 #include <string>
 #include <map>
+#include <chrono>
 #include <vector>
 
+#include "path_filter.h"
+#include "dir_index.h"
+#include "io_engine.h"
+#include "inotify_record.h"
+
 namespace linux
 {
 
@@ -75,7 +81,70 @@ class Inotify final {
   int WatchFile(const char *filename, uint32_t events);
 
   /**
-   * @brief watch the path recursively.
+   * @brief only watch directories and report events for paths the
+   * filter lets through, relative to the path given to
+   * WatchRecursively(). Set it before watching.
+   *
+   * @param filter nullptr for no filtering. Must outlive this.
+   */
+  void SetFilter(const PathFilter *filter) {
+    this->filter_ = filter;
+  }
+
+  /**
+   * @brief take unchanged directories from index instead of reading
+   * them, and record the watched tree into it. Set it before watching.
+   *
+   * @param index nullptr for no index. Must outlive the watching.
+   */
+  void SetDirIndex(DirIndex *index) {
+    this->index_ = index;
+  }
+
+  /**
+   * @brief stat the directories of a walk in batches through engine
+   * instead of one lstat() at a time. Set it before watching.
+   *
+   * @param engine nullptr for plain lstat(). Must outlive the watching.
+   */
+  void SetIoEngine(IoEngine *engine) {
+    this->engine_ = engine;
+  }
+
+  /**
+   * @brief write the watches and every buffer read to recorder, for
+   * Replay(). Set it before watching.
+   *
+   * @param recorder nullptr to stop recording. Must outlive the watching.
+   */
+  void SetRecorder(InotifyRecorder *recorder) {
+    this->recorder_ = recorder;
+  }
+
+  InotifyRecorder* recorder() const {
+    return this->recorder_;
+  }
+
+  /**
+   * @brief take one record of a recording instead of watching and
+   * reading: a watch goes into the table, a read is parsed and filtered
+   * the way ReadEvents() does it. Nothing is watched for real.
+   *
+   * @return the events of a read, none for the other records.
+   */
+  std::vector<InotifyEvent> Replay(const InotifyRecording &recording,
+                                   const InotifyRecording::Record &record);
+
+  /**
+   * @return the number of directories being watched.
+   */
+  size_t GetWatchedDirCount() const {
+    return this->wd_dir_map.size();
+  }
+
+  /**
+   * @brief watch the path recursively. Subtrees the filter rejects are
+   * not opened at all.
    *
    * @param path path of directory to watch. If the path is a file then
    * the behavior is same as WatchFile(...).
@@ -87,6 +156,17 @@ class Inotify final {
                         uint32_t events,
                         int32_t max_depth = -1);
 
+  /**
+   * @brief watch a directory created below the path given to
+   * WatchRecursively() since, e.g. by an install. The filter applies the
+   * same way.
+   *
+   * @exception system_error Indicates the error.
+   */
+  void WatchCreatedDirectory(const std::string &path,
+                             uint32_t events,
+                             int32_t max_depth);
+
   /**
    * @brief remove an exsiting watch from an inofity instance.
    *
@@ -109,14 +189,62 @@ class Inotify final {
    */
   std::vector<InotifyEvent> ReadEvents(int timeout_sec);
 
+  /**
+   * @brief same as above with a finer timeout, less than 0 waits forever.
+   */
+  std::vector<InotifyEvent> ReadEvents(std::chrono::milliseconds timeout);
+
  private:
 
-  void ParseInotifyEvents(char *buf,
-                          int size,
+  /// a directory found by the walk, not watched yet.
+  struct Subdirectory {
+    std::string        path;
+    std::string        name;
+    PathFilter::Cursor cursor;
+    uint32_t           indexed;
+    bool               known;    /// known to be a directory
+  };
+
+  void WatchDirectory(const std::string &path,
+                      const std::string &name,
+                      uint32_t events,
+                      int32_t max_depth,
+                      const PathFilter::Cursor &cursor,
+                      uint32_t indexed,
+                      uint32_t parent_record);
+
+  /// watch sibling directories, then read each of them.
+  void WatchSubdirectories(std::vector<Subdirectory> &dirs,
+                           uint32_t events,
+                           int32_t max_depth,
+                           uint32_t parent_record,
+                           bool may_vanish);
+
+  void ReadDirectory(const Subdirectory &dir,
+                     int fd,
+                     const struct stat *s,
+                     uint32_t events,
+                     int32_t max_depth,
+                     uint32_t record);
+
+  void StatPaths(const std::vector<std::string> &paths,
+                 std::vector<struct stat> &stats,
+                 std::vector<int> &errors);
+
+  bool IsFilteredOut(const inotify_event *event, const std::string &name);
+
+  void ParseInotifyEvents(const char *buf,
+                          size_t size,
                           std::vector<InotifyEvent> &events);
 
   int fd_;
+  std::string root_;
   std::map<int, std::string> wd_dir_map;
+  std::map<int, PathFilter::Cursor> wd_cursor_map;
+  const PathFilter *filter_;
+  DirIndex *index_;
+  IoEngine *engine_;
+  InotifyRecorder *recorder_;
 
 };
 
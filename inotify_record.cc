@@ -0,0 +1,228 @@
+#include "inotify_record.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <stdexcept>
+#include <system_error>
+
+namespace linux
+{
+
+namespace {
+
+const char     kMagic[8]   = { 'm', 'i', 'X', 'p', 'k', 'g', 'I', 'R' };
+const uint32_t kVersion    = 1;
+const uint32_t kByteOrder  = 0x01020304;
+const size_t   kFlushSize  = 1 << 20;
+const size_t   kAlignment  = 8;
+
+void PutString(std::string &out, const std::string &s) {
+  PutVarint(out, s.size());
+  out.append(s);
+}
+
+template<typename T>
+void PutFixed(std::string &out, T v) {
+  out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+}
+
+InotifyRecorder::InotifyRecorder(const std::string &file,
+                                 const std::string &root,
+                                 const std::vector<std::string> &includes,
+                                 const std::vector<std::string> &excludes)
+  : offset_(0), last_(std::chrono::steady_clock::now()), reads_(0) {
+
+  this->fd_ = ::open(file.c_str(),
+                     O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  CHECK_LINUX_FUN_RETURN_OR_THROW(this->fd_);
+
+  this->buffer_.append(kMagic, sizeof(kMagic));
+  PutFixed(this->buffer_, kVersion);
+  PutFixed(this->buffer_, kByteOrder);
+  PutFixed(this->buffer_, uint32_t(sizeof(struct inotify_event)));
+  PutFixed(this->buffer_, int64_t(::time(nullptr)));
+
+  PutString(this->buffer_, root);
+  PutVarint(this->buffer_, includes.size());
+  for(auto &glob : includes) PutString(this->buffer_, glob);
+  PutVarint(this->buffer_, excludes.size());
+  for(auto &glob : excludes) PutString(this->buffer_, glob);
+}
+
+InotifyRecorder::~InotifyRecorder() {
+  try {
+    this->Flush();
+  }
+  catch(const std::exception&) {
+  }
+
+  ::close(this->fd_);
+}
+
+void InotifyRecorder::Begin(char type) {
+
+  auto now = std::chrono::steady_clock::now();
+  auto micros = std::chrono::duration_cast<std::chrono::microseconds>(
+      now - this->last_).count();
+
+  /// keep the remainder, so the times don't drift from rounding.
+  this->last_ += std::chrono::microseconds(micros);
+
+  this->buffer_.push_back(type);
+  PutVarint(this->buffer_, uint64_t(micros));
+}
+
+void InotifyRecorder::Watch(int wd, const std::string &dir) {
+  this->Begin(InotifyRecording::kWatch);
+  PutVarint(this->buffer_, uint64_t(wd));
+  PutString(this->buffer_, dir);
+
+  if(this->buffer_.size() >= kFlushSize) this->Flush();
+}
+
+void InotifyRecorder::Unwatch(int wd) {
+  this->Begin(InotifyRecording::kUnwatch);
+  PutVarint(this->buffer_, uint64_t(wd));
+
+  if(this->buffer_.size() >= kFlushSize) this->Flush();
+}
+
+void InotifyRecorder::Read(const char *buf, size_t size) {
+  this->Begin(InotifyRecording::kRead);
+  PutVarint(this->buffer_, size);
+
+  size_t end = this->offset_ + this->buffer_.size();
+  this->buffer_.append((kAlignment - end % kAlignment) % kAlignment, '\0');
+  this->buffer_.append(buf, size);
+  ++this->reads_;
+
+  if(this->buffer_.size() >= kFlushSize) this->Flush();
+}
+
+void InotifyRecorder::Flush() {
+  if(this->buffer_.empty()) return;
+
+  WriteAll(this->fd_, this->buffer_.data(), this->buffer_.size(),
+           this->offset_);
+  this->offset_ += this->buffer_.size();
+  this->buffer_.clear();
+}
+
+InotifyRecording::InotifyRecording(const std::string &file)
+  : file_(file), pos_(0), micros_(0) {
+
+  uint32_t version = 0, byte_order = 0, event_size = 0;
+  int64_t started = 0;
+
+  this->Need(sizeof(kMagic) + 3 * sizeof(uint32_t) + sizeof(int64_t));
+  const char *p = this->file_.data();
+
+  if(0 != memcmp(p, kMagic, sizeof(kMagic))) {
+    throw std::runtime_error(file + " isn't an inotify recording");
+  }
+  p += sizeof(kMagic);
+
+  memcpy(&version, p, sizeof(version));
+  p += sizeof(version);
+  memcpy(&byte_order, p, sizeof(byte_order));
+  p += sizeof(byte_order);
+  memcpy(&event_size, p, sizeof(event_size));
+  p += sizeof(event_size);
+  memcpy(&started, p, sizeof(started));
+  p += sizeof(started);
+
+  if(kVersion != version || kByteOrder != byte_order ||
+     sizeof(struct inotify_event) != event_size) {
+    throw std::runtime_error(file + " was recorded by another version or"
+                             " on another architecture");
+  }
+
+  this->started_ = static_cast<time_t>(started);
+  this->pos_ = p - this->file_.data();
+
+  this->root_ = this->String();
+  for(uint64_t n = this->Varint(); n > 0; --n) {
+    this->includes_.push_back(this->String());
+  }
+  for(uint64_t n = this->Varint(); n > 0; --n) {
+    this->excludes_.push_back(this->String());
+  }
+
+  this->first_ = this->pos_;
+}
+
+void InotifyRecording::Need(size_t size) const {
+  if(this->file_.size() - this->pos_ < size) {
+    throw std::runtime_error("the inotify recording is truncated");
+  }
+}
+
+uint64_t InotifyRecording::Varint() {
+  const char *p   = this->file_.data() + this->pos_;
+  const char *end = this->file_.data() + this->file_.size();
+
+  uint64_t v = 0;
+  bool ok = GetVarint(p, end, v);
+  this->pos_ = p - this->file_.data();
+
+  if(!ok) {
+    this->Need(1);   /// ran out, or over 64 bits
+    throw std::runtime_error("corrupt inotify recording");
+  }
+  return v;
+}
+
+std::string InotifyRecording::String() {
+  uint64_t size = this->Varint();
+  this->Need(size);
+
+  std::string s(this->file_.data() + this->pos_, size);
+  this->pos_ += size;
+  return s;
+}
+
+bool InotifyRecording::Next(Record &record) {
+
+  if(this->pos_ == this->file_.size()) return false;
+
+  record.type = this->file_.data()[this->pos_++];
+  this->micros_ += this->Varint();
+  record.micros = this->micros_;
+
+  switch(record.type) {
+    case kWatch:
+      record.wd  = static_cast<int>(this->Varint());
+      record.dir = this->String();
+      break;
+
+    case kUnwatch:
+      record.wd = static_cast<int>(this->Varint());
+      break;
+
+    case kRead: {
+      record.size = this->Varint();
+
+      size_t padding = (kAlignment - this->pos_ % kAlignment) % kAlignment;
+      this->Need(padding);
+      this->pos_ += padding;
+      this->Need(record.size);
+
+      record.data  = this->file_.data() + this->pos_;
+      this->pos_  += record.size;
+      break;
+    }
+
+    default:
+      throw std::runtime_error("corrupt inotify recording");
+  }
+
+  return true;
+}
+
+} /// ns infra
@@ -0,0 +1,137 @@
+
+#ifndef LINUX_INOTIFY_RECORD_H_
+#define LINUX_INOTIFY_RECORD_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "file_ops.h"
+
+namespace linux
+{
+
+/**
+ * @brief the file Inotify::SetRecorder() writes, read by InotifyRecording.
+ *
+ * A header, then one record for every watch added or removed and every
+ * read() of the inotify descriptor, in the order they happened:
+ *
+ *   header:  "miXpkgIR", uint32 version, uint32 0x01020304 and uint32
+ *            sizeof(inotify_event) (both to refuse another ABI), int64
+ *            start time, then as varint length and bytes the watched
+ *            root and the --include and --exclude globs, each list
+ *            after its varint count.
+ *   record:  type byte, varint microseconds since the record before,
+ *            then
+ *     'W'    varint wd, varint length, directory
+ *     'U'    varint wd
+ *     'R'    varint size, zeros up to the next 8 byte offset, the bytes
+ *            read, aligned for struct inotify_event.
+ */
+class InotifyRecorder final {
+ public:
+
+  /**
+   * @exception system_error if the file can't be created.
+   */
+  InotifyRecorder(const std::string &file, const std::string &root,
+                  const std::vector<std::string> &includes,
+                  const std::vector<std::string> &excludes);
+
+  /// writes what is left, errors are lost then, see Flush().
+  ~InotifyRecorder();
+
+ private:
+  InotifyRecorder(const InotifyRecorder&) = delete;
+  InotifyRecorder& operator=(const InotifyRecorder&) = delete;
+
+ public:
+
+  /// @exception system_error if the file can't be written.
+  void Watch(int wd, const std::string &dir);
+  void Unwatch(int wd);
+  void Read(const char *buf, size_t size);
+
+  /// @exception system_error if the file can't be written.
+  void Flush();
+
+  uint64_t reads() const { return this->reads_; }
+  uint64_t bytes() const { return this->offset_ + this->buffer_.size(); }
+
+ private:
+  void Begin(char type);
+
+  int                                   fd_;
+  off_t                                 offset_;   /// of buffer_ in the file
+  std::string                           buffer_;
+  std::chrono::steady_clock::time_point last_;
+  uint64_t                              reads_;
+};
+
+class InotifyRecording final {
+ public:
+
+  enum Type {
+    kWatch   = 'W',
+    kUnwatch = 'U',
+    kRead    = 'R'
+  };
+
+  struct Record {
+    char        type;
+    uint64_t    micros;   /// since the recording started
+    int         wd;
+    std::string dir;
+    const char *data;     /// of a read, valid as long as the recording
+    size_t      size;
+  };
+
+  /**
+   * @exception system_error if the file can't be mapped. runtime_error
+   * if it isn't a recording of this version and ABI.
+   */
+  explicit InotifyRecording(const std::string &file);
+
+ private:
+  InotifyRecording(const InotifyRecording&) = delete;
+  InotifyRecording& operator=(const InotifyRecording&) = delete;
+
+ public:
+
+  const std::string& root() const { return this->root_; }
+  const std::vector<std::string>& includes() const { return this->includes_; }
+  const std::vector<std::string>& excludes() const { return this->excludes_; }
+  time_t started() const { return this->started_; }
+
+  /**
+   * @return false after the last record.
+   * @exception runtime_error if the recording is truncated or corrupt.
+   */
+  bool Next(Record &record);
+
+  /// start again from the first record.
+  void Rewind() { this->pos_ = this->first_; this->micros_ = 0; }
+
+ private:
+  uint64_t Varint();
+  std::string String();
+  void Need(size_t size) const;
+
+  MappedFile               file_;
+  size_t                   pos_;
+  size_t                   first_;     /// offset of the first record
+  uint64_t                 micros_;
+  std::string              root_;
+  std::vector<std::string> includes_;
+  std::vector<std::string> excludes_;
+  time_t                   started_;
+};
+
+} // end of linux ns
+
+#endif /* end of include guard: LINUX_INOTIFY_RECORD_H_ */
@@ -0,0 +1,155 @@
+/// Runs a recording made with 'miXpkg --record' through the same event
+/// parsing, filtering and capturing as the install, as fast as it goes.
+/// Every run has to capture the same paths, their digest makes a
+/// regression test, the rate a benchmark.
+///
+///   make replay
+///   ./miXpkg-replay recording [runs=5] [capture MiB=64]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "capture_store.h"
+#include "file_ops.h"
+#include "inotify.h"
+#include "inotify_record.h"
+#include "path_filter.h"
+
+namespace {
+
+double MillisecondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+      std::chrono::steady_clock::now() - start).count();
+}
+
+struct Totals {
+  uint64_t watches = 0;
+  uint64_t reads   = 0;
+  uint64_t bytes   = 0;
+  uint64_t events  = 0;
+  uint64_t micros  = 0;   /// recorded from first to last record
+  uint64_t paths   = 0;
+  uint64_t digest  = 0;
+};
+
+/// one replay, from the first record to the captured paths.
+double Replay(linux::InotifyRecording &recording,
+              const linux::PathFilter &filter,
+              size_t budget, Totals &totals) {
+
+  totals = Totals();
+  recording.Rewind();
+
+  linux::Inotify notify;
+  if(!filter.empty()) notify.SetFilter(&filter);
+  linux::CaptureStore installed(budget);
+
+  auto start = std::chrono::steady_clock::now();
+
+  linux::InotifyRecording::Record record;
+  while(recording.Next(record)) {
+    auto events = notify.Replay(recording, record);
+    installed.AddEvents(events);
+
+    totals.watches += linux::InotifyRecording::kWatch == record.type;
+    if(linux::InotifyRecording::kRead == record.type) {
+      ++totals.reads;
+      totals.bytes  += record.size;
+      totals.events += events.size();
+    }
+    totals.micros = record.micros;
+  }
+
+  /// FNV-1a of every path and its kind, in path order.
+  uint64_t digest = linux::kFnv1aBasis;
+  installed.ForEach([&](const std::string &path, bool is_dir) {
+    char kind = is_dir ? 'd' : 'f';
+    digest = linux::Fnv1a(path.data(), path.size(), digest);
+    digest = linux::Fnv1a(&kind, 1, digest);
+    ++totals.paths;
+    return true;
+  });
+  totals.digest = digest;
+
+  return MillisecondsSince(start);
+}
+
+}
+
+int main(int argc, char *argv[]) {
+
+  if(argc < 2) {
+    std::cerr << "usage: " << argv[0]
+              << " recording [runs=5] [capture MiB=64]" << std::endl;
+    return 1;
+  }
+
+  unsigned runs   = argc > 2 ? std::atoi(argv[2]) : 5;
+  size_t   budget = size_t(argc > 3 ? std::atoi(argv[3]) : 64) << 20;
+  if(0 == budget) budget = 1 << 20;
+
+  try {
+
+    linux::InotifyRecording recording(argv[1]);
+    linux::PathFilter filter(recording.includes(), recording.excludes());
+
+    Totals first, totals;
+    std::vector<double> times;
+
+    for(unsigned run = 0; run < std::max(runs, 1u); ++run) {
+      times.push_back(Replay(recording, filter, budget, totals));
+
+      if(0 == run) {
+        first = totals;
+      } else if(totals.digest != first.digest) {
+        std::cerr << "error: run " << run + 1 << " captured other paths"
+                  << std::endl;
+        return 1;
+      }
+    }
+
+    time_t started = recording.started();
+    char when[32];
+    std::strftime(when, sizeof(when), "%F %T", std::localtime(&started));
+
+    std::cout << "recording of " << recording.root() << " from " << when
+              << ", " << std::fixed << std::setprecision(2)
+              << first.micros / 1e6 << " s" << std::endl
+              << first.watches << " watches, " << first.reads << " reads, "
+              << first.bytes << " bytes, " << first.events << " events"
+              << std::endl
+              << first.paths << " paths captured, digest " << std::hex
+              << std::setw(16) << std::setfill('0') << first.digest
+              << std::dec << std::setfill(' ') << std::endl << std::endl
+              << std::left  << std::setw(6) << "run"
+              << std::right << std::setw(12) << "ms"
+              << std::setw(14) << "events/s"
+              << std::setw(12) << "MB/s" << std::endl;
+
+    for(size_t run = 0; run < times.size(); ++run) {
+      double seconds = times[run] / 1000;
+
+      std::cout << std::left  << std::setw(6) << run + 1
+                << std::right << std::fixed << std::setprecision(1)
+                << std::setw(12) << times[run]
+                << std::setprecision(0)
+                << std::setw(14) << first.events / seconds
+                << std::setprecision(1)
+                << std::setw(12) << first.bytes / seconds / 1e6
+                << std::endl;
+    }
+  }
+  catch(const std::exception &ex) {
+    std::cerr << "error: " << ex.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
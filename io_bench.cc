@@ -0,0 +1,220 @@
+/// Compares the I/O engines on a tree of many small files, the common
+/// shape of an install into sysroot.
+///
+///   make bench
+///   ./io_bench /tmp/bench [dirs] [files per dir] [file size] [rounds]
+///
+/// Every round runs each engine once, in turns that alternate from round
+/// to round, so neither always gets the page cache the other warmed.
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "file_ops.h"
+#include "io_engine.h"
+
+namespace {
+
+double MillisecondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+      std::chrono::steady_clock::now() - start).count();
+}
+
+void CreateTree(const std::string &root, unsigned dirs, unsigned files,
+                size_t size) {
+
+  std::vector<char> data(size, 'x');
+
+  for(unsigned d = 0; d < dirs; ++d) {
+    std::string dir = root + "/d" + std::to_string(d % 16) +
+                      "/d" + std::to_string(d);
+    linux::MakeDirectories(dir);
+
+    for(unsigned f = 0; f < files; ++f) {
+      std::string file = dir + "/f" + std::to_string(f);
+      int fd = ::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if(-1 == fd) {
+        perror(file.c_str());
+        std::exit(1);
+      }
+      linux::WriteAll(fd, data.data(), data.size(), 0);
+      ::close(fd);
+    }
+  }
+}
+
+/// read the tree a level at a time like WatchRecursively(): readdir()
+/// every directory of the level, then one Stat() batch for all entries
+/// found, as if d_type were DT_UNKNOWN.
+size_t Walk(linux::IoEngine &engine, const std::string &root) {
+
+  std::vector<std::string> level{ root }, paths, next;
+  std::vector<struct stat> stats;
+  std::vector<int> errors;
+  size_t entries = 0;
+
+  while(!level.empty()) {
+    paths.clear();
+    for(auto &dir : level) {
+      DIR *handle = ::opendir(dir.c_str());
+      if(nullptr == handle) continue;
+
+      while(struct dirent *entry = ::readdir(handle)) {
+        std::string name(entry->d_name);
+        if("." == name || ".." == name) continue;
+        paths.push_back(dir + "/" + name);
+      }
+      ::closedir(handle);
+    }
+
+    engine.Stat(paths, stats, errors);
+    entries += paths.size();
+
+    next.clear();
+    for(size_t i = 0; i < paths.size(); ++i) {
+      if(0 == errors[i] && S_ISDIR(stats[i].st_mode)) {
+        next.push_back(paths[i]);
+      }
+    }
+    level.swap(next);
+  }
+
+  return entries;
+}
+
+}
+
+int main(int argc, char *argv[]) {
+
+  if(argc < 2) {
+    std::cerr << "usage: " << argv[0]
+              << " dir [dirs=1000] [files per dir=50] [file size=512]"
+                 " [rounds=3]"
+              << std::endl;
+    return 1;
+  }
+
+  std::string root(argv[1]);
+  unsigned dirs   = argc > 2 ? std::atoi(argv[2]) : 1000;
+  unsigned files  = argc > 3 ? std::atoi(argv[3]) : 50;
+  size_t   size   = argc > 4 ? std::atoi(argv[4]) : 512;
+  unsigned rounds = argc > 5 ? std::atoi(argv[5]) : 3;
+
+  std::string source = root + "/src";
+  CreateTree(source, dirs, files, size);
+
+  std::vector<std::string> dir_paths, file_paths;
+  for(unsigned d = 0; d < dirs; ++d) {
+    std::string dir = "/d" + std::to_string(d % 16) + "/d" + std::to_string(d);
+    dir_paths.push_back(dir);
+    for(unsigned f = 0; f < files; ++f) {
+      file_paths.push_back(dir + "/f" + std::to_string(f));
+    }
+  }
+
+  std::vector<std::unique_ptr<linux::IoEngine>> engines;
+  for(const char *kind : { "threads", "uring" }) {
+    try {
+      engines.push_back(linux::IoEngine::Create(kind));
+    }
+    catch(const std::exception &ex) {
+      std::cout << kind << " not available: " << ex.what() << std::endl;
+    }
+  }
+
+  std::cout << dirs << " directories, " << file_paths.size() << " files of "
+            << size << " bytes" << std::endl << std::endl
+            << std::left  << std::setw(6)  << "round"
+            << std::setw(10) << "engine"
+            << std::right << std::setw(12) << "stat ms"
+            << std::setw(12) << "walk ms"
+            << std::setw(12) << "mkdir ms"
+            << std::setw(12) << "copy ms"
+            << std::setw(12) << "remove ms" << std::endl;
+
+  for(size_t run = 0; run < rounds * engines.size(); ++run) {
+
+    size_t round = run / engines.size(), turn = run % engines.size();
+
+    /// the first engine of an odd round is the last of an even one.
+    linux::IoEngine &engine =
+        *engines[0 == round % 2 ? turn : engines.size() - 1 - turn];
+
+    std::string target = root + "/" + engine.name();
+
+    std::vector<std::string> sources;
+    for(auto &file : file_paths) sources.push_back(source + file);
+
+    std::vector<std::string> targets{ target };
+    std::vector<mode_t> modes{ 0755 };
+    for(unsigned d = 0; d < 16 && d < dirs; ++d) {
+      targets.push_back(target + "/d" + std::to_string(d));
+      modes.push_back(0755);
+    }
+    for(auto &dir : dir_paths) {
+      targets.push_back(target + dir);
+      modes.push_back(0755);
+    }
+
+    std::vector<linux::IoEngine::CopyRequest> copies;
+    for(auto &file : file_paths) {
+      copies.push_back(linux::IoEngine::CopyRequest{
+          source + file, target + file, 0644, off_t(size) });
+    }
+
+    std::vector<struct stat> stats;
+    std::vector<int> errors;
+    size_t failed = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    engine.Stat(sources, stats, errors);
+    double stat_ms = MillisecondsSince(start);
+    for(int e : errors) failed += 0 != e;
+
+    start = std::chrono::steady_clock::now();
+    size_t walked = Walk(engine, source);
+    double walk_ms = MillisecondsSince(start);
+    if(walked != targets.size() - 1 + file_paths.size()) ++failed;
+
+    start = std::chrono::steady_clock::now();
+    engine.MakeDirectories(targets, modes, errors);
+    double mkdir_ms = MillisecondsSince(start);
+    for(int e : errors) failed += 0 != e;
+
+    start = std::chrono::steady_clock::now();
+    engine.Copy(copies, linux::IoEngine::Divert(), errors);
+    double copy_ms = MillisecondsSince(start);
+    for(int e : errors) failed += 0 != e;
+
+    start = std::chrono::steady_clock::now();
+    failed += engine.RemoveTrees(std::vector<std::string>{ target });
+    double remove_ms = MillisecondsSince(start);
+
+    std::cout << std::left  << std::setw(6)  << round + 1
+              << std::setw(10) << engine.name()
+              << std::right << std::fixed << std::setprecision(1)
+              << std::setw(12) << stat_ms
+              << std::setw(12) << walk_ms
+              << std::setw(12) << mkdir_ms
+              << std::setw(12) << copy_ms
+              << std::setw(12) << remove_ms;
+    if(0 != failed) std::cout << "  (" << failed << " failed)";
+    std::cout << std::endl;
+  }
+
+  linux::IoEngine::Create("threads")->RemoveTrees(
+      std::vector<std::string>{ source });
+
+  return 0;
+}
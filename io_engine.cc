@@ -0,0 +1,948 @@
+#include "io_engine.h"
+#include "file_ops.h"
+#include "thread_pool.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+
+namespace linux
+{
+
+namespace {
+
+/// the first bytes handed to a Divert, enough for any file magic.
+const size_t kHeadSize = 64;
+
+size_t Depth(const std::string &path) {
+  return std::count(path.begin(), path.end(), '/');
+}
+
+/// indices of paths grouped by depth, shallowest first. A directory never
+/// shares a group with its parent, so each group can run at once.
+std::vector<std::vector<size_t> > GroupByDepth(
+    const std::vector<std::string> &paths) {
+
+  std::map<size_t, std::vector<size_t> > depths;
+  for(size_t i = 0; i < paths.size(); ++i) {
+    depths[Depth(paths[i])].push_back(i);
+  }
+
+  std::vector<std::vector<size_t> > groups;
+  for(auto &depth : depths) groups.push_back(depth.second);
+  return groups;
+}
+
+int ErrorOf(const std::system_error &e) {
+  return e.code().value() ? e.code().value() : EIO;
+}
+
+/**
+ * @brief blocking calls spread over a thread pool.
+ */
+class ThreadPoolIoEngine final : public IoEngine {
+ public:
+  explicit ThreadPoolIoEngine(unsigned threads) : pool_(threads) { }
+
+  const char* name() const override { return "threads"; }
+
+  void Stat(const std::vector<std::string> &paths,
+            std::vector<struct stat> &stats,
+            std::vector<int> &errors) override {
+
+    struct stat zero;
+    memset(&zero, 0, sizeof(zero));
+    stats.assign(paths.size(), zero);
+    errors.assign(paths.size(), 0);
+
+    this->pool_.ParallelFor(paths.size(), [&](size_t i) {
+      if(0 != ::lstat(paths[i].c_str(), &stats[i])) errors[i] = errno;
+    });
+  }
+
+  void MakeDirectories(const std::vector<std::string> &paths,
+                       const std::vector<mode_t> &modes,
+                       std::vector<int> &errors) override {
+
+    errors.assign(paths.size(), 0);
+
+    for(auto &group : GroupByDepth(paths)) {
+      this->pool_.ParallelFor(group.size(), [&](size_t i) {
+        size_t index = group[i];
+        if(0 != ::mkdir(paths[index].c_str(), modes[index]) &&
+           EEXIST != errno) {
+          errors[index] = errno;
+        }
+      });
+    }
+  }
+
+  void Copy(const std::vector<CopyRequest> &files,
+            const Divert &divert,
+            std::vector<int> &errors) override {
+
+    errors.assign(files.size(), 0);
+
+    this->pool_.ParallelFor(files.size(), [&](size_t i) {
+      const CopyRequest &file = files[i];
+
+      if(divert) {
+        char head[kHeadSize];
+        ssize_t size = -1;
+
+        int fd = ::open(file.source.c_str(), O_RDONLY | O_CLOEXEC);
+        if(-1 != fd) {
+          size = ::pread(fd, head, sizeof(head), 0);
+          ::close(fd);
+        }
+
+        if(-1 == size) {
+          errors[i] = errno;
+          return;
+        }
+
+        if(divert(head, size)) {
+          errors[i] = kDiverted;
+          return;
+        }
+      }
+
+      try {
+        CopyRegularFile(file.source, file.target, file.mode);
+      }
+      catch(const std::system_error &e) {
+        errors[i] = ErrorOf(e);
+      }
+    });
+  }
+
+  void Unlink(const std::vector<std::string> &paths,
+              bool remove_dirs,
+              std::vector<int> &errors) override {
+
+    errors.assign(paths.size(), 0);
+
+    this->pool_.ParallelFor(paths.size(), [&](size_t i) {
+      int rc = remove_dirs ? ::rmdir(paths[i].c_str())
+                           : ::unlink(paths[i].c_str());
+      if(0 != rc) errors[i] = errno;
+    });
+  }
+
+ private:
+  ThreadPool pool_;
+};
+
+/**
+ * @brief a minimal io_uring, set up with the raw system calls so nothing
+ * beyond the kernel headers is needed.
+ *
+ * Not thread safe, every user owns its ring.
+ */
+class Ring final {
+ public:
+
+  explicit Ring(unsigned entries) : fd_(-1), sq_map_(MAP_FAILED),
+      cq_map_(MAP_FAILED), sqes_(static_cast<io_uring_sqe*>(MAP_FAILED)),
+      sqe_tail_(0), submitted_(0) {
+
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    this->fd_ = ::syscall(__NR_io_uring_setup, entries, &params);
+    CHECK_LINUX_FUN_RETURN_OR_THROW(this->fd_);
+
+    try {
+      this->Map(params);
+      this->Probe();
+    }
+    catch(...) {
+      this->Unmap();
+      throw;
+    }
+  }
+
+  ~Ring() {
+    this->Unmap();
+  }
+
+ private:
+  Ring(const Ring&) = delete;
+  Ring& operator=(const Ring&) = delete;
+
+  void Map(const io_uring_params &params) {
+
+    this->sq_map_size_ = params.sq_off.array +
+                         params.sq_entries * sizeof(unsigned);
+    this->cq_map_size_ = params.cq_off.cqes +
+                         params.cq_entries * sizeof(io_uring_cqe);
+
+    /// older kernels map the two rings separately.
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if(single) {
+      this->sq_map_size_ = this->cq_map_size_ =
+          std::max(this->sq_map_size_, this->cq_map_size_);
+    }
+
+    this->sq_map_ = ::mmap(nullptr, this->sq_map_size_,
+                           PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           this->fd_, IORING_OFF_SQ_RING);
+    if(MAP_FAILED == this->sq_map_) {
+      throw std::system_error(errno, std::system_category());
+    }
+
+    if(single) {
+      this->cq_map_ = this->sq_map_;
+    } else {
+      this->cq_map_ = ::mmap(nullptr, this->cq_map_size_,
+                             PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             this->fd_, IORING_OFF_CQ_RING);
+      if(MAP_FAILED == this->cq_map_) {
+        throw std::system_error(errno, std::system_category());
+      }
+    }
+
+    this->sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    void *sqes = ::mmap(nullptr, this->sqes_size_,
+                        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        this->fd_, IORING_OFF_SQES);
+    if(MAP_FAILED == sqes) {
+      throw std::system_error(errno, std::system_category());
+    }
+    this->sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+    char *sq = static_cast<char*>(this->sq_map_);
+    this->sq_head_    = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    this->sq_tail_    = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    this->sq_mask_    = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    this->sq_array_   = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    this->sq_entries_ = params.sq_entries;
+
+    char *cq = static_cast<char*>(this->cq_map_);
+    this->cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    this->cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    this->cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    this->cqes_    = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    this->sqe_tail_ = *this->sq_tail_;
+    this->submitted_ = this->sqe_tail_;
+  }
+
+  /// STATX, MKDIRAT and UNLINKAT came late (5.6 - 5.15), check them all
+  /// up front rather than failing half way through a batch.
+  void Probe() {
+
+    const unsigned kOps = 256;
+    std::vector<char> buffer(sizeof(io_uring_probe) +
+                             kOps * sizeof(io_uring_probe_op));
+    io_uring_probe *probe = reinterpret_cast<io_uring_probe*>(buffer.data());
+
+    CHECK_LINUX_FUN_RETURN_OR_THROW(::syscall(__NR_io_uring_register,
+        this->fd_, IORING_REGISTER_PROBE, probe, kOps));
+
+    const unsigned needed[] = {
+      IORING_OP_STATX, IORING_OP_MKDIRAT, IORING_OP_UNLINKAT,
+      IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE,
+    };
+
+    for(unsigned op : needed) {
+      if(op > probe->last_op ||
+         !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+        throw std::system_error(ENOSYS, std::system_category());
+      }
+    }
+  }
+
+  void Unmap() {
+    if(MAP_FAILED != static_cast<void*>(this->sqes_)) {
+      ::munmap(this->sqes_, this->sqes_size_);
+    }
+    if(MAP_FAILED != this->cq_map_ && this->cq_map_ != this->sq_map_) {
+      ::munmap(this->cq_map_, this->cq_map_size_);
+    }
+    if(MAP_FAILED != this->sq_map_) ::munmap(this->sq_map_, this->sq_map_size_);
+    if(-1 != this->fd_) ::close(this->fd_);
+  }
+
+ public:
+
+  unsigned entries() const { return this->sq_entries_; }
+
+  /**
+   * @brief a cleared submission entry, or nullptr while the queue is full.
+   */
+  io_uring_sqe* Next() {
+    unsigned head = __atomic_load_n(this->sq_head_, __ATOMIC_ACQUIRE);
+    if(this->sqe_tail_ - head >= this->sq_entries_) return nullptr;
+
+    unsigned index = this->sqe_tail_ & this->sq_mask_;
+    this->sq_array_[index] = index;
+    ++this->sqe_tail_;
+
+    io_uring_sqe *sqe = &this->sqes_[index];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+  }
+
+  /**
+   * @brief submit what was queued and wait for wait_for completions.
+   *
+   * @exception system_error Indicates the error.
+   */
+  void Submit(unsigned wait_for) {
+
+    __atomic_store_n(this->sq_tail_, this->sqe_tail_, __ATOMIC_RELEASE);
+
+    for(;;) {
+      unsigned pending = this->sqe_tail_ - this->submitted_;
+      int rc = ::syscall(__NR_io_uring_enter, this->fd_, pending, wait_for,
+                         wait_for ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+      if(rc >= 0) {
+        this->submitted_ += rc;
+        if(unsigned(rc) == pending) return;
+        /// the kernel took only part of it, go round for the rest.
+        wait_for = 0;
+        continue;
+      }
+
+      /// EBUSY: completions have to be reaped before more can be taken,
+      /// the caller does that next.
+      if(EINTR == errno || EBUSY == errno || EAGAIN == errno) {
+        if(EINTR == errno) continue;
+        return;
+      }
+
+      throw std::system_error(errno, std::system_category());
+    }
+  }
+
+  /**
+   * @brief call fn(user_data, result) for every completion there is.
+   *
+   * @return the number of completions.
+   */
+  template <typename Fn>
+  unsigned Reap(Fn fn) {
+    unsigned head = *this->cq_head_;
+    unsigned tail = __atomic_load_n(this->cq_tail_, __ATOMIC_ACQUIRE);
+    unsigned count = 0;
+
+    for(; head != tail; ++head, ++count) {
+      const io_uring_cqe &cqe = this->cqes_[head & this->cq_mask_];
+      fn(cqe.user_data, cqe.res);
+    }
+
+    __atomic_store_n(this->cq_head_, head, __ATOMIC_RELEASE);
+    return count;
+  }
+
+ private:
+  int           fd_;
+  void         *sq_map_;
+  void         *cq_map_;
+  size_t        sq_map_size_;
+  size_t        cq_map_size_;
+  io_uring_sqe *sqes_;
+  size_t        sqes_size_;
+
+  unsigned     *sq_head_;
+  unsigned     *sq_tail_;
+  unsigned      sq_mask_;
+  unsigned     *sq_array_;
+  unsigned      sq_entries_;
+
+  unsigned     *cq_head_;
+  unsigned     *cq_tail_;
+  unsigned      cq_mask_;
+  io_uring_cqe *cqes_;
+
+  unsigned      sqe_tail_;
+  unsigned      submitted_;
+};
+
+void PrepareRequest(io_uring_sqe *sqe, int opcode, int fd,
+                    const void *addr, unsigned len, uint64_t offset) {
+  sqe->opcode = opcode;
+  sqe->fd     = fd;
+  sqe->addr   = reinterpret_cast<uint64_t>(addr);
+  sqe->len    = len;
+  sqe->off    = offset;
+}
+
+/**
+ * @brief everything goes through one io_uring from the calling thread.
+ *
+ * Stat, mkdir and unlink are one request per path. A copy is a little
+ * state machine per file (open source, read, open target, write, ...,
+ * close both) and kMaxCopies of them are in flight at once.
+ */
+class UringIoEngine final : public IoEngine {
+ public:
+  UringIoEngine() : ring_(kRingEntries) { }
+
+  const char* name() const override { return "uring"; }
+
+  void Stat(const std::vector<std::string> &paths,
+            std::vector<struct stat> &stats,
+            std::vector<int> &errors) override {
+
+    struct stat zero;
+    memset(&zero, 0, sizeof(zero));
+    stats.assign(paths.size(), zero);
+    errors.assign(paths.size(), 0);
+
+    std::vector<struct statx> results(paths.size());
+
+    this->RunEach(paths.size(),
+      [&](io_uring_sqe *sqe, size_t i) {
+        PrepareRequest(sqe, IORING_OP_STATX, AT_FDCWD, paths[i].c_str(),
+                       STATX_BASIC_STATS,
+                       reinterpret_cast<uint64_t>(&results[i]));
+        sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+      },
+      [&](size_t i, int result) {
+        if(result < 0) {
+          errors[i] = -result;
+          return;
+        }
+
+        const struct statx &x = results[i];
+        struct stat &s = stats[i];
+        s.st_dev   = makedev(x.stx_dev_major, x.stx_dev_minor);
+        s.st_ino   = x.stx_ino;
+        s.st_mode  = x.stx_mode;
+        s.st_nlink = x.stx_nlink;
+        s.st_uid   = x.stx_uid;
+        s.st_gid   = x.stx_gid;
+        s.st_rdev  = makedev(x.stx_rdev_major, x.stx_rdev_minor);
+        s.st_size  = x.stx_size;
+        s.st_blksize = x.stx_blksize;
+        s.st_blocks  = x.stx_blocks;
+        s.st_atim.tv_sec  = x.stx_atime.tv_sec;
+        s.st_atim.tv_nsec = x.stx_atime.tv_nsec;
+        s.st_mtim.tv_sec  = x.stx_mtime.tv_sec;
+        s.st_mtim.tv_nsec = x.stx_mtime.tv_nsec;
+        s.st_ctim.tv_sec  = x.stx_ctime.tv_sec;
+        s.st_ctim.tv_nsec = x.stx_ctime.tv_nsec;
+      });
+  }
+
+  void MakeDirectories(const std::vector<std::string> &paths,
+                       const std::vector<mode_t> &modes,
+                       std::vector<int> &errors) override {
+
+    errors.assign(paths.size(), 0);
+
+    for(auto &group : GroupByDepth(paths)) {
+      this->RunEach(group.size(),
+        [&](io_uring_sqe *sqe, size_t i) {
+          PrepareRequest(sqe, IORING_OP_MKDIRAT, AT_FDCWD,
+                         paths[group[i]].c_str(), modes[group[i]], 0);
+        },
+        [&](size_t i, int result) {
+          if(result < 0 && -EEXIST != result) errors[group[i]] = -result;
+        });
+    }
+  }
+
+  void Unlink(const std::vector<std::string> &paths,
+              bool remove_dirs,
+              std::vector<int> &errors) override {
+
+    errors.assign(paths.size(), 0);
+
+    this->RunEach(paths.size(),
+      [&](io_uring_sqe *sqe, size_t i) {
+        PrepareRequest(sqe, IORING_OP_UNLINKAT, AT_FDCWD, paths[i].c_str(),
+                       0, 0);
+        sqe->unlink_flags = remove_dirs ? AT_REMOVEDIR : 0;
+      },
+      [&](size_t i, int result) {
+        if(result < 0) errors[i] = -result;
+      });
+  }
+
+  void Copy(const std::vector<CopyRequest> &files,
+            const Divert &divert,
+            std::vector<int> &errors) override;
+
+ private:
+
+  static const unsigned kRingEntries = 256;
+  static const unsigned kMaxCopies   = 64;
+  static const size_t   kCopyBuffer  = 128 * 1024;
+
+  /**
+   * @brief one request per item, as many in flight as the ring holds.
+   */
+  template <typename Prepare, typename Complete>
+  void RunEach(size_t count, Prepare prepare, Complete complete) {
+
+    size_t next = 0, in_flight = 0;
+
+    while(next < count || in_flight > 0) {
+      io_uring_sqe *sqe;
+      while(next < count && nullptr != (sqe = this->ring_.Next())) {
+        prepare(sqe, next);
+        sqe->user_data = next;
+        ++next;
+        ++in_flight;
+      }
+
+      this->ring_.Submit(1);
+      in_flight -= this->ring_.Reap([&](uint64_t user_data, int result) {
+        complete(size_t(user_data), result);
+      });
+    }
+  }
+
+  io_uring_sqe* NextOrFlush() {
+    io_uring_sqe *sqe;
+    while(nullptr == (sqe = this->ring_.Next())) this->ring_.Submit(0);
+    return sqe;
+  }
+
+  Ring ring_;
+};
+
+const unsigned UringIoEngine::kRingEntries;
+const unsigned UringIoEngine::kMaxCopies;
+const size_t   UringIoEngine::kCopyBuffer;
+
+void UringIoEngine::Copy(const std::vector<CopyRequest> &files,
+                         const Divert &divert,
+                         std::vector<int> &errors) {
+
+  errors.assign(files.size(), 0);
+
+  /// kOpen: the source. kCreate: the target once the source opened, a
+  /// source that can't be opened leaves a staged target alone. kHead:
+  /// reading the head divert looks at. kOpenTarget: the target after
+  /// the head. kChunk: a READ linked to a WRITE of the same range.
+  /// kWrite: the rest of a short write.
+  enum Stage { kIdle, kOpen, kCreate, kHead, kOpenTarget, kChunk, kWrite };
+
+  /// what a completion is for, kept in the top byte of user_data.
+  enum Tag { kOpenSourceTag = 1, kOpenTargetTag, kReadTag, kWriteTag,
+             kCloseTag };
+
+  struct Transfer {
+    Stage               stage;
+    size_t              file;
+    int                 source;
+    int                 target;
+    int                 error;
+    unsigned            pending;  /// requests in flight
+    uint64_t            offset;   /// of the buffer in the file
+    size_t              length;   /// of the chunk asked for
+    int                 read;     /// bytes in the buffer
+    int                 written;  /// of them
+    std::unique_ptr<char[]> buffer;
+  };
+
+  const size_t slots = std::min<size_t>(kMaxCopies, files.size());
+  std::vector<Transfer> transfers(slots);
+  for(auto &t : transfers) {
+    t.stage  = kIdle;
+    t.buffer.reset(new char[kCopyBuffer]);
+  }
+
+  size_t next = 0, in_flight = 0;
+
+  auto queue = [&](size_t slot, Tag tag, int opcode, int fd,
+                   const void *addr, unsigned len, uint64_t offset) {
+    io_uring_sqe *sqe = this->NextOrFlush();
+    PrepareRequest(sqe, opcode, fd, addr, len, offset);
+    sqe->user_data = (uint64_t(tag) << 56) | slot;
+    ++transfers[slot].pending;
+    ++in_flight;
+    return sqe;
+  };
+
+  auto close_fd = [&](int &fd) {
+    if(-1 == fd) return;
+    io_uring_sqe *sqe = this->NextOrFlush();
+    PrepareRequest(sqe, IORING_OP_CLOSE, fd, nullptr, 0, 0);
+    sqe->user_data = uint64_t(kCloseTag) << 56;
+    ++in_flight;
+    fd = -1;
+  };
+
+  auto open_target = [&](size_t slot) {
+    const CopyRequest &file = files[transfers[slot].file];
+    io_uring_sqe *sqe = queue(slot, kOpenTargetTag, IORING_OP_OPENAT,
+                              AT_FDCWD, file.target.c_str(), file.mode, 0);
+    sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+  };
+
+  auto start = [&](size_t slot) {
+    Transfer &t = transfers[slot];
+    if(next >= files.size()) {
+      t.stage = kIdle;
+      return;
+    }
+
+    t.file    = next++;
+    t.source  = t.target = -1;
+    t.error   = 0;
+    t.pending = 0;
+    t.offset  = 0;
+    t.stage   = kOpen;
+
+    io_uring_sqe *sqe = queue(slot, kOpenSourceTag, IORING_OP_OPENAT,
+                              AT_FDCWD, files[t.file].source.c_str(), 0, 0);
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+  };
+
+  auto finish = [&](size_t slot, int error) {
+    Transfer &t = transfers[slot];
+    errors[t.file] = error;
+    close_fd(t.source);
+    close_fd(t.target);
+    start(slot);
+  };
+
+  /// the next range up to the size the caller saw, read and written in
+  /// one round trip.
+  auto chunk = [&](size_t slot) {
+    Transfer &t = transfers[slot];
+    uint64_t size = files[t.file].size;
+
+    if(t.offset >= size) {
+      finish(slot, 0);
+      return;
+    }
+
+    t.stage  = kChunk;
+    t.length = std::min<uint64_t>(size - t.offset, kCopyBuffer);
+    t.read   = t.written = 0;
+
+    io_uring_sqe *sqe = queue(slot, kReadTag, IORING_OP_READ, t.source,
+                              t.buffer.get(), t.length, t.offset);
+    sqe->flags |= IOSQE_IO_LINK;
+    queue(slot, kWriteTag, IORING_OP_WRITE, t.target, t.buffer.get(),
+          t.length, t.offset);
+  };
+
+  /// write what was read but not written yet, then go on.
+  auto write_rest = [&](size_t slot) {
+    Transfer &t = transfers[slot];
+
+    if(t.written < t.read) {
+      t.stage = kWrite;
+      queue(slot, kWriteTag, IORING_OP_WRITE, t.target,
+            t.buffer.get() + t.written, t.read - t.written,
+            t.offset + t.written);
+      return;
+    }
+
+    /// nothing read, the file shrank since the caller looked.
+    if(0 == t.read) {
+      finish(slot, 0);
+      return;
+    }
+
+    t.offset += t.read;
+    chunk(slot);
+  };
+
+  auto opened = [&](size_t slot) {
+    Transfer &t = transfers[slot];
+
+    if(0 != t.error) {
+      finish(slot, t.error);
+    } else if(kOpenTarget == t.stage) {
+      write_rest(slot);
+    } else if(kCreate == t.stage) {
+      chunk(slot);
+    } else if(divert) {
+      t.stage = kHead;
+      queue(slot, kReadTag, IORING_OP_READ, t.source, t.buffer.get(),
+            std::min<uint64_t>(kCopyBuffer, files[t.file].size), 0);
+    } else {
+      t.stage = kCreate;
+      open_target(slot);
+    }
+  };
+
+  /// a short or failed read cancels the linked write.
+  auto chunk_done = [&](size_t slot) {
+    Transfer &t = transfers[slot];
+
+    if(0 != t.error) {
+      finish(slot, t.error);
+    } else if(size_t(t.read) == t.length && size_t(t.written) == t.length) {
+      t.offset += t.length;
+      chunk(slot);
+    } else {
+      write_rest(slot);
+    }
+  };
+
+  auto advance = [&](size_t slot, Tag tag, int result) {
+    Transfer &t = transfers[slot];
+    --t.pending;
+
+    switch(tag) {
+      case kOpenSourceTag:
+      case kOpenTargetTag:
+        if(result < 0) {
+          if(0 == t.error) t.error = -result;
+        } else {
+          (kOpenSourceTag == tag ? t.source : t.target) = result;
+        }
+        if(0 == t.pending) opened(slot);
+        break;
+
+      case kReadTag:
+        if(result < 0) {
+          t.error = -result;
+        } else {
+          t.read = result;
+        }
+
+        if(kHead == t.stage) {
+          if(0 != t.error) {
+            finish(slot, t.error);
+          } else if(divert(t.buffer.get(),
+                           std::min<size_t>(t.read, kHeadSize))) {
+            finish(slot, kDiverted);
+          } else {
+            t.written = 0;
+            t.stage   = kOpenTarget;
+            open_target(slot);
+          }
+        } else if(0 == t.pending) {
+          chunk_done(slot);
+        }
+        break;
+
+      case kWriteTag:
+        if(kChunk == t.stage) {
+          if(result >= 0) {
+            t.written = result;
+          } else if(-ECANCELED != result && 0 == t.error) {
+            t.error = -result;
+          }
+          if(0 == t.pending) chunk_done(slot);
+          break;
+        }
+
+        if(result <= 0) {
+          finish(slot, result < 0 ? -result : EIO);
+          break;
+        }
+        t.written += result;
+        write_rest(slot);
+        break;
+
+      case kCloseTag:
+        break;
+    }
+  };
+
+  for(size_t slot = 0; slot < slots; ++slot) start(slot);
+
+  std::vector<std::pair<uint64_t, int> > done;
+
+  while(in_flight > 0) {
+    this->ring_.Submit(1);
+
+    /// completions queue new requests, collect them first so the ring
+    /// isn't reaped from inside its own Reap().
+    done.clear();
+    this->ring_.Reap([&](uint64_t user_data, int result) {
+      done.push_back(std::make_pair(user_data, result));
+    });
+
+    for(auto &completion : done) {
+      --in_flight;
+
+      Tag tag = Tag(completion.first >> 56);
+      if(kCloseTag == tag) continue;
+      advance(size_t(completion.first & 0xffffffffffffffULL), tag,
+              completion.second);
+    }
+  }
+}
+
+
+/**
+ * @brief 'rm -rf' depth first, with a directory open per level. Files
+ * are unlinked and emptied directories removed a batch at a time, so
+ * memory doesn't grow with the tree.
+ */
+class TreeRemover final {
+ public:
+  static const size_t kBatch = 1 << 12;
+
+  explicit TreeRemover(IoEngine &engine) : engine_(engine), failed_(0) { }
+
+  ~TreeRemover() {
+    for(auto &level : this->open_) ::closedir(level.second);
+  }
+
+ private:
+  TreeRemover(const TreeRemover&) = delete;
+  TreeRemover& operator=(const TreeRemover&) = delete;
+
+ public:
+
+  void Remove(const std::string &root) {
+    this->Enter(root);
+
+    /// d_type tells files from directories without a stat per entry.
+    while(!this->open_.empty()) {
+      struct dirent *entry = ::readdir(this->open_.back().second);
+
+      if(nullptr == entry) {
+        ::closedir(this->open_.back().second);
+        this->AddDirectory(this->open_.back().first);
+        this->open_.pop_back();
+        continue;
+      }
+
+      if(0 == strcmp(entry->d_name, ".") || 0 == strcmp(entry->d_name, "..")) {
+        continue;
+      }
+
+      std::string child = this->open_.back().first + "/" + entry->d_name;
+      if(DT_DIR == entry->d_type || DT_UNKNOWN == entry->d_type) {
+        this->Enter(child);
+      } else {
+        this->AddFile(child);
+      }
+    }
+  }
+
+  /// @return the number of entries that couldn't be removed.
+  size_t Finish() {
+    this->FlushDirectories();
+    return this->failed_;
+  }
+
+ private:
+  void Enter(const std::string &path) {
+
+    /// never follow a symbolic link out of the tree, it is removed itself.
+    const int kFlags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+    int fd = ::open(path.c_str(), kFlags);
+
+    /// staged directories have their modes, we need to read and empty
+    /// them anyway.
+    if(-1 == fd && EACCES == errno && 0 == ::chmod(path.c_str(), S_IRWXU)) {
+      fd = ::open(path.c_str(), kFlags);
+    }
+
+    struct stat s;
+    if(-1 != fd && 0 == ::fstat(fd, &s) &&
+       S_IRWXU != (s.st_mode & S_IRWXU)) {
+      ::fchmod(fd, (s.st_mode & 07777) | S_IRWXU);
+    }
+
+    DIR *dir = -1 == fd ? nullptr : ::fdopendir(fd);
+    if(nullptr == dir) {
+      if(-1 != fd) ::close(fd);
+      if(ENOTDIR == errno || ELOOP == errno) {
+        this->AddFile(path);
+      } else if(ENOENT != errno) {
+        this->AddDirectory(path);   /// rmdir() reports it
+      }
+      return;
+    }
+
+    this->open_.push_back(std::make_pair(path, dir));
+  }
+
+  void AddFile(const std::string &path) {
+    this->files_.push_back(path);
+    if(this->files_.size() >= kBatch) this->FlushFiles();
+  }
+
+  /// directories are added once everything below them was.
+  void AddDirectory(const std::string &path) {
+    this->dirs_.push_back(path);
+    if(this->dirs_.size() >= kBatch) this->FlushDirectories();
+  }
+
+  void FlushFiles() {
+    this->engine_.Unlink(this->files_, false, this->errors_);
+    this->CountFailed();
+    this->files_.clear();
+  }
+
+  void FlushDirectories() {
+    this->FlushFiles();
+
+    /// children before their parents: deepest group first.
+    auto groups = GroupByDepth(this->dirs_);
+    for(auto group = groups.rbegin(); group != groups.rend(); ++group) {
+      std::vector<std::string> level;
+      for(size_t i : *group) level.push_back(this->dirs_[i]);
+
+      this->engine_.Unlink(level, true, this->errors_);
+      this->CountFailed();
+    }
+    this->dirs_.clear();
+  }
+
+  void CountFailed() {
+    this->failed_ += std::count_if(this->errors_.begin(), this->errors_.end(),
+                                   [](int e) { return 0 != e && ENOENT != e; });
+  }
+
+  IoEngine                                 &engine_;
+  std::vector<std::pair<std::string, DIR*> > open_;    /// root first
+  std::vector<std::string>                  files_;
+  std::vector<std::string>                  dirs_;
+  std::vector<int>                          errors_;
+  size_t                                    failed_;
+};
+
+}
+
+size_t IoEngine::RemoveTrees(const std::vector<std::string> &paths) {
+
+  TreeRemover remover(*this);
+  for(auto &path : paths) remover.Remove(path);
+  return remover.Finish();
+}
+
+std::unique_ptr<IoEngine> IoEngine::Create(const std::string &kind,
+                                           unsigned threads) {
+
+  if("threads" == kind) {
+    return std::unique_ptr<IoEngine>(new ThreadPoolIoEngine(threads));
+  }
+
+  if("uring" == kind) {
+    return std::unique_ptr<IoEngine>(new UringIoEngine());
+  }
+
+  /// io_uring where the kernel has it (and seccomp allows it), else the
+  /// thread pool.
+  if("auto" == kind) {
+    try {
+      return std::unique_ptr<IoEngine>(new UringIoEngine());
+    }
+    catch(const std::system_error&) {
+      return std::unique_ptr<IoEngine>(new ThreadPoolIoEngine(threads));
+    }
+  }
+
+  throw std::invalid_argument("unknown I/O engine '" + kind + "'");
+}
+
+} /// ns infra
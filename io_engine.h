@@ -0,0 +1,101 @@
+
+#ifndef LINUX_IO_ENGINE_H_
+#define LINUX_IO_ENGINE_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace linux
+{
+
+/**
+ * @brief Bulk file system operations for staging, cleaning and walking.
+ *
+ * Every call takes a whole batch, so an engine can keep many requests in
+ * flight: the io_uring engine submits them with a deep queue from one
+ * thread, the thread pool engine runs the blocking calls on workers.
+ *
+ * Errors are reported per item as errno values, 0 means success.
+ */
+class IoEngine {
+ public:
+
+  struct CopyRequest {
+    std::string source;
+    std::string target;
+    mode_t      mode;
+    off_t       size;   /// from lstat(), how much the copy expects
+  };
+
+  /**
+   * @brief sees the first bytes of a file before it is copied.
+   *
+   * @return true to leave the file to the caller instead, it is reported
+   * as kDiverted then.
+   */
+  typedef std::function<bool(const char *head, size_t size)> Divert;
+
+  static const int kDiverted = -1;
+
+  virtual ~IoEngine() { }
+
+  virtual const char* name() const = 0;
+
+  /**
+   * @brief lstat() every path.
+   */
+  virtual void Stat(const std::vector<std::string> &paths,
+                    std::vector<struct stat> &stats,
+                    std::vector<int> &errors) = 0;
+
+  /**
+   * @brief mkdir() every path, parents have to be listed before their
+   * children. Existing directories are not an error.
+   */
+  virtual void MakeDirectories(const std::vector<std::string> &paths,
+                               const std::vector<mode_t> &modes,
+                               std::vector<int> &errors) = 0;
+
+  /**
+   * @brief copy regular files, targets are created or truncated.
+   *
+   * @param divert may be empty.
+   */
+  virtual void Copy(const std::vector<CopyRequest> &files,
+                    const Divert &divert,
+                    std::vector<int> &errors) = 0;
+
+  /**
+   * @brief unlink() every path, or rmdir() with remove_dirs.
+   */
+  virtual void Unlink(const std::vector<std::string> &paths,
+                      bool remove_dirs,
+                      std::vector<int> &errors) = 0;
+
+  /**
+   * @brief 'rm -rf' for all paths, depth first with batched unlinks.
+   *
+   * @return the number of entries that couldn't be removed.
+   */
+  size_t RemoveTrees(const std::vector<std::string> &paths);
+
+  /**
+   * @param kind "uring", "threads" or "auto" (uring if it's available,
+   * threads otherwise).
+   * @param threads workers of the thread pool engine, 0 for one per CPU.
+   *
+   * @exception invalid_argument for an unknown kind, system_error if
+   * "uring" was asked for and isn't available.
+   */
+  static std::unique_ptr<IoEngine> Create(const std::string &kind,
+                                          unsigned threads = 0);
+};
+
+} // end of linux ns
+
+#endif /* end of include guard: LINUX_IO_ENGINE_H_ */
@@ -0,0 +1,260 @@
+#include "jobserver.h"
+#include "file_ops.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <sstream>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+
+namespace linux
+{
+
+namespace {
+
+/// how often a waiting thread looks at give_up and the implicit slot.
+const int kPollMs = 10;
+
+bool IsOpenPipe(int fd) {
+  struct stat st;
+  return fd >= 0 && 0 == ::fstat(fd, &st) && S_ISFIFO(st.st_mode);
+}
+
+/// an open file description of our own, so O_NONBLOCK doesn't change
+/// the pipe for make and the other clients. /proc/self/fd opens the
+/// pipe itself again, not a copy of the descriptor.
+int ReopenPipe(int fd, int flags) {
+  std::string path = "/proc/self/fd/" + std::to_string(fd);
+  int own = ::open(path.c_str(), flags | O_CLOEXEC);
+  if(-1 != own) return own;
+
+  /// no /proc: share it, a read may then wait for a slot however long.
+  return ::fcntl(fd, F_DUPFD_CLOEXEC, 0);
+}
+
+}
+
+void Jobserver::Token::Release() {
+  if(nullptr != this->owner_) this->owner_->Release(*this);
+}
+
+Jobserver& Jobserver::Get() {
+  static Jobserver jobserver;
+  return jobserver;
+}
+
+Jobserver::Jobserver() : implicit_free_(false), read_fd_(-1),
+                         write_fd_(-1) {
+}
+
+Jobserver::~Jobserver() {
+  if(-1 != this->read_fd_)  ::close(this->read_fd_);
+  if(-1 != this->write_fd_) ::close(this->write_fd_);
+}
+
+bool Jobserver::Join(const std::string &makeflags) {
+
+  /// variables given on make's command line follow a lone "--".
+  std::istringstream words(makeflags);
+  std::string word, auth;
+
+  while(words >> word && "--" != word) {
+    for(const char *option : { "--jobserver-auth=", "--jobserver-fds=" }) {
+      if(0 == word.compare(0, strlen(option), option)) {
+        auth = word.substr(strlen(option));
+      }
+    }
+  }
+
+  if(auth.empty()) return false;
+
+  this->Open(auth);
+  return true;
+}
+
+void Jobserver::Open(const std::string &auth) {
+
+  int read_fd = -1, write_fd = -1;
+
+  if(0 == auth.compare(0, 5, "fifo:")) {
+    std::string path = auth.substr(5);
+
+    read_fd = ::open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if(-1 != read_fd) {
+      write_fd = ::open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    }
+
+    if(-1 == write_fd) {
+      int error = errno;
+      if(-1 != read_fd) ::close(read_fd);
+      throw std::runtime_error("can't open the jobserver fifo " + path +
+                               ": " + strerror(error));
+    }
+  }
+  else {
+    int r = -1, w = -1, end = 0;
+
+    if(2 != sscanf(auth.c_str(), "%d,%d%n", &r, &w, &end) ||
+       auth.size() != static_cast<size_t>(end)) {
+      throw std::runtime_error("unknown jobserver '" + auth + "'");
+    }
+
+    if(!IsOpenPipe(r) || !IsOpenPipe(w)) {
+      throw std::runtime_error("the jobserver pipe " + auth + " isn't open,"
+                               " is the parent make rule a '+' rule?");
+    }
+
+    read_fd  = ReopenPipe(r, O_RDONLY | O_NONBLOCK);
+    write_fd = ::fcntl(w, F_DUPFD_CLOEXEC, 0);
+
+    if(-1 == read_fd || -1 == write_fd) {
+      int error = errno;
+      if(-1 != read_fd)  ::close(read_fd);
+      if(-1 != write_fd) ::close(write_fd);
+      throw std::system_error(error, std::system_category());
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(this->mutex_);
+
+  if(-1 != this->read_fd_)  ::close(this->read_fd_);
+  if(-1 != this->write_fd_) ::close(this->write_fd_);
+
+  this->read_fd_  = read_fd;
+  this->write_fd_ = write_fd;
+}
+
+void Jobserver::Serve(unsigned slots) {
+
+  /// inherited by every child, only make looks at it.
+  int fds[2];
+  CHECK_LINUX_FUN_RETURN_OR_THROW(::pipe(fds));
+
+  std::string tokens(slots > 1 ? slots - 1 : 0, '+');
+  if(!tokens.empty()) {
+    CHECK_LINUX_FUN_RETURN_OR_THROW(
+        ::write(fds[1], tokens.data(), tokens.size()));
+  }
+
+  std::string auth = std::to_string(fds[0]) + "," + std::to_string(fds[1]);
+  this->Open(auth);
+
+  /// what make passes on: the flags, then "--" and the variables. The
+  /// flags of a parent jobserver go, ours go in their place.
+  std::string makeflags, variables;
+  const char *inherited = getenv("MAKEFLAGS");
+  if(nullptr != inherited) {
+    makeflags = inherited;
+
+    std::string::size_type pos = makeflags.find(" -- ");
+    if(0 == makeflags.compare(0, 3, "-- ")) pos = 0;
+    if(std::string::npos != pos) {
+      variables = makeflags.substr(pos);
+      makeflags.erase(pos);
+    }
+  }
+
+  std::istringstream words(makeflags);
+  std::string word, flags;
+
+  while(words >> word) {
+    if(0 == word.compare(0, 2, "-j") ||
+       0 == word.compare(0, 12, "--jobserver-")) {
+      continue;
+    }
+    flags += (flags.empty() ? "" : " ") + word;
+  }
+
+  flags += " -j" + std::to_string(slots) + " --jobserver-auth=" + auth;
+  if(!variables.empty() && ' ' != variables[0]) flags += " ";
+
+  CHECK_LINUX_FUN_RETURN_OR_THROW(
+      ::setenv("MAKEFLAGS", (flags + variables).c_str(), 1));
+}
+
+bool Jobserver::Acquire(Token &token, const std::function<bool()> &give_up) {
+
+  if(token.held()) return true;
+
+  for(;;) {
+    {
+      std::lock_guard<std::mutex> lock(this->mutex_);
+
+      if(this->implicit_free_) {
+        this->implicit_free_ = false;
+        token.owner_ = this;
+        token.byte_  = kImplicit;
+        return true;
+      }
+
+      if(-1 == this->read_fd_) {
+        token.owner_ = this;
+        token.byte_  = kUnlimited;
+        return true;
+      }
+
+      unsigned char byte;
+      ssize_t count = ::read(this->read_fd_, &byte, 1);
+
+      if(1 == count) {
+        token.owner_ = this;
+        token.byte_  = byte;
+        return true;
+      }
+
+      if(-1 == count && EAGAIN != errno && EINTR != errno) {
+        throw std::system_error(errno, std::system_category());
+      }
+    }
+
+    if(give_up && give_up()) return false;
+
+    struct pollfd readable = { this->read_fd_, POLLIN, 0 };
+    ::poll(&readable, 1, kPollMs);
+  }
+}
+
+void Jobserver::Release(Token &token) {
+
+  std::lock_guard<std::mutex> lock(this->mutex_);
+
+  if(kImplicit == token.byte_) {
+    this->implicit_free_ = true;
+  }
+  else if(token.byte_ >= 0) {
+    /// a lost byte is a lost slot for the whole build, so retry.
+    unsigned char byte = static_cast<unsigned char>(token.byte_);
+    while(-1 == ::write(this->write_fd_, &byte, 1) && EINTR == errno) { }
+  }
+
+  token.owner_ = nullptr;
+}
+
+void Jobserver::Lend() {
+  std::lock_guard<std::mutex> lock(this->mutex_);
+  this->implicit_free_ = true;
+}
+
+void Jobserver::Reclaim() {
+  for(;;) {
+    {
+      std::lock_guard<std::mutex> lock(this->mutex_);
+      if(this->implicit_free_) {
+        this->implicit_free_ = false;
+        return;
+      }
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(kPollMs));
+  }
+}
+
+} /// ns infra
@@ -0,0 +1,115 @@
+
+#ifndef LINUX_JOBSERVER_H_
+#define LINUX_JOBSERVER_H_
+
+#include <functional>
+#include <mutex>
+#include <string>
+
+namespace linux
+{
+
+/**
+ * @brief job slots shared with GNU make.
+ *
+ * A make jobserver is a pipe (or, since make 4.4, a named fifo) holding
+ * one byte for every job slot but one: every process has one slot of its
+ * own, the implicit one, and reads a byte before it runs anything more
+ * at the same time. The byte is written back when that is done.
+ *
+ * Here, the thread that calls into a ThreadPool works on its slot, each
+ * further worker acquires one first. Without a jobserver, Acquire()
+ * never waits.
+ */
+class Jobserver final {
+ public:
+
+  static const int kImplicit  = -1;
+  static const int kUnlimited = -2;   /// no jobserver, nothing to give back
+
+  /// a job slot, given back when destroyed.
+  class Token final {
+   public:
+    Token() : owner_(nullptr), byte_(0) { }
+    ~Token() { this->Release(); }
+
+   private:
+    Token(const Token&) = delete;
+    Token& operator=(const Token&) = delete;
+
+   public:
+    bool held() const { return nullptr != this->owner_; }
+    void Release();
+
+   private:
+    friend class Jobserver;
+
+    Jobserver *owner_;
+    int        byte_;   /// read from the jobserver, or kImplicit, kUnlimited
+  };
+
+  /// the one of this process.
+  static Jobserver& Get();
+
+  ~Jobserver();
+
+ private:
+  Jobserver();
+  Jobserver(const Jobserver&) = delete;
+  Jobserver& operator=(const Jobserver&) = delete;
+
+ public:
+
+  /**
+   * @brief join the jobserver makeflags advertises, --jobserver-auth=R,W,
+   * --jobserver-auth=fifo:PATH or the older --jobserver-fds=R,W.
+   *
+   * @return false if it advertises none.
+   * @exception runtime_error if the jobserver can't be used, e.g. make
+   * closed the fds because the rule running us isn't a '+' rule.
+   */
+  bool Join(const std::string &makeflags);
+
+  /**
+   * @brief become the jobserver of child makes, with slots job slots in
+   * all. MAKEFLAGS is set to advertise it, replacing the jobserver of a
+   * parent.
+   *
+   * @exception system_error if the pipe can't be created.
+   */
+  void Serve(unsigned slots);
+
+  /// whether Join() or Serve() succeeded.
+  bool active() const { return -1 != this->read_fd_; }
+
+  /**
+   * @brief wait for a job slot.
+   *
+   * @param give_up polled while waiting, true stops waiting. Null waits
+   * as long as it takes.
+   * @return false if given up.
+   * @exception system_error if the jobserver can't be read.
+   */
+  bool Acquire(Token &token, const std::function<bool()> &give_up);
+
+  /**
+   * @brief the calling thread holds the implicit slot. While it only
+   * waits for other threads, Lend() lets one of them acquire it, and
+   * Reclaim() waits for it to be given back.
+   */
+  void Lend();
+  void Reclaim();
+
+ private:
+  void Release(Token &token);
+  void Open(const std::string &auth);
+
+  std::mutex mutex_;
+  bool       implicit_free_;
+  int        read_fd_;    /// O_NONBLOCK, of this process only
+  int        write_fd_;
+};
+
+} // end of linux ns
+
+#endif /* end of include guard: LINUX_JOBSERVER_H_ */
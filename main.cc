@@ -2,12 +2,16 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <fcntl.h>
+#include <dirent.h>
 #include <unistd.h>
 #include <linux/limits.h>
 #include <errno.h>
+#include <elf.h>
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <system_error>
 #include <thread>
 #include <vector>
@@ -15,40 +19,215 @@
 #include <cstring>
 #include <array>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <map>
+#include <iomanip>
+#include <functional>
 
 #include <tclap/CmdLine.h>
 
 #include "inotify.h"
+#include "inotify_record.h"
+#include "capture_store.h"
+#include "file_ops.h"
+#include "elf_strip.h"
+#include "thread_pool.h"
+#include "jobserver.h"
+#include "io_engine.h"
+#include "dedupe.h"
+#include "batch_manifest.h"
+#include "deb_delta.h"
+#include "deb_stream.h"
 
 namespace {
 
-using InotifyEventCollection = std::vector<linux::InotifyEvent>;
 using StringArray = std::vector<std::string>;
+using linux::CombineToFullPath;
 
 std::string g_sysrootDir;
 std::string g_outputDir;
 std::string g_packageName;
 bool        g_reserveCopied;
 StringArray g_argsToMake;
-StringArray g_CopiedItems;
 bool        g_canClean = false;
-
-
-bool g_stop_monitor = false;
+bool        g_strip;
+std::string g_debugDir;
+linux::PathFilter g_pathFilter;
+std::string g_dirIndexFile;
+std::string g_dirIndexKey;
+std::string g_batchManifest;
+unsigned    g_jobs;
+std::string g_ioEngine;
+bool        g_dedupe;
+std::string g_deltaFrom;
+bool        g_deltaUncompressed;
+bool        g_deltaEpoch;
+std::string g_control;
+int         g_streamFd = -1;   /// where -o - or --output-fd streams to
+size_t      g_captureBudget;
+std::string g_recordFile;
+StringArray g_includeGlobs;   /// as given, for the recording
+StringArray g_excludeGlobs;
+
+const uint32_t kWatchEvents   = IN_CREATE | IN_MOVE;
+const int32_t  kWatchMaxDepth = 9;
+const size_t   kInstalledBatch = 1 << 12;   /// installed paths staged at once
+
+/// where the files of one package are staged and what to build.
+struct PackageJob {
+  std::string name;
+  std::string outputDir;
+  std::string debugDir;
+  std::string packageFile;
+  std::string control;      /// DEBIAN/control, empty to edit a template
+  std::string deltaFrom;    /// previous package to write a delta against
+  linux::CaptureStore *installed = nullptr;   /// once staged, to clean up
+};
 
 bool IsDir(const char *dir);
 bool ParseCmdOptions(int argc, char *argv[]);
 void WatchInotifyEvents(linux::Inotify &notify,
-                        InotifyEventCollection &installed);
+                        linux::CaptureStore &installed,
+                        const std::atomic<bool> &stop);
 
 int CreateChildProcessAndWait(const std::string &command,
                               const StringArray &argv);
 
-bool InstallAndMonitorSysroot(InotifyEventCollection &installed);
-bool CopyInstalledToOutputDir(const InotifyEventCollection &installed);
-std::string CombineToFullPath(const std::string &path,
-                              const std::string &file);
-void CreateDebianPackage();
+void WatchSysroot(linux::Inotify &notify, linux::DirIndex &index,
+                  std::unique_ptr<linux::InotifyRecorder> &recorder);
+void StopRecording(std::unique_ptr<linux::InotifyRecorder> &recorder);
+void WatchCreatedDirectories(linux::Inotify &notify,
+                             linux::CaptureStore &installed);
+bool InstallAndMonitorSysroot(linux::CaptureStore &installed);
+bool CopyInstalledToOutputDir(linux::CaptureStore &installed,
+                              PackageJob &job);
+void CleanStagedItems(const PackageJob &job);
+int RunBatch();
+
+struct StagedFile {
+  std::string source;
+  std::string target;
+  std::string relative;   /// path inside the package, e.g. /usr/bin/app
+  mode_t      mode;
+  off_t       size;
+  time_t      mtime;
+  dev_t       rdev;
+};
+
+/// the trees below the installed paths, kept in stores as bounded as
+/// the captured paths.
+struct InstalledTree {
+  explicit InstalledTree(size_t budget)
+    : paths(budget), parents(budget), links(budget) { }
+
+  linux::CaptureStore paths;     /// everything to package, in sysroot
+  linux::CaptureStore parents;   /// directories above them, relative
+  linux::CaptureStore links;     /// "duplicate\0original" with --dedupe
+};
+
+/// state of walking the installed trees, a level at a time.
+struct TreeWalk {
+  linux::IoEngine          &engine;
+  InstalledTree            &tree;
+  linux::DuplicateFinder   *finder;       /// nullptr without --dedupe
+  std::string               output_dir;   /// empty to record tree.parents
+  std::vector<std::string>  covers;       /// installed directories, "dir/"
+  std::string               last_root;    /// last installed path, relative
+  std::string               made;         /// last parent made for a tree
+  size_t                    dirs;         /// staged
+};
+
+/// the --dedupe links, read along with the paths in path order.
+class LinkReader final {
+ public:
+  explicit LinkReader(linux::CaptureStore &links) : reader_(links) {
+    this->more_ = this->reader_.Next(this->link_, this->is_dir_);
+  }
+
+  /// the file path was linked to, empty if it wasn't. Paths have to be
+  /// asked for in order.
+  std::string OriginalOf(const std::string &path) {
+    while(this->more_) {
+      std::string::size_type end = this->link_.find('\0');
+      int order = this->link_.compare(0, end, path);
+      if(order > 0) break;
+      if(0 == order) return this->link_.substr(end + 1);
+      this->more_ = this->reader_.Next(this->link_, this->is_dir_);
+    }
+    return std::string();
+  }
+
+ private:
+  linux::CaptureStore::Reader reader_;
+  std::string                 link_;
+  bool                        is_dir_;
+  bool                        more_;
+};
+
+/// a staged directory, until everything below it is staged.
+struct StagedDirectory {
+  std::string prefix;   /// source with a trailing '/'
+  std::string target;
+  mode_t      mode;
+};
+
+/// state of staging the walked files, a batch at a time.
+struct Staging {
+  linux::IoEngine              &engine;
+  linux::ThreadPool            &pool;
+  const linux::ElfStripper     &stripper;
+  const std::string            &output_dir;
+  LinkReader                   &links;
+  size_t                        files;
+  std::vector<StagedDirectory>  open_dirs;
+};
+
+/// an entry of a streamed package, no source for a parent directory.
+struct StreamEntry {
+  std::string relative;
+  std::string source;
+  std::string original;   /// with --dedupe, what it is a hard link to
+};
+
+/// state of streaming a package, planning first, then writing.
+struct PackageStream {
+  linux::DebStream &deb;
+  linux::IoEngine  &engine;
+  time_t            timestamp;
+  bool              clamp;     /// no mtime after timestamp
+  bool              writing;
+  size_t            dirs;
+  size_t            files;
+};
+
+/// the installed path without sysroot, e.g. /usr/bin/app.
+std::string RelativePath(const std::string &full_installed_path);
+/// of --capture-memory, for each store besides the captured paths.
+size_t WalkBudget();
+/// dir ends in '/'. In path order, what comes after a path that is
+/// neither below dir nor sorts before it isn't below dir either.
+bool PastDirectory(const std::string &path, const std::string &dir);
+bool ForEachBatch(
+    linux::CaptureStore &store,
+    const std::function<bool(const std::vector<std::string>&)> &process);
+bool Covered(std::vector<std::string> &covers, const std::string &path);
+void AddParentDirectories(TreeWalk &walk, const std::string &path);
+bool MakeParentDirectory(TreeWalk &walk, const std::string &path);
+bool ReadCreatedDirectory(const std::string &path, linux::CaptureStore &next);
+bool WalkBatch(TreeWalk &walk, const std::vector<std::string> &batch,
+               bool installed, linux::CaptureStore &next);
+bool WalkInstalledTrees(linux::CaptureStore &installed, TreeWalk &walk);
+bool FindDuplicateFiles(linux::DuplicateFinder &finder, InstalledTree &tree);
+bool StageBatch(Staging &staging, const std::vector<std::string> &batch);
+size_t RestoreDirectoryModes(const std::vector<StagedDirectory> &dirs);
+bool StreamBatch(PackageStream &stream, const std::vector<StreamEntry> &batch);
+bool StreamEntries(PackageStream &stream, InstalledTree &tree);
+bool StreamDebianPackage(linux::CaptureStore &installed);
+void StageFile(const StagedFile &file, const linux::ElfStripper &stripper);
+bool CreateDebianPackage(const PackageJob &job);
 
 }
 
@@ -57,23 +236,15 @@ int main(int argc, char *argv[])
 {
 
   struct Cleaner {
-    InotifyEventCollection &events;
-    Cleaner(InotifyEventCollection &evs) : events(evs){ }
+    PackageJob &job;
+    Cleaner(PackageJob &j) : job(j){ }
     ~Cleaner() {
 
       if(!g_canClean || g_reserveCopied) {
         return;
       }
 
-      std::cout << "Cleaning copied items..." << std::endl;
-
-      g_CopiedItems.insert(g_CopiedItems.begin(), "-rf");
-
-      if(!g_CopiedItems.empty()) {
-        g_CopiedItems.push_back(CombineToFullPath(g_outputDir, "DEBIAN"));
-        CreateChildProcessAndWait("rm", g_CopiedItems);
-      }
-
+      CleanStagedItems(job);
     }
   };
 
@@ -81,13 +252,33 @@ int main(int argc, char *argv[])
     return 1;
   }
 
-  InotifyEventCollection installed;
-  Cleaner cleaner(installed);
+  if(!g_batchManifest.empty()) {
+    return RunBatch();
+  }
+
+  /// nothing staged, nothing to clean up.
+  if(-1 != g_streamFd) {
+    linux::CaptureStore installed(g_captureBudget);
+    return InstallAndMonitorSysroot(installed) &&
+           StreamDebianPackage(installed) ? 0 : 1;
+  }
+
+  PackageJob job;
+  job.name        = g_packageName;
+  job.outputDir   = g_outputDir;
+  job.debugDir    = g_debugDir;
+  job.packageFile = g_packageName + ".deb";
+  job.deltaFrom   = g_deltaFrom;
+  job.control     = g_control;
+
+  linux::CaptureStore installed(g_captureBudget);
+  Cleaner cleaner(job);
 
   if(InstallAndMonitorSysroot(installed) &&
-     CopyInstalledToOutputDir(installed)) {
+     CopyInstalledToOutputDir(installed, job)) {
 
-    CreateDebianPackage();
+    /// keep the staged files, so the package can be fixed by hand.
+    if(!CreateDebianPackage(job)) return 1;
   }
 
   g_canClean = true;
@@ -128,20 +319,163 @@ bool ParseCmdOptions(int argc, char *argv[]) {
 
   cmd.add(reserveArg);
 
+  TCLAP::SwitchArg stripArg(
+      "S", "strip",
+      "Off default. Strip ELF executables and shared objects while copying,"
+      " their debug sections are kept in <output>-dbg/usr/lib/debug.",
+      false);
+
+  cmd.add(stripArg);
+
+  TCLAP::SwitchArg dedupeArg(
+      "", "dedupe",
+      "Off default. Stage files with the same contents as hard links to one"
+      " copy, the package keeps them as hard links as well.",
+      false);
+
+  cmd.add(dedupeArg);
+
+  TCLAP::ValueArg<std::string> deltaFromArg(
+      "", "delta-from",
+      "The previous package. <package>.delta next to the new one rebuilds"
+      " it from the previous one with miXpkg-apply. If it doesn't exist"
+      " yet, only the new one is built, to start from. With --batch, a"
+      " directory holding <component>.deb. On its own the package is"
+      " compressed as usual, which changes all of it, so the delta is"
+      " nearly as large as the package; --delta-uncompressed and"
+      " --delta-epoch make it small, for a package several times larger.",
+      false, "", "/path/to/old.deb");
+
+  cmd.add(deltaFromArg);
+
+  TCLAP::SwitchArg deltaUncompressedArg(
+      "", "delta-uncompressed",
+      "Off default. Build the package with dpkg-deb -Znone, so unchanged"
+      " files are unchanged bytes and the --delta-from delta is small. The"
+      " package is much larger.",
+      false);
+
+  cmd.add(deltaUncompressedArg);
+
+  TCLAP::SwitchArg deltaEpochArg(
+      "", "delta-epoch",
+      "Off default. Unless SOURCE_DATE_EPOCH is set, build the package with"
+      " the timestamp of the --delta-from package, so unchanged files keep"
+      " their tar headers as well.",
+      false);
+
+  cmd.add(deltaEpochArg);
+
+  TCLAP::ValueArg<std::string> debugDirArg(
+      "", "dbg-output",
+      "The directory where --strip places the debug files, instead of <output>-dbg",
+      false, "", "/path/to/dbg");
+
+  cmd.add(debugDirArg);
+
+  TCLAP::MultiArg<std::string> includeArg(
+      "i", "include",
+      "Only watch and capture paths under sysroot matching this glob, e.g."
+      " 'usr/lib/**' or 'usr/bin/*'. May be repeated.",
+      false, "glob");
+
+  cmd.add(includeArg);
+
+  TCLAP::MultiArg<std::string> excludeArg(
+      "x", "exclude",
+      "Don't watch or capture paths under sysroot matching this glob, e.g."
+      " 'usr/share/doc' or '**/*.la'. May be repeated, wins over --include.",
+      false, "glob");
+
+  cmd.add(excludeArg);
+
+  TCLAP::ValueArg<std::string> dirIndexArg(
+      "", "dir-index",
+      "Keep an index of the sysroot directories in this file. Next time only"
+      " directories changed since are read again, which speeds up watching.",
+      false, "", "/path/to/index");
+
+  cmd.add(dirIndexArg);
+
+  TCLAP::ValueArg<std::string> batchArg(
+      "b", "batch",
+      "Build and package every component listed in this manifest, see"
+      " batch_manifest.h. Packages go to <output>/<component>.deb. Builds"
+      " run in parallel, installs one at a time: whatever is created in"
+      " sysroot during an install is packaged with it, so builds must not"
+      " write into sysroot (miXpkg warns when it sees one did).",
+      false, "", "manifest");
+
+  cmd.add(batchArg);
+
+  TCLAP::ValueArg<unsigned> jobsArg(
+      "j", "jobs",
+      "How many components --batch builds at the same time. Default is the"
+      " number of CPUs. Given, it is also the number of job slots 'make'"
+      " and miXpkg share through a jobserver, instead of the slots of the"
+      " make running miXpkg.",
+      false, 0, "jobs");
+
+  cmd.add(jobsArg);
+
+  std::vector<std::string> engines{ "auto", "uring", "threads" };
+  TCLAP::ValuesConstraint<std::string> engineNames(engines);
+  TCLAP::ValueArg<std::string> ioEngineArg(
+      "", "io-engine",
+      "How staging, cleaning up and walking sysroot do their file I/O:"
+      " io_uring, a thread pool, or auto (io_uring if the kernel has it)."
+      " Without io_uring, uring warns and uses the thread pool.",
+      false, "auto", &engineNames);
+
+  cmd.add(ioEngineArg);
+
+  TCLAP::ValueArg<unsigned> captureMemoryArg(
+      "", "capture-memory",
+      "MiB the paths created by 'make install' may take in memory, beyond"
+      " that they are spilled to a temporary file in $TMPDIR. Default 64.",
+      false, 64, "MiB");
+
+  cmd.add(captureMemoryArg);
+
+  TCLAP::ValueArg<std::string> recordArg(
+      "", "record",
+      "Record the watches and everything read from inotify during the"
+      " install into this file. miXpkg-replay ('make replay') runs it"
+      " through the event handling again.",
+      false, "", "/path/to/recording");
+
+  cmd.add(recordArg);
+
   TCLAP::ValueArg<std::string> outputArg(
       "o", "output",
       "The directory where installed files will be copied to,"
-      " and create a DEB package automatically that will be placed in <output>/../<pkg-name>.deb",
+      " and create a DEB package automatically that will be placed in <output>/../<pkg-name>.deb."
+      " '-' streams the package to stdout instead, without copying anything."
+      " The only files it writes then are the temporary ones of"
+      " --capture-memory, if the paths to package outgrow it.",
       true, ".", "/path/to/output"
       );
 
-  cmd.add(outputArg);
+  TCLAP::ValueArg<int> outputFdArg(
+      "", "output-fd",
+      "Stream the package to this open file descriptor, like -o -",
+      true, -1, "fd");
+
+  cmd.xorAdd(outputArg, outputFdArg);
+
+  TCLAP::ValueArg<std::string> controlArg(
+      "", "control",
+      "Use this file as DEBIAN/control instead of editing a template."
+      " Required when streaming. Not used with --batch.",
+      false, "", "/path/to/control");
+
+  cmd.add(controlArg);
 
   TCLAP::ValueArg<std::string> packageNameArg(
       "n",
       "pkg-name",
-      "the name of the package that will be generated",
-      true, "", "package name");
+      "the name of the package that will be generated. Required without --batch",
+      false, "", "package name");
 
   cmd.add(packageNameArg);
 
@@ -161,6 +495,72 @@ bool ParseCmdOptions(int argc, char *argv[]) {
     g_packageName   = packageNameArg.getValue();
     g_argsToMake    = toMakeArgs.getValue();
     g_reserveCopied = reserveArg.getValue();
+    g_strip         = stripArg.getValue();
+    g_dedupe        = dedupeArg.getValue();
+    g_deltaFrom     = deltaFromArg.getValue();
+    g_deltaUncompressed = deltaUncompressedArg.getValue();
+    g_deltaEpoch    = deltaEpochArg.getValue();
+    g_debugDir      = debugDirArg.getValue();
+    g_includeGlobs  = includeArg.getValue();
+    g_excludeGlobs  = excludeArg.getValue();
+    g_pathFilter    = linux::PathFilter(g_includeGlobs, g_excludeGlobs);
+    g_recordFile    = recordArg.getValue();
+    g_dirIndexFile  = dirIndexArg.getValue();
+    g_batchManifest = batchArg.getValue();
+    g_jobs          = jobsArg.getValue();
+    g_captureBudget = size_t(std::max(captureMemoryArg.getValue(), 1u)) << 20;
+
+    if(0 == g_jobs) g_jobs = std::thread::hardware_concurrency();
+    if(0 == g_jobs) g_jobs = 1;
+
+    /// share job slots with make. Like a submake given -j, -j makes us
+    /// the jobserver of our own makes, else we join the one of the make
+    /// running us, if any.
+    linux::Jobserver &jobserver = linux::Jobserver::Get();
+    const char *makeflags = getenv("MAKEFLAGS");
+    try {
+      if(jobsArg.isSet()) {
+        jobserver.Serve(g_jobs);
+      } else if(nullptr != makeflags) {
+        jobserver.Join(makeflags);
+      }
+    }
+    catch(const std::exception &ex) {
+      std::cerr << "warning: jobserver unavailable: " << ex.what()
+                << " Using -j1." << std::endl;
+      g_jobs = 1;
+      try {
+        jobserver.Serve(1);
+      }
+      catch(const std::exception&) {
+      }
+    }
+
+    /// settle 'auto' once, every user creates its own engine.
+    try {
+      g_ioEngine = linux::IoEngine::Create(ioEngineArg.getValue())->name();
+    }
+    catch(const std::system_error &ex) {
+      std::cerr << "warning: io_uring isn't available: " << ex.what()
+                << ". Using the thread pool." << std::endl;
+      g_ioEngine = "threads";
+    }
+
+    if(g_batchManifest.empty() && g_packageName.empty()) {
+      std::cerr << "error: -n/--pkg-name is required without --batch"
+                << std::endl;
+      return false;
+    }
+
+    /// an index of another sysroot, depth or other filters is stale.
+    g_dirIndexKey = "sysroot=" + g_sysrootDir + "\n" +
+                    "depth=" + std::to_string(kWatchMaxDepth) + "\n";
+    for(auto &pattern : includeArg.getValue()) {
+      g_dirIndexKey += "include=" + pattern + "\n";
+    }
+    for(auto &pattern : excludeArg.getValue()) {
+      g_dirIndexKey += "exclude=" + pattern + "\n";
+    }
 
     if(g_argsToMake.empty()) {
       g_argsToMake.push_back("install");
@@ -172,16 +572,100 @@ bool ParseCmdOptions(int argc, char *argv[]) {
       return false;
     }
 
-    if(g_outputDir != "." && !IsDir(g_outputDir.c_str())) {
+    bool stream = "-" == g_outputDir || outputFdArg.isSet();
+
+    if(!stream && g_outputDir != "." && !IsDir(g_outputDir.c_str())) {
       std::cerr << "Invalid output directory: " << g_outputDir << std::endl;
       return false;
     }
 
+    if(controlArg.isSet()) {
+      std::ifstream control_fs(controlArg.getValue());
+      std::stringstream control;
+      control << control_fs.rdbuf();
+      if(!control_fs) {
+        std::cerr << "Can't read " << controlArg.getValue() << std::endl;
+        return false;
+      }
+      g_control = control.str();
+      if(!g_control.empty() && '\n' != g_control.back()) g_control += '\n';
+    }
+
+    if(g_deltaFrom.empty() && (g_deltaUncompressed || g_deltaEpoch)) {
+      std::cerr << "error: --delta-uncompressed and --delta-epoch go with"
+                << " --delta-from" << std::endl;
+      return false;
+    }
+
+    if(!g_deltaFrom.empty() && !g_deltaUncompressed && !g_deltaEpoch) {
+      std::cerr << "warning: the package is compressed, so the delta will be"
+                << " nearly as large. --delta-uncompressed --delta-epoch"
+                << " make it small, for a larger package." << std::endl;
+    }
+
+    if(stream) {
+      if(!g_batchManifest.empty() || g_strip || !g_deltaFrom.empty()) {
+        std::cerr << "error: --batch, --strip and --delta-from need a staged"
+                  << " package, it can't be streamed" << std::endl;
+        return false;
+      }
+
+      if(!g_dirIndexFile.empty() || !g_recordFile.empty()) {
+        std::cerr << "error: --dir-index and --record write files, a"
+                  << " streamed package doesn't" << std::endl;
+        return false;
+      }
+
+      if(g_control.empty()) {
+        std::cerr << "error: streaming the package needs --control"
+                  << std::endl;
+        return false;
+      }
+
+      /// the package gets stdout to itself, everything we or make print
+      /// goes to stderr.
+      if(outputFdArg.isSet() && STDOUT_FILENO != outputFdArg.getValue()) {
+        g_streamFd = outputFdArg.getValue();
+        if(-1 == ::fcntl(g_streamFd, F_SETFD, FD_CLOEXEC)) {
+          std::cerr << "Invalid output fd " << g_streamFd << ": "
+                    << strerror(errno) << std::endl;
+          return false;
+        }
+      } else {
+        g_streamFd = ::fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+        if(-1 == g_streamFd || -1 == ::dup2(STDERR_FILENO, STDOUT_FILENO)) {
+          std::cerr << "Can't stream to stdout: " << strerror(errno)
+                    << std::endl;
+          return false;
+        }
+      }
+
+      return true;
+    }
+
+    if(!g_deltaFrom.empty()) {
+      struct stat s;
+      bool batch = !g_batchManifest.empty();
+      /// a missing package starts the chain: it's built for deltas.
+      if(batch ? 0 != ::stat(g_deltaFrom.c_str(), &s) || !S_ISDIR(s.st_mode)
+               : 0 == ::stat(g_deltaFrom.c_str(), &s) && !S_ISREG(s.st_mode)) {
+        std::cerr << "Invalid previous package"
+                  << (batch ? " directory: " : ": ") << g_deltaFrom
+                  << std::endl;
+        return false;
+      }
+    }
+
     if(g_outputDir == ".") {
       char *cwd = ::getcwd(nullptr, 0);
       g_outputDir = std::string(cwd);
       free(cwd);
     }
+
+    if(g_debugDir.empty()) {
+      std::string::size_type end = g_outputDir.find_last_not_of('/');
+      g_debugDir = g_outputDir.substr(0, end + 1) + "-dbg";
+    }
   }
   catch(TCLAP::ArgException &ex) {
     std::cerr << "error: " << ex.error() << std::endl;
@@ -196,32 +680,21 @@ bool ParseCmdOptions(int argc, char *argv[]) {
 }
 
 void WatchInotifyEvents(linux::Inotify &notify,
-                        InotifyEventCollection &installed) {
+                        linux::CaptureStore &installed,
+                        const std::atomic<bool> &stop) {
 
   try {
 
-    while(!g_stop_monitor) {
-      auto events = notify.ReadEvents(1);
-      for(auto &event : events) {
-
-        if(IN_MOVED_FROM & event.mask()) {
-          auto deleted = std::find_if(installed.begin(),
-                                      installed.end(),
-                                      [&](linux::InotifyEvent& e)->bool {
-                                        return event.file() == e.file() &&
-                                               event.dir()  == e.dir();
-                                      });
-
-          installed.erase(deleted);
-          continue;
-        }
-
-        if(IN_CREATE & event.mask()) {
-          installed.push_back(std::move(event));
-        }
+    bool drained = false;
 
-      } /// end for
+    /// after stop, read what is still queued for the finished install.
+    while(!drained) {
+      bool stopping = stop;
+      auto events = notify.ReadEvents(
+          std::chrono::milliseconds(stopping ? 0 : 100));
+      drained = stopping && events.empty();
 
+      installed.AddEvents(events);
     } // end while
 
 
@@ -235,15 +708,13 @@ void WatchInotifyEvents(linux::Inotify &notify,
 int CreateChildProcessAndWait(const std::string &command,
                               const StringArray &argv) {
 
-  char* args[32];
+  std::vector<char*> args(argv.size() + 2, nullptr);
   args[0] = const_cast<char*>(command.data());
 
-  for(StringArray::size_type i = 0; i < argv.size() && i < 32; ++i) {
+  for(StringArray::size_type i = 0; i < argv.size(); ++i) {
     args[i + 1] = const_cast<char*>(argv[i].data());
   }
 
-  args[argv.size() + 1] = nullptr;
-
 #ifdef DEBUG
   for(StringArray::size_type i = 0; i < argv.size() + 1; ++i)
     std::cout << args[i] << " ";
@@ -252,7 +723,7 @@ int CreateChildProcessAndWait(const std::string &command,
 
   pid_t child = fork();
   if(0 == child) {
-    execvp(command.c_str(), args);
+    execvp(command.c_str(), args.data());
     _exit(errno);
   }
 
@@ -350,32 +821,132 @@ char * inotifytools_event_to_str_sep(int events, char sep)
         return &ret[1];
 }
 
-bool InstallAndMonitorSysroot(InotifyEventCollection &installed) {
+void WatchSysroot(linux::Inotify &notify, linux::DirIndex &index,
+                  std::unique_ptr<linux::InotifyRecorder> &recorder) {
+
+  if(!g_pathFilter.empty()) notify.SetFilter(&g_pathFilter);
+
+  if(!g_recordFile.empty()) {
+    recorder.reset(new linux::InotifyRecorder(
+        g_recordFile, g_sysrootDir, g_includeGlobs, g_excludeGlobs));
+    notify.SetRecorder(recorder.get());
+  }
+
+  bool warm = false;
+  if(!g_dirIndexFile.empty()) {
+    warm = index.Load(g_dirIndexFile, g_dirIndexKey);
+    notify.SetDirIndex(&index);
+  }
+
+  auto engine = linux::IoEngine::Create(g_ioEngine, g_jobs);
+  notify.SetIoEngine(engine.get());
+
+  auto watch_start = std::chrono::steady_clock::now();
+
+  std::cout << std::endl;
+  notify.WatchRecursively(g_sysrootDir.c_str(), kWatchEvents, kWatchMaxDepth);
+  std::cout << std::endl;
+
+  notify.SetIoEngine(nullptr);
+
+  auto watch_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - watch_start).count();
+
+  std::cout << "Watching " << notify.GetWatchedDirCount()
+            << " directories took " << watch_ms << " ms";
+  if(!g_dirIndexFile.empty()) {
+    std::cout << " (" << (warm ? "warm" : "cold") << " start, "
+              << index.read_dirs() << " read, "
+              << index.reused_dirs() << " from index)";
+  }
+  std::cout << std::endl;
+
+  if(!g_dirIndexFile.empty()) {
+    notify.SetDirIndex(nullptr);
+
+    try {
+      index.Save(g_dirIndexFile, g_dirIndexKey);
+    }
+    catch(const std::exception &ex) {
+      std::cerr << "Can't save " << g_dirIndexFile << ": "
+                << ex.what() << std::endl;
+    }
+  }
+}
+
+void StopRecording(std::unique_ptr<linux::InotifyRecorder> &recorder) {
+
+  if(!recorder) return;
+
+  try {
+    recorder->Flush();
+    std::cout << "Recorded " << recorder->reads() << " inotify reads, "
+              << recorder->bytes() << " bytes, into " << g_recordFile
+              << std::endl;
+  }
+  catch(const std::exception &ex) {
+    std::cerr << "Can't write " << g_recordFile << ": " << ex.what()
+              << std::endl;
+  }
+}
+
+void WatchCreatedDirectories(linux::Inotify &notify,
+                             linux::CaptureStore &installed) {
+
+  installed.ForEach([&](const std::string &path, bool is_dir) {
+    if(!is_dir) return true;
+
+    std::string relative(path.begin() + g_sysrootDir.size(), path.end());
+
+    int32_t depth = std::count(relative.begin(), relative.end(), '/');
+    if(depth > kWatchMaxDepth) return true;
+
+    try {
+      notify.WatchCreatedDirectory(path, kWatchEvents, kWatchMaxDepth - depth);
+    }
+    catch(const std::exception &ex) {
+      std::cerr << "Can't watch " << path << ": " << ex.what() << std::endl;
+    }
+    return true;
+  });
+}
+
+bool InstallAndMonitorSysroot(linux::CaptureStore &installed) {
 
   try {
 
+    std::unique_ptr<linux::InotifyRecorder> recorder;
     linux::Inotify notify;
-    std::cout << std::endl;
-    notify.WatchRecursively(g_sysrootDir.c_str(), IN_CREATE | IN_MOVE , 9);
-    std::cout << std::endl;
+    linux::DirIndex index;
+    WatchSysroot(notify, index, recorder);
 
-    std::thread monitor(WatchInotifyEvents, std::ref(notify), std::ref(installed));
+    std::atomic<bool> stop(false);
+    std::thread monitor(WatchInotifyEvents, std::ref(notify),
+                        std::ref(installed), std::cref(stop));
 
     int rc = CreateChildProcessAndWait("make", g_argsToMake);
-    g_stop_monitor = true;
+    stop = true;
     monitor.join();
 
+    StopRecording(recorder);
+
     if(rc != 0) return false;
 
+    if(0 != installed.spills()) {
+      std::cout << "Captured " << installed.records() << " events, spilled "
+                << installed.spills() << " times, " << installed.spilled_bytes()
+                << " bytes" << std::endl;
+    }
+
 #ifdef DEBUG
     std::cout << "inotify fd: " << notify.GetDescriptor() << std::endl;
-    for(auto &event : installed) {
-      std::cout << "fd: " << event.wd() << "cookie: " << event.cookie() << " ---  ";
-      if(event.dir().size() > 0) std::cout << event.dir() << "/";
-      std::cout << event.file() << "   ";
-      std::cout << inotifytools_event_to_str_sep(event.mask(), ' ')
+    installed.ForEach([](const std::string &path, bool is_dir) {
+      std::cout << path << "   "
+                << inotifytools_event_to_str_sep(
+                       IN_CREATE | (is_dir ? IN_ISDIR : 0), ' ')
                 << std::endl << std::endl;
-    }
+      return true;
+    });
 #endif
 
   }
@@ -386,82 +957,628 @@ bool InstallAndMonitorSysroot(InotifyEventCollection &installed) {
   return true;
 }
 
-std::string CombineToFullPath(const std::string &path,
-                              const std::string &file) {
+std::string RelativePath(const std::string &full_installed_path) {
+
+  /// miXpkg -s /opt/sysroot
+  /// full_installed_path = /opt/sysroot/dira/dircc
+  ///                                  ^  < - >  ^   => /dira/dircc
+  return std::string(full_installed_path.begin() + g_sysrootDir.size(),
+                     full_installed_path.end());
+}
 
-  std::string new_path;
+size_t WalkBudget() {
+  return std::max<size_t>(g_captureBudget / 8, 1 << 20);
+}
 
-  if(file.size() == 0) return path;
+bool PastDirectory(const std::string &path, const std::string &dir) {
+  return 0 != path.compare(0, dir.size(), dir) && path > dir;
+}
 
-  if('/' != path.back()  && '/' != file.front()) {
-    new_path = path + "/" + file;
-  } else if('/' == path.back()  && '/' == file.front()) {
-    new_path = path;
-    new_path.append(file.begin() + 1, file.end());
-  } else {
-    new_path = path + file;
+bool ForEachBatch(
+    linux::CaptureStore &store,
+    const std::function<bool(const std::vector<std::string>&)> &process) {
+
+  std::vector<std::string> batch;
+  bool ok = true;
+
+  try {
+    store.ForEach([&](const std::string &path, bool) {
+      batch.push_back(path);
+      if(batch.size() < kInstalledBatch) return true;
+
+      ok = process(batch);
+      batch.clear();
+      return ok;
+    });
+
+    return ok && (batch.empty() || process(batch));
+  }
+  catch(const std::exception &ex) {
+    std::cerr << "Can't read the installed paths: " << ex.what()
+              << std::endl;
+    return false;
+  }
+}
+
+/// in path order, an installed path inside an installed directory comes
+/// after it and is walked with it.
+bool Covered(std::vector<std::string> &covers, const std::string &path) {
+  while(!covers.empty()) {
+    const std::string &dir = covers.back();
+    if(0 == path.compare(0, dir.size(), dir)) return true;
+    if(!PastDirectory(path, dir)) return false;
+    covers.pop_back();
+  }
+  return false;
+}
+
+void AddParentDirectories(TreeWalk &walk, const std::string &path) {
+
+  /// the previous installed path was below the same ones up to where
+  /// they part, those are recorded already.
+  std::string relative = RelativePath(path);
+  for(std::string::size_type slash = relative.find('/', 1);
+      std::string::npos != slash; slash = relative.find('/', slash + 1)) {
+    if(0 == walk.last_root.compare(0, slash + 1, relative, 0, slash + 1)) {
+      continue;
+    }
+    walk.tree.parents.AddCreated(relative.substr(0, slash), true);
+  }
+  walk.last_root = relative;
+}
+
+bool MakeParentDirectory(TreeWalk &walk, const std::string &path) {
+
+  /// the tree goes into where its parent is staged.
+  std::string target = CombineToFullPath(walk.output_dir, RelativePath(path));
+  target.resize(target.find_last_of('/'));
+  if(target == walk.made) return true;
+
+  try {
+    linux::MakeDirectories(target);
+  }
+  catch(const std::exception &ex) {
+    std::cerr << "Can't copy " << path << ": " << ex.what() << std::endl;
+    return false;
+  }
+
+  walk.made = target;
+  return true;
+}
+
+bool ReadCreatedDirectory(const std::string &path, linux::CaptureStore &next) {
+
+  std::shared_ptr<DIR> dir(opendir(path.c_str()), closedir);
+  if(!dir) {
+    std::cerr << "Can't copy " << path << ": " << std::strerror(errno)
+              << std::endl;
+    return false;
+  }
+
+  /// created directories aren't watched, filter their contents here.
+  linux::PathFilter::Cursor cursor = g_pathFilter.Enter(RelativePath(path));
+
+  struct dirent *entry = nullptr;
+  while(nullptr != (entry = readdir(dir.get()))) {
+    std::string name(entry->d_name);
+    if("." == name || ".." == name) continue;
+
+    int result = g_pathFilter.Test(cursor, entry->d_name, nullptr);
+    if(0 == result) continue;
+
+    bool is_dir = DT_DIR == entry->d_type;
+    if(DT_UNKNOWN == entry->d_type) {
+      struct stat s;
+      is_dir = 0 == fstatat(dirfd(dir.get()), entry->d_name, &s,
+                            AT_SYMLINK_NOFOLLOW) && S_ISDIR(s.st_mode);
+    }
+
+    /// a directory is staged for what may be captured below it.
+    if(is_dir || 0 != (linux::PathFilter::kCapture & result)) {
+      next.AddCreated(CombineToFullPath(path, name), is_dir);
+    }
+  }
+
+  return true;
+}
+
+bool WalkBatch(TreeWalk &walk, const std::vector<std::string> &batch,
+               bool installed, linux::CaptureStore &next) {
+
+  std::vector<struct stat> stats;
+  std::vector<int> errors;
+  walk.engine.Stat(batch, stats, errors);
+
+  bool staging = !walk.output_dir.empty();
+  std::vector<size_t> dirs;
+
+  for(size_t i = 0; i < batch.size(); ++i) {
+    const std::string &path = batch[i];
+    const struct stat &s = stats[i];
+
+    if(0 != errors[i]) {
+      std::cerr << "Can't copy " << path << ": "
+                << std::strerror(errors[i]) << std::endl;
+      return false;
+    }
+
+    bool is_dir = S_ISDIR(s.st_mode);
+
+    if(installed) {
+      if(Covered(walk.covers, path)) continue;
+      if(is_dir) walk.covers.push_back(path + "/");
+
+      if(!staging) {
+        AddParentDirectories(walk, path);
+      } else if(!MakeParentDirectory(walk, path)) {
+        return false;
+      }
+    }
+
+    walk.tree.paths.AddCreated(path, is_dir);
+
+    if(nullptr != walk.finder && S_ISREG(s.st_mode)) {
+      walk.finder->Add(path, s.st_size, s.st_mode);
+    }
+
+    if(!is_dir) continue;
+    if(!ReadCreatedDirectory(path, next)) return false;
+    dirs.push_back(i);
+  }
+
+  if(!staging) return true;
+
+  /// the directories are staged here, their parents were in the level
+  /// before. Kept writable for us until the files are in. Creating them
+  /// all before the files keeps ext4 from slowing file creation down
+  /// several times.
+  std::vector<std::string> targets;
+  std::vector<mode_t> modes;
+  for(size_t i : dirs) {
+    targets.push_back(CombineToFullPath(walk.output_dir,
+                                        RelativePath(batch[i])));
+    modes.push_back((stats[i].st_mode & 07777) | S_IRWXU);
+  }
+
+  walk.engine.MakeDirectories(targets, modes, errors);
+  walk.dirs += dirs.size();
+
+  for(size_t d = 0; d < dirs.size(); ++d) {
+    if(0 == errors[d]) continue;
+    std::cerr << "Can't copy " << batch[dirs[d]] << ": "
+              << std::strerror(errors[d]) << std::endl;
+    return false;
   }
 
-  return std::move(new_path);
+  return true;
+}
+
+bool WalkInstalledTrees(linux::CaptureStore &installed, TreeWalk &walk) {
+
+  /// a level of the trees at a time, the installed paths first.
+  std::unique_ptr<linux::CaptureStore> level, next;
+  linux::CaptureStore *current = &installed;
+
+  while(true) {
+    next.reset(new linux::CaptureStore(WalkBudget()));
+
+    bool walked = ForEachBatch(
+        *current, [&](const std::vector<std::string> &batch) {
+          return WalkBatch(walk, batch, current == &installed, *next);
+        });
+    if(!walked) return false;
+
+    if(0 == next->records()) return true;
+
+    level.swap(next);
+    current = level.get();
+  }
+}
+
+bool FindDuplicateFiles(linux::DuplicateFinder &finder, InstalledTree &tree) {
+
+  auto start = std::chrono::steady_clock::now();
+
+  try {
+    finder.Resolve([&](const std::string &duplicate,
+                       const std::string &original) {
+      tree.links.AddCreated(duplicate + '\0' + original, false);
+    });
+  }
+  catch(const std::exception &ex) {
+    std::cerr << "Can't find duplicate files: " << ex.what() << std::endl;
+    return false;
+  }
+
+  auto dedupe_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start).count();
+
+  std::cout << "Linking " << finder.duplicates() << " duplicate files, "
+            << finder.duplicate_bytes() << " bytes less to copy and compress"
+            << " (found in " << dedupe_ms << " ms)" << std::endl;
+
+  return true;
 }
 
-bool CopyInstalledToOutputDir(const InotifyEventCollection &installed) {
+bool StageBatch(Staging &staging, const std::vector<std::string> &batch) {
 
-  for(auto &entry : installed) {
+  std::vector<struct stat> stats;
+  std::vector<int> errors;
+  staging.engine.Stat(batch, stats, errors);
 
-    if(false == (IN_CREATE & entry.mask())) continue;
+  std::vector<StagedFile> files;
+  std::vector<std::pair<StagedFile, std::string> > duplicates;
+  std::vector<StagedDirectory> complete;
 
-    std::string full_installed_path =
-        CombineToFullPath(entry.dir(), entry.file());
+  /// the directories were made by the walk, sort the files out.
+  for(size_t i = 0; i < batch.size(); ++i) {
+    const std::string &path = batch[i];
+    const struct stat &s = stats[i];
 
-    /// miXpkg -s /opt/sysroot
-    /// entry.dir() = /opt/sysroot/dira/dircc
-    ///                           ^  < - >  ^   => /dira/dircc
-    std::string relative_path(full_installed_path.begin() + g_sysrootDir.size(),
-                              full_installed_path.end());
+    if(0 != errors[i]) {
+      std::cerr << "Can't copy " << path << ": "
+                << std::strerror(errors[i]) << std::endl;
+      return false;
+    }
 
     /// miXpkg -o ~/pkg
     /// =>  ~/pkg/dira/dircc
-    /// make sure has only one blash between ouput dir and relative_path
-    std::string full_output_path = CombineToFullPath(g_outputDir, relative_path);
+    std::string relative = RelativePath(path);
+    StagedFile file{ path, CombineToFullPath(staging.output_dir, relative),
+                     relative, s.st_mode, s.st_size, s.st_mtime,
+                     s.st_rdev };
+
+    /// the walk left the directories writable for us, they get their
+    /// modes back once everything below them is in, children first.
+    while(!staging.open_dirs.empty() &&
+          PastDirectory(path, staging.open_dirs.back().prefix)) {
+      complete.push_back(staging.open_dirs.back());
+      staging.open_dirs.pop_back();
+    }
 
-    /// extract ouput dir, and creat it first.
-    std::string::size_type last_blash_pos = full_output_path.find_last_of('/');
-    std::string full_output_dir(full_output_path.begin(),
-                                full_output_path.begin() + last_blash_pos);
+    if(S_ISDIR(file.mode)) {
+      staging.open_dirs.push_back(StagedDirectory{ path + "/", file.target,
+                                                   file.mode & 07777 });
+      continue;
+    }
 
-#ifdef DEBUG
-    std::cout << std::endl;
-    std::cout << "          entry.dir: " << entry.dir()         << std::endl;
-    std::cout << "         entry.file: " << entry.file()        << std::endl;
-    std::cout << "full_installed_path: " << full_installed_path << std::endl;
-    std::cout << "      relative_path: " << relative_path       << std::endl;
-    std::cout << "   full_output_path: " << full_output_path    << std::endl;
-    std::cout << "    full_output_dir: " << full_output_dir     << std::endl;
-#endif
+    /// files with the same contents are copied once and linked to it.
+    std::string original = staging.links.OriginalOf(path);
+    if(original.empty()) {
+      files.push_back(file);
+    } else {
+      duplicates.push_back(std::make_pair(
+          file, CombineToFullPath(staging.output_dir,
+                                  RelativePath(original))));
+    }
+  }
+
+  staging.files += files.size() + duplicates.size();
+
+  std::atomic<size_t> failed(0);
+
+  /// then copy them. Regular files go through the engine, ELF
+  /// files come back from it to be stripped on the way, so each staged
+  /// file is written once.
+  std::vector<linux::IoEngine::CopyRequest> requests;
+  std::vector<size_t> regular;
+  std::vector<const StagedFile*> others;
+
+  for(size_t i = 0; i < files.size(); ++i) {
+    if(S_ISREG(files[i].mode)) {
+      requests.push_back(linux::IoEngine::CopyRequest{
+          files[i].source, files[i].target, files[i].mode & 07777,
+          files[i].size });
+      regular.push_back(i);
+    } else {
+      others.push_back(&files[i]);
+    }
+  }
+
+  linux::IoEngine::Divert divert;
+  if(g_strip) {
+    divert = [](const char *head, size_t size) {
+      return size >= SELFMAG && 0 == memcmp(head, ELFMAG, SELFMAG);
+    };
+  }
+
+  staging.engine.Copy(requests, divert, errors);
+
+  for(size_t i = 0; i < requests.size(); ++i) {
+    const StagedFile &file = files[regular[i]];
+
+    if(linux::IoEngine::kDiverted == errors[i]) {
+      others.push_back(&file);
+    } else if(0 != errors[i]) {
+      std::cerr << "Can't copy " << file.source << ": "
+                << std::strerror(errors[i]) << std::endl;
+      ++failed;
+    }
+  }
+
+  staging.pool.ParallelFor(others.size(), [&](size_t i) {
+    try {
+      StageFile(*others[i], staging.stripper);
+    }
+    catch(const std::exception &ex) {
+      std::cerr << "Can't copy " << others[i]->source << ": "
+                << ex.what() << std::endl;
+      ++failed;
+    }
+  });
+
+  /// dpkg-deb's tar stores the links as hard link entries, so the
+  /// contents are compressed once as well. The original sorts first,
+  /// it is staged by now.
+  for(auto &duplicate : duplicates) {
+    const StagedFile &file = duplicate.first;
+    const std::string &linked = duplicate.second;
+
+    if(0 == ::link(linked.c_str(), file.target.c_str())) continue;
+    if(EEXIST == errno && 0 == ::unlink(file.target.c_str()) &&
+       0 == ::link(linked.c_str(), file.target.c_str())) {
+      continue;
+    }
+
+    /// the original failed, or no hard links on this file system.
+    try {
+      StageFile(file, staging.stripper);
+    }
+    catch(const std::exception &ex) {
+      std::cerr << "Can't copy " << file.source << ": "
+                << ex.what() << std::endl;
+      ++failed;
+    }
+  }
+
+  failed += RestoreDirectoryModes(complete);
+
+  return 0 == failed;
+}
+
+size_t RestoreDirectoryModes(const std::vector<StagedDirectory> &dirs) {
+
+  size_t failed = 0;
+  for(auto &dir : dirs) {
+    if(0 == ::chmod(dir.target.c_str(), dir.mode)) continue;
+
+    std::cerr << "Can't set the mode of " << dir.target << ": "
+              << std::strerror(errno) << std::endl;
+    ++failed;
+  }
+  return failed;
+}
+
+bool CopyInstalledToOutputDir(linux::CaptureStore &installed,
+                              PackageJob &job) {
+
+  job.installed = &installed;
+
+  auto start = std::chrono::steady_clock::now();
+  auto engine = linux::IoEngine::Create(g_ioEngine, g_jobs);
+  linux::ThreadPool pool;
+  linux::ElfStripper stripper(job.debugDir);
+
+  /// the trees below the installed paths are walked and staged a batch
+  /// at a time, a huge install doesn't have to be in memory at once.
+  InstalledTree tree(WalkBudget());
+  std::unique_ptr<linux::DuplicateFinder> finder;
+  if(g_dedupe) finder.reset(new linux::DuplicateFinder(pool, WalkBudget()));
+
+  TreeWalk walk{ *engine, tree, finder.get(), job.outputDir };
+  if(!WalkInstalledTrees(installed, walk)) return false;
+  if(finder && !FindDuplicateFiles(*finder, tree)) return false;
+
+  LinkReader links(tree.links);
+  Staging staging{ *engine, pool, stripper, job.outputDir, links };
+  bool staged = ForEachBatch(
+      tree.paths, [&](const std::vector<std::string> &batch) {
+        return StageBatch(staging, batch);
+      });
+
+  /// the directories still open are complete now, the deepest last.
+  std::vector<StagedDirectory> rest(staging.open_dirs.rbegin(),
+                                    staging.open_dirs.rend());
+  if(staged && 0 != RestoreDirectoryModes(rest)) staged = false;
+
+  auto staging_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start).count();
+
+  std::cout << "Staged " << staging.files << " files in " << walk.dirs
+            << " directories with " << engine->name() << " in "
+            << staging_ms << " ms" << std::endl;
+
+  return staged;
+}
+
+bool StreamBatch(PackageStream &stream, const std::vector<StreamEntry> &batch) {
+
+  std::vector<std::string> paths;
+  for(auto &entry : batch) {
+    if(!entry.source.empty()) paths.push_back(entry.source);
+  }
+
+  std::vector<struct stat> stats;
+  std::vector<int> errors;
+  stream.engine.Stat(paths, stats, errors);
+
+  linux::DebStream &deb = stream.deb;
+  size_t next = 0;
+
+  for(auto &entry : batch) {
+
+    /// above the installed paths, as dpkg-deb has them in a staged tree.
+    if(entry.source.empty()) {
+      deb.AddDirectory(entry.relative, 0755, stream.timestamp);
+      continue;
+    }
+
+    size_t i = next++;
+    const struct stat &s = stats[i];
+
+    if(0 != errors[i]) {
+      std::cerr << "Can't copy " << entry.source << ": "
+                << std::strerror(errors[i]) << std::endl;
+      return false;
+    }
+
+    time_t mtime = stream.clamp && s.st_mtime > stream.timestamp
+                       ? stream.timestamp : s.st_mtime;
+
+    if(S_ISDIR(s.st_mode)) {
+      deb.AddDirectory(entry.relative, s.st_mode & 07777, mtime);
+      if(stream.writing) ++stream.dirs;
+      continue;
+    }
+
+    if(stream.writing) ++stream.files;
+
+    if(!entry.original.empty()) {
+      deb.AddHardLink(entry.relative, RelativePath(entry.original),
+                      s.st_mode & 07777, mtime);
+    } else if(S_ISREG(s.st_mode)) {
+      deb.AddFile(entry.relative, entry.source, s.st_mode & 07777,
+                  s.st_size, mtime);
+    } else if(S_ISLNK(s.st_mode)) {
+      char link[PATH_MAX];
+      ssize_t size = ::readlink(entry.source.c_str(), link, sizeof(link));
+      if(-1 == size) {
+        std::cerr << "Can't copy " << entry.source << ": "
+                  << std::strerror(errno) << std::endl;
+        return false;
+      }
+      deb.AddSymlink(entry.relative, std::string(link, size), mtime);
+    } else if(S_ISSOCK(s.st_mode)) {
+      if(stream.writing) {
+        std::cerr << "Skipping socket " << entry.source << std::endl;
+      }
+    } else {
+      deb.AddNode(entry.relative, s.st_mode, s.st_rdev, mtime);
+    }
+  }
+
+  return true;
+}
+
+bool StreamEntries(PackageStream &stream, InstalledTree &tree) {
+
+  /// the walked paths and the directories above them, merged in path
+  /// order.
+  linux::CaptureStore::Reader paths(tree.paths), parents(tree.parents);
+  LinkReader links(tree.links);
+
+  std::string path, parent;
+  bool is_dir = false;
+  bool more_paths   = paths.Next(path, is_dir);
+  bool more_parents = parents.Next(parent, is_dir);
+
+  std::vector<StreamEntry> batch;
+
+  while(more_paths || more_parents) {
+    std::string relative = more_paths ? RelativePath(path) : std::string();
+
+    if(more_parents && (!more_paths || parent <= relative)) {
+      if(!more_paths || parent < relative) {
+        batch.push_back(StreamEntry{ parent, std::string(), std::string() });
+      }
+      more_parents = parents.Next(parent, is_dir);
+    } else {
+      batch.push_back(StreamEntry{ relative, path, links.OriginalOf(path) });
+      more_paths = paths.Next(path, is_dir);
+    }
 
-    /// first, create the ouput dir.
-    StringArray mkdirArgs{ "-p", full_output_dir};
-    CreateChildProcessAndWait("mkdir", mkdirArgs);
+    if(batch.size() < kInstalledBatch) continue;
+    if(!StreamBatch(stream, batch)) return false;
+    batch.clear();
+  }
+
+  return StreamBatch(stream, batch);
+}
+
+bool StreamDebianPackage(linux::CaptureStore &installed) {
 
-    /// second, copy to ouput dir.
-    StringArray cpArgs{ "-R", full_installed_path, full_output_path };
-    CreateChildProcessAndWait("cp", cpArgs);
-    g_CopiedItems.push_back(full_output_path);
+  auto start = std::chrono::steady_clock::now();
+  auto engine = linux::IoEngine::Create(g_ioEngine, g_jobs);
 
+  InstalledTree tree(WalkBudget());
+  std::unique_ptr<linux::ThreadPool> pool;
+  std::unique_ptr<linux::DuplicateFinder> finder;
+  if(g_dedupe) {
+    pool.reset(new linux::ThreadPool());
+    finder.reset(new linux::DuplicateFinder(*pool, WalkBudget()));
+  }
+
+  TreeWalk walk{ *engine, tree, finder.get(), std::string() };
+  if(!WalkInstalledTrees(installed, walk)) return false;
+  if(finder && !FindDuplicateFiles(*finder, tree)) return false;
+
+  /// like dpkg-deb, SOURCE_DATE_EPOCH is the package's time and no file
+  /// is newer.
+  time_t timestamp = ::time(nullptr);
+  const char *epoch = getenv("SOURCE_DATE_EPOCH");
+  if(nullptr != epoch) {
+    timestamp = static_cast<time_t>(strtoll(epoch, nullptr, 10));
+  }
+
+  linux::DebStream deb(g_streamFd, timestamp);
+  PackageStream stream{ deb, *engine, timestamp, nullptr != epoch };
+
+  uint64_t size = 0;
+  try {
+
+    /// the size of data.tar goes before it: every entry is added once
+    /// to plan the package and once more to write it.
+    if(!StreamEntries(stream, tree)) return false;
+
+    deb.Start(g_control);
+    stream.writing = true;
+    if(!StreamEntries(stream, tree)) return false;
+
+    size = deb.Finish();
+  }
+  catch(const std::exception &ex) {
+    std::cerr << "Can't stream the package: " << ex.what() << std::endl;
+    return false;
   }
 
+  std::cout << "Streamed " << size << " bytes, " << stream.files
+            << " files in " << stream.dirs << " directories, in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now() - start).count()
+            << " ms" << std::endl;
+
   return true;
 }
 
-void CreateDebianPackage() {
+void StageFile(const StagedFile &file, const linux::ElfStripper &stripper) {
+
+  if(S_ISLNK(file.mode)) {
+    linux::CopySymlink(file.source, file.target);
+    return;
+  }
+
+  if(S_ISREG(file.mode)) {
+    if(g_strip && stripper.StripTo(file.source, file.target,
+                                   file.relative, file.mode & 07777)) {
+      return;
+    }
+
+    linux::CopyRegularFile(file.source, file.target, file.mode & 07777);
+    return;
+  }
+
+  /// devices, fifos and sockets.
+  linux::CopyNode(file.target, file.mode, file.rdev);
+}
+
+bool CreateDebianPackage(const PackageJob &job) {
   int rc = 0;
 
   /// create DEBIAN directory
-  std::string debian_dir = CombineToFullPath(g_outputDir, "DEBIAN");
+  std::string debian_dir = CombineToFullPath(job.outputDir, "DEBIAN");
   StringArray mkdirArgs{ "-p", debian_dir };
   rc = CreateChildProcessAndWait("mkdir", mkdirArgs);
-  if(0 != rc) exit(1);
+  if(0 != rc) return false;
 
   /// create control file
   std::string deb_control = CombineToFullPath(debian_dir, "control");
@@ -471,55 +1588,471 @@ void CreateDebianPackage() {
     std::fstream control_fs(deb_control, std::ios::out);
     if(!control_fs) {
       std::cerr << "Can't create " << deb_control << std::endl;
-      exit(1);
+      return false;
     }
 
-    control_fs << "Package: "      << g_packageName << std::endl
-               << "Version: "      << std::endl
-               << "Section: "      << std::endl
-               << "Architecture: " << std::endl
-               << "Maintainer: "   << std::endl
-               << "Description: "  << std::endl;
+    if(!job.control.empty()) {
+      control_fs << job.control;
+    } else {
+      control_fs << "Package: "      << job.name << std::endl
+                 << "Version: "      << std::endl
+                 << "Section: "      << std::endl
+                 << "Architecture: " << std::endl
+                 << "Maintainer: "   << std::endl
+                 << "Description: "  << std::endl;
+    }
 
     control_fs.flush();
 
   }
 
-  const char *editor_env = getenv("EDITOR");
-  if(nullptr == editor_env) editor_env = "vim";
+  if(job.control.empty()) {
 
-  std::string editor(editor_env);
-  StringArray editorArgs{ deb_control };
-  rc = CreateChildProcessAndWait(editor, editorArgs);
-  if(0 != rc) {
-    std::cerr << std::endl << "Can't find vim or other editor." << std::endl
-              << "You can edit " << deb_control
-              << " manually." << std::endl
-              << "And then run 'dpkg -b " << g_outputDir << " ' to "
-              << " create DEB package for '" << g_packageName
-              << "'" << std::endl;
+    const char *editor_env = getenv("EDITOR");
+    if(nullptr == editor_env) editor_env = "vim";
+
+    std::string editor(editor_env);
+    StringArray editorArgs{ deb_control };
+    rc = CreateChildProcessAndWait(editor, editorArgs);
+    if(0 != rc) {
+      std::cerr << std::endl << "Can't find vim or other editor." << std::endl
+                << "You can edit " << deb_control
+                << " manually." << std::endl
+                << "And then run 'dpkg -b " << job.outputDir << " ' to "
+                << " create DEB package for '" << job.name
+                << "'" << std::endl;
+
+      return false;
+    }
+  }
+
+  /// rebuilding over the previous package keeps that one as .old.
+  std::string previous = job.deltaFrom;
+  struct stat old_stat, new_stat;
+  bool have_previous = !previous.empty() &&
+                       0 == ::stat(previous.c_str(), &old_stat);
+
+  if(have_previous &&
+     0 == ::stat(job.packageFile.c_str(), &new_stat) &&
+     old_stat.st_dev == new_stat.st_dev &&
+     old_stat.st_ino == new_stat.st_ino) {
+
+    previous = job.packageFile + ".old";
+    if(0 != ::rename(job.packageFile.c_str(), previous.c_str())) {
+      std::cerr << "Can't move " << job.packageFile << " to " << previous
+                << ": " << strerror(errno) << std::endl;
+      return false;
+    }
+    std::cout << "The previous package is now " << previous << std::endl;
+  }
+
+  auto dpkg_start = std::chrono::steady_clock::now();
+
+  if(previous.empty() || !(g_deltaUncompressed || g_deltaEpoch)) {
+    StringArray dpkgArgs{ "-b", job.outputDir, job.packageFile };
+    rc = CreateChildProcessAndWait("dpkg", dpkgArgs);
+  } else {
+
+    /// a small delta needs unchanged files to be unchanged bytes, asked
+    /// for: no compression, and the previous package's timestamp for the
+    /// tar headers of reinstalled files.
+    std::string epoch;
+    if(g_deltaEpoch && have_previous &&
+       nullptr == getenv("SOURCE_DATE_EPOCH")) {
+      try {
+        epoch = std::to_string(
+            static_cast<long long>(linux::PackageTimestamp(previous)));
+      }
+      catch(const std::system_error &ex) {
+        std::cerr << "Can't read " << previous << ": " << ex.what()
+                  << std::endl;
+        return false;
+      }
+    }
 
-    exit(1);
+    StringArray dpkgArgs{ "SOURCE_DATE_EPOCH=" + epoch, "dpkg-deb",
+                          "-Znone", "-b", job.outputDir, job.packageFile };
+    if(!g_deltaUncompressed) dpkgArgs.erase(dpkgArgs.begin() + 2);
+    if(epoch.empty()) dpkgArgs.erase(dpkgArgs.begin());
+
+    rc = CreateChildProcessAndWait("env", dpkgArgs);
+    if(127 == rc) rc = ENOENT;   /// env didn't find dpkg-deb
   }
 
-  StringArray dpkgArgs{ "-b", g_outputDir, g_packageName + ".deb" };
-  rc = CreateChildProcessAndWait("dpkg", dpkgArgs);
+  std::cout << "dpkg -b took "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now() - dpkg_start).count()
+            << " ms" << std::endl;
   if(0 != rc) {
 
     if(ENOENT == rc) {
       std::cerr << "Can't find dpkg command." << std::endl;
     } else {
       std::cerr << std::endl
-                << "Can't create DEB package for '" << g_packageName
+                << "Can't create DEB package for '" << job.name
                 << "'. Please fix '" << deb_control << "'"
-                << "and run 'dpkg -b " << g_outputDir << " "
-                << g_packageName + ".deb" << "' again."
+                << "and run 'dpkg -b " << job.outputDir << " "
+                << job.packageFile << "' again."
                 << std::endl;
     }
 
-    exit(1);
+    return false;
+  }
+
+  if(previous.empty()) return true;
+
+  if(!have_previous) {
+    std::cout << "No " << previous << " yet, the next package can be a"
+              << " delta against this one." << std::endl;
+    return true;
+  }
+
+  std::string delta_file = job.packageFile + ".delta";
+  auto delta_start = std::chrono::steady_clock::now();
+
+  try {
+    linux::DeltaStats stats = linux::CreateDelta(previous, job.packageFile,
+                                                 delta_file);
+    struct stat s;
+    off_t package_size = 0 == ::stat(job.packageFile.c_str(), &s) ?
+                         s.st_size : 0;
+
+    std::cout << "Wrote " << delta_file << ": " << stats.size << " bytes, "
+              << (package_size ? 100.0 * stats.size / package_size : 0.0)
+              << "% of the package (" << stats.copied << " bytes copied, "
+              << stats.patched << " patched, " << stats.inserted
+              << " new) in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(
+                     std::chrono::steady_clock::now() - delta_start).count()
+              << " ms" << std::endl;
+  }
+  catch(const std::exception &ex) {
+    std::cerr << "Can't write " << delta_file << ": " << ex.what()
+              << std::endl;
+    return false;
+  }
+
+  return true;
+}
+
+void CleanStagedItems(const PackageJob &job) {
+
+  std::cout << "Cleaning copied items..." << std::endl;
+
+  StringArray paths{ CombineToFullPath(job.outputDir, "DEBIAN") };
+
+  try {
+    auto engine = linux::IoEngine::Create(g_ioEngine, g_jobs);
+    size_t failed = 0;
+
+    /// what was staged is what was installed, a batch at a time.
+    if(nullptr != job.installed) {
+      job.installed->ForEach([&](const std::string &path, bool) {
+        paths.push_back(CombineToFullPath(
+            job.outputDir, path.substr(g_sysrootDir.size())));
+        if(paths.size() < kInstalledBatch) return true;
+
+        failed += engine->RemoveTrees(paths);
+        paths.clear();
+        return true;
+      });
+    }
+
+    failed += engine->RemoveTrees(paths);
+    if(0 != failed) {
+      std::cerr << "Can't remove " << failed << " copied items" << std::endl;
+    }
+  }
+  catch(const std::exception &ex) {
+    std::cerr << "Can't clean copied items: " << ex.what() << std::endl;
+  }
+}
+
+/// state of a --batch component while the scheduler runs it.
+struct BatchComponent {
+  enum State { kWaiting, kRunning, kInstalled, kDone, kFailed, kSkipped };
+
+  linux::Component component;
+  State             state = kWaiting;
+  double            build_sec = 0;
+  double            install_sec = 0;
+  double            package_sec = 0;
+};
+
+double SecondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+}
+
+/// build, install under capture, then stage and package. Installs are
+/// serialized on install_mutex: inotify can't tell which process
+/// created a file, so only one install may run while being captured.
+bool BuildComponent(BatchComponent &item,
+                    linux::Inotify &notify,
+                    std::mutex &install_mutex,
+                    std::function<void()> installed_callback) {
+
+  const linux::Component &component = item.component;
+
+  if(!component.build_args.empty()) {
+    auto start = std::chrono::steady_clock::now();
+
+    StringArray makeArgs{ "-C", component.dir };
+    makeArgs.insert(makeArgs.end(), component.build_args.begin(),
+                    component.build_args.end());
+
+    int rc = CreateChildProcessAndWait("make", makeArgs);
+    item.build_sec = SecondsSince(start);
+
+    if(0 != rc) {
+      std::cerr << component.name << ": build failed" << std::endl;
+      return false;
+    }
+  }
+
+  linux::CaptureStore installed(g_captureBudget);
+
+  {
+    std::lock_guard<std::mutex> lock(install_mutex);
+    auto start = std::chrono::steady_clock::now();
+
+    /// whatever concurrent builds wrote into sysroot isn't ours. Nor is
+    /// it recorded, a replay has to capture what the installs did.
+    linux::InotifyRecorder *recorder = notify.recorder();
+    notify.SetRecorder(nullptr);
+    linux::CaptureStore stray(g_captureBudget);
+    std::string written;
+    size_t writes = 0;
+    for(auto events = notify.ReadEvents(0); !events.empty();
+        events = notify.ReadEvents(0)) {
+      for(auto &event : events) {
+        if(!((IN_CREATE | IN_MOVED_TO) & event.mask())) continue;
+        if(0 == writes++) written = CombineToFullPath(event.dir(), event.file());
+      }
+      stray.AddEvents(events);
+    }
+    notify.SetRecorder(recorder);
+
+    /// the install may still put files below them.
+    WatchCreatedDirectories(notify, stray);
+
+    /// one that lands during an install is taken for part of it, and
+    /// inotify can't tell which process made it.
+    if(0 != writes) {
+      std::cerr << "warning: a build created " << written;
+      if(writes > 1) std::cerr << " and " << writes - 1 << " more";
+      std::cerr << " in sysroot. Left out of the packages now, but what a"
+                << " build creates during an install is packaged with"
+                << " that component." << std::endl;
+    }
+
+    StringArray makeArgs{ "-C", component.dir };
+    makeArgs.insert(makeArgs.end(), component.install_args.begin(),
+                    component.install_args.end());
+
+    std::atomic<bool> stop(false);
+    std::thread monitor(WatchInotifyEvents, std::ref(notify),
+                        std::ref(installed), std::cref(stop));
+
+    int rc = CreateChildProcessAndWait("make", makeArgs);
+    stop = true;
+    monitor.join();
+
+    /// so that later installs into them are seen.
+    WatchCreatedDirectories(notify, installed);
+
+    item.install_sec = SecondsSince(start);
+
+    if(0 != rc) {
+      std::cerr << component.name << ": install failed" << std::endl;
+      return false;
+    }
+  }
+
+  installed_callback();
+
+  auto start = std::chrono::steady_clock::now();
+
+  PackageJob job;
+  job.name        = component.name;
+  job.outputDir   = CombineToFullPath(g_outputDir, component.name);
+  job.debugDir    = CombineToFullPath(g_debugDir, component.name);
+  job.packageFile = job.outputDir + ".deb";
+  job.control     = "Package: " + component.name + "\n";
+  for(auto &field : component.control) {
+    job.control += field.first + ": " + field.second + "\n";
+  }
+
+  if(!g_deltaFrom.empty()) {
+    job.deltaFrom = CombineToFullPath(g_deltaFrom, component.name + ".deb");
+  }
+
+  linux::MakeDirectories(job.outputDir);
+
+  bool packaged = CopyInstalledToOutputDir(installed, job) &&
+                  CreateDebianPackage(job);
+
+  item.package_sec = SecondsSince(start);
+
+  if(packaged && !g_reserveCopied) CleanStagedItems(job);
+
+  return packaged;
+}
+
+int RunBatch() {
+
+  std::vector<BatchComponent> items;
+
+  try {
+    for(auto &component : linux::ParseManifest(g_batchManifest)) {
+      BatchComponent item;
+      item.component = component;
+      items.push_back(item);
+    }
+  }
+  catch(const std::exception &ex) {
+    std::cerr << "error: " << ex.what() << std::endl;
+    return 1;
+  }
+
+  std::map<std::string, size_t> by_name;
+  for(size_t i = 0; i < items.size(); ++i) {
+    by_name[items[i].component.name] = i;
+  }
+
+  auto batch_start = std::chrono::steady_clock::now();
+
+  std::unique_ptr<linux::InotifyRecorder> recorder;
+  linux::Inotify notify;
+  linux::DirIndex index;
+
+  try {
+    WatchSysroot(notify, index, recorder);
+  }
+  catch(const std::exception &ex) {
+    std::cerr << ex.what() << std::endl;
+    return 1;
+  }
+
+  std::mutex              mutex;
+  std::condition_variable changed;
+  std::mutex              install_mutex;
+  std::vector<std::thread> threads;
+  unsigned                running = 0;
+
+  /// this thread only schedules, its job slot goes to a component.
+  linux::Jobserver &jobserver = linux::Jobserver::Get();
+  jobserver.Lend();
+
+  std::unique_lock<std::mutex> lock(mutex);
+
+  for(;;) {
+
+    bool started = false;
+
+    for(auto &item : items) {
+      if(BatchComponent::kWaiting != item.state) continue;
+
+      bool ready = true;
+      for(auto &dependency : item.component.depends) {
+        BatchComponent::State state = items[by_name[dependency]].state;
+
+        if(BatchComponent::kFailed == state ||
+           BatchComponent::kSkipped == state) {
+          item.state = BatchComponent::kSkipped;
+          std::cerr << item.component.name << ": skipped, '" << dependency
+                    << "' failed" << std::endl;
+          break;
+        }
+
+        ready = ready && (BatchComponent::kInstalled == state ||
+                          BatchComponent::kDone == state);
+      }
+
+      if(BatchComponent::kSkipped == item.state) {
+        started = true;   /// may unblock others, look again.
+        continue;
+      }
+
+      if(!ready || running >= g_jobs) continue;
+
+      item.state = BatchComponent::kRunning;
+      ++running;
+      started = true;
+
+      BatchComponent *current = &item;
+      threads.emplace_back([&, current]() {
+        linux::Jobserver::Token token;
+        bool ok = false;
+
+        try {
+          jobserver.Acquire(token, nullptr);
+          ok = BuildComponent(*current, notify, install_mutex, [&]() {
+            std::lock_guard<std::mutex> guard(mutex);
+            current->state = BatchComponent::kInstalled;
+            changed.notify_all();
+          });
+        }
+        catch(const std::exception &ex) {
+          std::cerr << current->component.name << ": " << ex.what()
+                    << std::endl;
+        }
+
+        std::lock_guard<std::mutex> guard(mutex);
+        current->state = ok ? BatchComponent::kDone : BatchComponent::kFailed;
+        --running;
+        changed.notify_all();
+      });
+    }
+
+    if(started) continue;
+    if(0 == running) {
+      /// nothing runs and nothing can start, what's left is a cycle.
+      for(auto &item : items) {
+        if(BatchComponent::kWaiting != item.state) continue;
+        item.state = BatchComponent::kFailed;
+        std::cerr << item.component.name << ": dependency cycle" << std::endl;
+      }
+      break;
+    }
+
+    changed.wait(lock);
   }
 
+  lock.unlock();
+  for(auto &t : threads) t.join();
+  jobserver.Reclaim();
+
+  StopRecording(recorder);
+
+  int failed = 0;
+
+  std::cout << std::endl
+            << std::left  << std::setw(24) << "component"
+            << std::right << std::setw(10) << "build s"
+            << std::setw(10) << "install s"
+            << std::setw(10) << "package s"
+            << "  result" << std::endl;
+
+  for(auto &item : items) {
+    const char *result = "ok";
+    if(BatchComponent::kFailed == item.state)  result = "FAILED";
+    if(BatchComponent::kSkipped == item.state) result = "skipped";
+    if(BatchComponent::kDone != item.state) ++failed;
+
+    std::cout << std::left  << std::setw(24) << item.component.name
+              << std::right << std::fixed << std::setprecision(2)
+              << std::setw(10) << item.build_sec
+              << std::setw(10) << item.install_sec
+              << std::setw(10) << item.package_sec
+              << "  " << result << std::endl;
+  }
+
+  std::cout << items.size() - failed << "/" << items.size()
+            << " packaged in " << std::fixed << std::setprecision(2)
+            << SecondsSince(batch_start) << " s" << std::endl;
+
+  return 0 == failed ? 0 : 1;
 }
 
 
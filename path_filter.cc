@@ -0,0 +1,312 @@
+#include "path_filter.h"
+
+#include <stdexcept>
+
+namespace linux
+{
+
+namespace {
+
+size_t WordsFor(size_t states) {
+  return (states + 63) / 64;
+}
+
+}
+
+PathFilter::PathFilter() : has_includes_(false) {
+
+}
+
+PathFilter::PathFilter(const std::vector<std::string> &includes,
+                       const std::vector<std::string> &excludes)
+  : has_includes_(!includes.empty()) {
+
+  for(auto &pattern : includes) this->Compile(pattern, false);
+  for(auto &pattern : excludes) this->Compile(pattern, true);
+
+  if(this->states_.empty()) return;
+
+  const size_t words = WordsFor(this->states_.size());
+
+  this->include_states_.assign(words, 0);
+  for(uint32_t s = 0; s < this->states_.size(); ++s) {
+    if(!this->exclude_[s]) Set(this->include_states_, s);
+  }
+
+  this->include_accept_.resize(words, 0);
+  this->exclude_accept_.resize(words, 0);
+
+  /// epsilon closure of every state, computed once.
+  this->closures_.resize(this->states_.size());
+  for(uint32_t s = 0; s < this->states_.size(); ++s) {
+    std::vector<uint64_t> &closure = this->closures_[s];
+    closure.assign(words, 0);
+
+    std::vector<uint32_t> pending(1, s);
+    Set(closure, s);
+
+    while(!pending.empty()) {
+      uint32_t current = pending.back();
+      pending.pop_back();
+
+      for(uint32_t next : this->states_[current].epsilons) {
+        if(closure[next / 64] & (uint64_t(1) << (next % 64))) continue;
+        Set(closure, next);
+        pending.push_back(next);
+      }
+    }
+  }
+}
+
+uint32_t PathFilter::AddState(bool exclude) {
+  this->states_.push_back(State());
+  this->exclude_.push_back(exclude);
+  return this->states_.size() - 1;
+}
+
+void PathFilter::Set(std::vector<uint64_t> &bits, uint32_t state) {
+  if(bits.size() <= state / 64) bits.resize(state / 64 + 1, 0);
+  bits[state / 64] |= uint64_t(1) << (state % 64);
+}
+
+void PathFilter::Compile(const std::string &pattern, bool exclude) {
+
+  std::string::size_type begin = 0, end = pattern.size();
+  while(begin < end && '/' == pattern[begin]) ++begin;
+  if(end - begin >= 2 && '.' == pattern[begin] && '/' == pattern[begin + 1]) {
+    begin += 2;
+  }
+  while(end > begin && '/' == pattern[end - 1]) --end;
+
+  if(begin == end) {
+    throw std::invalid_argument("empty path pattern: '" + pattern + "'");
+  }
+
+  CharSet all, no_slash, slash;
+  all.set();
+  no_slash.set();
+  no_slash.reset('/');
+  slash.set('/');
+
+  uint32_t current = this->AddState(exclude);
+  this->starts_.push_back(current);
+
+  auto append = [&](const CharSet &on) {
+    uint32_t next = this->AddState(exclude);
+    this->states_[current].edges.push_back(Edge{ on, next });
+    current = next;
+  };
+
+  auto loop = [&](const CharSet &on) {
+    uint32_t next = this->AddState(exclude);
+    this->states_[current].edges.push_back(Edge{ on, current });
+    this->states_[current].epsilons.push_back(next);
+    current = next;
+  };
+
+  for(std::string::size_type i = begin; i < end; ++i) {
+    unsigned char c = pattern[i];
+
+    if('*' == c) {
+      bool component_start = (i == begin || '/' == pattern[i - 1]);
+      std::string::size_type stars = i;
+      while(stars < end && '*' == pattern[stars]) ++stars;
+
+      if(stars - i >= 2 && component_start && stars == end) {
+        /// trailing '**', anything below.
+        loop(all);
+      } else if(stars - i >= 2 && component_start && '/' == pattern[stars]) {
+        /// '**/', zero or more directories.
+        uint32_t inner = this->AddState(exclude);
+        this->states_[current].edges.push_back(Edge{ no_slash, inner });
+        this->states_[inner].edges.push_back(Edge{ no_slash, inner });
+        this->states_[inner].edges.push_back(Edge{ slash, current });
+
+        uint32_t next = this->AddState(exclude);
+        this->states_[current].epsilons.push_back(next);
+        current = next;
+        ++stars;
+      } else {
+        loop(no_slash);
+      }
+
+      i = stars - 1;
+      continue;
+    }
+
+    if('?' == c) {
+      append(no_slash);
+      continue;
+    }
+
+    if('[' == c) {
+      std::string::size_type j = i + 1;
+      bool negate = j < end && ('!' == pattern[j] || '^' == pattern[j]);
+      if(negate) ++j;
+
+      CharSet set;
+      std::string::size_type first = j;
+      for(; j < end && (']' != pattern[j] || j == first); ++j) {
+        unsigned char from = pattern[j];
+        unsigned char to   = from;
+        if(j + 2 < end && '-' == pattern[j + 1] && ']' != pattern[j + 2]) {
+          to = pattern[j + 2];
+          j += 2;
+        }
+        for(unsigned ch = from; ch <= to; ++ch) set.set(ch);
+      }
+
+      if(j >= end) {
+        throw std::invalid_argument("unterminated '[' in path pattern: '" +
+                                    pattern + "'");
+      }
+
+      if(negate) set.flip();
+      set.reset('/');
+
+      append(set);
+      i = j;
+      continue;
+    }
+
+    if('\\' == c && i + 1 < end) {
+      c = pattern[++i];
+    }
+
+    CharSet literal;
+    literal.set(c);
+    append(literal);
+  }
+
+  /// a matched directory matches everything below it.
+  uint32_t accept = current;
+  uint32_t below  = this->AddState(exclude);
+  this->states_[accept].edges.push_back(Edge{ slash, below });
+  this->states_[below].edges.push_back(Edge{ all, below });
+
+  std::vector<uint64_t> &accepts =
+      exclude ? this->exclude_accept_ : this->include_accept_;
+  Set(accepts, accept);
+  Set(accepts, below);
+}
+
+void PathFilter::Close(std::vector<uint64_t> &bits) const {
+
+  std::vector<uint64_t> closed(bits.size(), 0);
+
+  for(size_t w = 0; w < bits.size(); ++w) {
+    for(uint64_t word = bits[w]; word; word &= word - 1) {
+      uint32_t state = w * 64 + __builtin_ctzll(word);
+      const std::vector<uint64_t> &closure = this->closures_[state];
+      for(size_t k = 0; k < closed.size(); ++k) closed[k] |= closure[k];
+    }
+  }
+
+  bits.swap(closed);
+}
+
+bool PathFilter::Step(const std::vector<uint64_t> &from,
+                      unsigned char c,
+                      std::vector<uint64_t> &to) const {
+
+  to.assign(from.size(), 0);
+  bool alive = false;
+
+  for(size_t w = 0; w < from.size(); ++w) {
+    for(uint64_t word = from[w]; word; word &= word - 1) {
+      uint32_t state = w * 64 + __builtin_ctzll(word);
+
+      for(auto &edge : this->states_[state].edges) {
+        if(!edge.on.test(c)) continue;
+
+        const std::vector<uint64_t> &closure = this->closures_[edge.target];
+        for(size_t k = 0; k < to.size(); ++k) to[k] |= closure[k];
+        alive = true;
+      }
+    }
+  }
+
+  return alive;
+}
+
+bool PathFilter::Intersects(const std::vector<uint64_t> &bits,
+                            const std::vector<uint64_t> &mask) const {
+  for(size_t w = 0; w < bits.size(); ++w) {
+    if(bits[w] & mask[w]) return true;
+  }
+  return false;
+}
+
+PathFilter::Cursor PathFilter::Root() const {
+
+  Cursor root;
+  if(this->empty()) return root;
+
+  root.bits_.assign(WordsFor(this->states_.size()), 0);
+  for(uint32_t start : this->starts_) Set(root.bits_, start);
+  this->Close(root.bits_);
+
+  return root;
+}
+
+PathFilter::Cursor PathFilter::Enter(const std::string &relative_dir) const {
+
+  Cursor dir = this->Root();
+  if(this->empty()) return dir;
+
+  std::string::size_type begin = 0;
+  while(begin < relative_dir.size()) {
+    std::string::size_type end = relative_dir.find('/', begin);
+    if(std::string::npos == end) end = relative_dir.size();
+
+    if(end > begin) {
+      Cursor child;
+      this->Test(dir, relative_dir.substr(begin, end - begin).c_str(), &child);
+      dir.bits_.swap(child.bits_);
+    }
+
+    begin = end + 1;
+  }
+
+  return dir;
+}
+
+int PathFilter::Test(const Cursor &dir, const char *name, Cursor *child) const {
+
+  if(this->empty()) return kCapture | kDescend;
+
+  std::vector<uint64_t> current(dir.bits_), next;
+  if(current.empty()) current.assign(WordsFor(this->states_.size()), 0);
+
+  for(const char *p = name; '\0' != *p; ++p) {
+    bool alive = this->Step(current, *p, next);
+    current.swap(next);
+
+    /// nothing left that could match, or exclude.
+    if(!alive) {
+      if(nullptr != child) child->bits_ = current;
+      return this->has_includes_ ? 0 : kCapture | kDescend;
+    }
+  }
+
+  this->Step(current, '/', next);
+
+  int result = 0;
+  if(!this->Intersects(current, this->exclude_accept_)) {
+    if(!this->has_includes_ ||
+       this->Intersects(current, this->include_accept_)) {
+      result |= kCapture;
+    }
+
+    if(!this->has_includes_ ||
+       this->Intersects(next, this->include_states_)) {
+      result |= kDescend;
+    }
+  }
+
+  if(nullptr != child) child->bits_.swap(next);
+
+  return result;
+}
+
+} /// ns infra
@@ -0,0 +1,117 @@
+
+#ifndef LINUX_PATH_FILTER_H_
+#define LINUX_PATH_FILTER_H_
+
+#include <stdint.h>
+
+#include <bitset>
+#include <string>
+#include <vector>
+
+namespace linux
+{
+
+/**
+ * @brief --include/--exclude glob patterns compiled into one NFA.
+ *
+ * Patterns are relative to the watched root. '*' and '?' don't match
+ * '/', '[...]' is a character class, '**' matches across directories
+ * when it is a whole path component. A pattern that matches a
+ * directory matches everything below it too.
+ *
+ * A path is captured when it matches an include pattern (or there are
+ * none) and matches no exclude pattern.
+ *
+ * Matching is incremental: a Cursor holds the automaton state after a
+ * directory, so walking a tree or checking an event only steps through
+ * the last name.
+ */
+class PathFilter final {
+ public:
+
+  class Cursor {
+   public:
+    Cursor() { }
+
+   private:
+    friend class PathFilter;
+    std::vector<uint64_t> bits_;
+  };
+
+  enum {
+    kCapture = 1,   /// the entry itself is captured
+    kDescend = 2    /// something below the entry may be captured
+  };
+
+  /**
+   * @brief a filter that captures everything.
+   */
+  PathFilter();
+
+  /**
+   * @exception invalid_argument if a pattern is empty or malformed.
+   */
+  PathFilter(const std::vector<std::string> &includes,
+             const std::vector<std::string> &excludes);
+
+  bool empty() const { return this->states_.empty(); }
+
+  /**
+   * @brief the cursor of the root directory.
+   */
+  Cursor Root() const;
+
+  /**
+   * @brief the cursor of a directory below the root.
+   *
+   * @param relative_dir e.g. usr/lib, leading and trailing '/' are ignored.
+   */
+  Cursor Enter(const std::string &relative_dir) const;
+
+  /**
+   * @brief check the entry name inside the directory of dir.
+   *
+   * @param child if not null, receives the cursor for the entry when it
+   * is a directory.
+   *
+   * @return kCapture and/or kDescend, 0 if the entry and everything
+   * below it are filtered out.
+   */
+  int Test(const Cursor &dir, const char *name, Cursor *child) const;
+
+ private:
+  typedef std::bitset<256> CharSet;
+
+  struct Edge {
+    CharSet  on;
+    uint32_t target;
+  };
+
+  struct State {
+    std::vector<Edge>     edges;
+    std::vector<uint32_t> epsilons;
+  };
+
+  void Compile(const std::string &pattern, bool exclude);
+  uint32_t AddState(bool exclude);
+  void Close(std::vector<uint64_t> &bits) const;
+  bool Step(const std::vector<uint64_t> &from,
+            unsigned char c,
+            std::vector<uint64_t> &to) const;
+  bool Intersects(const std::vector<uint64_t> &bits,
+                  const std::vector<uint64_t> &mask) const;
+  static void Set(std::vector<uint64_t> &bits, uint32_t state);
+
+  std::vector<State>    states_;
+  std::vector<uint32_t> starts_;
+  std::vector<bool>     exclude_;        /// state belongs to an exclude pattern
+  std::vector<uint64_t> include_states_;
+  std::vector<uint64_t> include_accept_;
+  std::vector<uint64_t> exclude_accept_;
+  std::vector<std::vector<uint64_t> > closures_;
+  bool                  has_includes_;
+};
+
+} // end of linux ns
+
+#endif /* end of include guard: LINUX_PATH_FILTER_H_ */
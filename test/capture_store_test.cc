@@ -0,0 +1,208 @@
+/// Feeds CaptureStore the same records with a budget so small that every
+/// record spills, and with the default one that never does, and checks
+/// both against a plain map of how often each path exists.
+///
+///   make test
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "capture_store.h"
+
+namespace {
+
+enum Kind { kMovedAway, kCreatedFile, kCreatedDir };
+
+struct Op {
+  std::string path;
+  Kind        kind;
+};
+
+typedef std::vector<std::pair<std::string, bool> > Paths;
+
+int g_failures = 0;
+
+void Check(bool ok, const std::string &what) {
+  if(ok) return;
+  std::cerr << "FAIL: " << what << std::endl;
+  ++g_failures;
+}
+
+void Feed(linux::CaptureStore &store, const std::vector<Op> &ops) {
+  for(auto &op : ops) {
+    if(kMovedAway == op.kind) {
+      store.AddMovedAway(op.path);
+    } else {
+      store.AddCreated(op.path, kCreatedDir == op.kind);
+    }
+  }
+}
+
+Paths Collect(linux::CaptureStore &store) {
+  Paths paths;
+  store.ForEach([&](const std::string &path, bool is_dir) {
+    paths.push_back(std::make_pair(path, is_dir));
+    return true;
+  });
+  return paths;
+}
+
+/// a create is one more of the path, a move away one less, never below
+/// none; it is a directory if its latest create was.
+Paths Expect(const std::vector<Op> &ops) {
+  std::map<std::string, std::pair<int64_t, bool> > counts;
+  for(auto &op : ops) {
+    auto &count = counts[op.path];
+    if(kMovedAway == op.kind) {
+      count.first = std::max<int64_t>(count.first - 1, 0);
+    } else {
+      ++count.first;
+      count.second = kCreatedDir == op.kind;
+    }
+  }
+
+  Paths paths;
+  for(auto &count : counts) {
+    if(count.second.first > 0) {
+      paths.push_back(std::make_pair(count.first, count.second.second));
+    }
+  }
+  return paths;
+}
+
+/// the unlinked file a store in dir spilled to, found through /proc.
+bool TempFileStat(const std::string &dir, struct stat &s) {
+  DIR *fds = ::opendir("/proc/self/fd");
+  if(nullptr == fds) return false;
+
+  bool found = false;
+  while(struct dirent *entry = ::readdir(fds)) {
+    std::string fd_path = std::string("/proc/self/fd/") + entry->d_name;
+    char target[4096];
+    ssize_t size = ::readlink(fd_path.c_str(), target, sizeof(target) - 1);
+    if(size <= 0) continue;
+    target[size] = '\0';
+
+    if(0 == std::string(target).compare(0, dir.size() + 1, dir + "/") &&
+       0 == ::stat(fd_path.c_str(), &s)) {
+      found = true;
+      break;
+    }
+  }
+  ::closedir(fds);
+  return found;
+}
+
+/// every sequence of up to 5 records of a path, each on a path of its
+/// own, one record of every path per round. With a budget of 1 each
+/// record is a run, so the records of a path fold across runs and merges.
+void TestFolds(const std::string &temp_dir) {
+  std::vector<std::vector<Kind> > sequences(1);
+  for(size_t begin = 0, length = 1; length <= 5; ++length) {
+    size_t end = sequences.size();
+    for(size_t i = begin; i < end; ++i) {
+      for(Kind kind : { kMovedAway, kCreatedFile, kCreatedDir }) {
+        sequences.push_back(sequences[i]);
+        sequences.back().push_back(kind);
+      }
+    }
+    begin = end;
+  }
+
+  std::vector<Op> ops;
+  for(size_t round = 0; round < 5; ++round) {
+    for(size_t i = 0; i < sequences.size(); ++i) {
+      if(round < sequences[i].size()) {
+        ops.push_back(Op{ "/seq/" + std::to_string(i), sequences[i][round] });
+      }
+    }
+  }
+
+  linux::CaptureStore spilled(1, temp_dir), in_memory;
+  Feed(spilled, ops);
+  Feed(in_memory, ops);
+
+  Paths expected = Expect(ops);
+  Check(spilled.spills() == ops.size(), "folds: every record spilled");
+  Check(Collect(in_memory) == expected, "folds: in memory");
+  Check(Collect(spilled) == expected, "folds: spilled and merged");
+}
+
+/// random records over few paths, enough spills for merges of three
+/// levels (16^3 runs), and the space of merged runs given back.
+void TestMerges(const std::string &temp_dir) {
+  std::mt19937 random(42);
+  std::vector<Op> ops;
+  for(size_t i = 0; i < 5000; ++i) {
+    unsigned r = random();
+    ops.push_back(Op{ "/usr/lib/" + std::to_string(r % 701) + "/f",
+                      Kind((r >> 16) % 3) });
+  }
+
+  linux::CaptureStore spilled(1, temp_dir), in_memory;
+  Feed(spilled, ops);
+  Feed(in_memory, ops);
+
+  Check(spilled.spills() >= 16 * 16 * 16, "merges: three levels");
+
+  Paths expected = Expect(ops);
+  Paths paths = Collect(spilled);
+  Check(Collect(in_memory) == expected, "merges: in memory");
+  Check(paths == expected, "merges: spilled and merged");
+
+  /// what was merged is punched out, only the live runs keep blocks.
+  struct stat s;
+  Check(TempFileStat(temp_dir, s), "merges: temporary file found");
+  Check(uint64_t(s.st_size) == spilled.spilled_bytes(),
+        "merges: file holds every run written");
+  Check(uint64_t(s.st_blocks) * 512 < spilled.spilled_bytes() / 4,
+        "merges: merged runs punched out (" +
+        std::to_string(uint64_t(s.st_blocks) * 512) + " of " +
+        std::to_string(spilled.spilled_bytes()) + " bytes allocated)");
+
+  /// and it can be added to and read again.
+  ops.push_back(Op{ "/usr/lib/0/f", kCreatedDir });
+  spilled.AddCreated("/usr/lib/0/f", true);
+  Check(Collect(spilled) == Expect(ops), "merges: added after reading");
+}
+
+}
+
+int main() {
+
+  const char *tmpdir = getenv("TMPDIR");
+  std::string temp = std::string(nullptr != tmpdir && *tmpdir ? tmpdir : "/tmp") +
+                     "/capture_store_test.XXXXXX";
+  std::vector<char> name(temp.begin(), temp.end());
+  name.push_back('\0');
+  if(nullptr == ::mkdtemp(name.data())) {
+    perror(temp.c_str());
+    return 1;
+  }
+
+  try {
+    TestFolds(name.data());
+    TestMerges(name.data());
+  }
+  catch(const std::exception &ex) {
+    std::cerr << "FAIL: " << ex.what() << std::endl;
+    ++g_failures;
+  }
+
+  ::rmdir(name.data());
+
+  if(0 != g_failures) return 1;
+
+  std::cout << "capture_store_test: ok" << std::endl;
+  return 0;
+}
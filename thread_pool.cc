@@ -0,0 +1,136 @@
+#include "thread_pool.h"
+#include "jobserver.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+
+namespace linux
+{
+
+/// what the workers share while a ParallelFor() runs.
+struct ThreadPool::Job {
+  Job(size_t count, const std::function<void(size_t)> &fn, size_t helpers)
+    : count(count), fn(fn), helpers(helpers), joined(0), next(0),
+      failed(false) { }
+
+  void Run() {
+    size_t i;
+    while(!this->failed && (i = this->next++) < this->count) {
+      try {
+        this->fn(i);
+      }
+      catch(...) {
+        std::lock_guard<std::mutex> lock(this->error_mutex);
+        if(!this->error) this->error = std::current_exception();
+        this->failed = true;
+      }
+    }
+  }
+
+  /// a worker joins while there is work, on a job slot from make's
+  /// jobserver, if there is one.
+  void Help() {
+    if(this->joined++ >= this->helpers) return;
+
+    Jobserver::Token token;
+    bool acquired = false;
+
+    try {
+      acquired = Jobserver::Get().Acquire(token, [this]() {
+        return this->failed || this->next >= this->count;
+      });
+    }
+    catch(...) {
+      /// without a slot, leave the work to the others.
+    }
+
+    if(acquired) this->Run();
+  }
+
+  const size_t                        count;
+  const std::function<void(size_t)>  &fn;
+  const size_t                        helpers;   /// workers that may join
+  std::atomic<size_t>                 joined;
+  std::atomic<size_t>                 next;
+  std::atomic<bool>                   failed;
+  std::exception_ptr                  error;
+  std::mutex                          error_mutex;
+};
+
+ThreadPool::ThreadPool(unsigned threads)
+  : threads_(threads), job_(nullptr), generation_(0), busy_(0),
+    stop_(false) {
+  if(0 == this->threads_) this->threads_ = std::thread::hardware_concurrency();
+  if(0 == this->threads_) this->threads_ = 1;
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    this->stop_ = true;
+  }
+  this->wake_.notify_all();
+
+  for(auto &t : this->workers_) t.join();
+}
+
+void ThreadPool::Work() {
+  uint64_t seen = 0;
+  std::unique_lock<std::mutex> lock(this->mutex_);
+
+  for(;;) {
+    this->wake_.wait(lock, [&]() {
+      return this->stop_ || seen != this->generation_;
+    });
+    if(this->stop_) return;
+
+    seen = this->generation_;
+    Job *job = this->job_;
+
+    lock.unlock();
+    job->Help();
+    lock.lock();
+
+    if(0 == --this->busy_) this->done_.notify_all();
+  }
+}
+
+void ThreadPool::ParallelFor(size_t count,
+                             const std::function<void(size_t)> &fn) {
+
+  std::lock_guard<std::mutex> call(this->call_mutex_);
+
+  size_t helpers = std::min<size_t>(this->threads_, count);
+  if(helpers > 0) --helpers;
+
+  Job job(count, fn, helpers);
+
+  /// the calling thread works on its own job slot, the workers wait for
+  /// one while there is work.
+  if(helpers > 0) {
+    while(this->workers_.size() + 1 < this->threads_) {
+      this->workers_.emplace_back(&ThreadPool::Work, this);
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(this->mutex_);
+      this->job_ = &job;
+      this->busy_ = this->workers_.size();
+      ++this->generation_;
+    }
+    this->wake_.notify_all();
+  }
+
+  job.Run();
+
+  if(helpers > 0) {
+    std::unique_lock<std::mutex> lock(this->mutex_);
+    this->done_.wait(lock, [this]() { return 0 == this->busy_; });
+    this->job_ = nullptr;
+  }
+
+  if(job.error) std::rethrow_exception(job.error);
+}
+
+} /// ns infra
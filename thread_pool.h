@@ -0,0 +1,70 @@
+
+#ifndef LINUX_THREAD_POOL_H_
+#define LINUX_THREAD_POOL_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace linux
+{
+
+class ThreadPool final {
+ public:
+
+  /**
+   * @param threads Number of workers. 0 means one per hardware thread.
+   * They are started by the first ParallelFor() that needs them and kept
+   * until the pool is destroyed.
+   */
+  explicit ThreadPool(unsigned threads = 0);
+  ~ThreadPool();
+
+ private:
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+ public:
+
+  unsigned GetThreads() const {
+    return this->threads_;
+  }
+
+  /**
+   * @brief call fn(i) for every i in [0, count) on the workers, the
+   * calling thread works as one of them. Returns when all are done.
+   *
+   * @exception The first exception thrown by fn is rethrown after every
+   * worker has stopped. Items not started yet are skipped.
+   *
+   * Workers other than the calling thread each take a job slot from
+   * Jobserver::Get() first, so fewer may run when make is busy.
+   *
+   * Calls from several threads take turns; fn must not call it again.
+   */
+  void ParallelFor(size_t count, const std::function<void(size_t)> &fn);
+
+ private:
+  struct Job;
+
+  void Work();
+
+  unsigned                 threads_;
+  std::mutex               call_mutex_;   /// one ParallelFor() at a time
+  std::mutex               mutex_;        /// guards the members below
+  std::condition_variable  wake_;         /// a new job_, or stop_
+  std::condition_variable  done_;         /// busy_ dropped to 0
+  std::vector<std::thread> workers_;
+  Job                     *job_;
+  uint64_t                 generation_;   /// of job_, workers run each once
+  size_t                   busy_;         /// workers yet to finish job_
+  bool                     stop_;
+};
+
+} // end of linux ns
+
+#endif /* end of include guard: LINUX_THREAD_POOL_H_ */